@@ -16,250 +16,1929 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <fts.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include "common.h"
 #include "articles.h"
+#include "cache.h"
+#include "pack.h"
+#include "prefetch.h"
+#include "probes.h"
+#include "site.h"
+#include "timing.h"
 
 /* article filename format: YYYYMMDDHHmm... */
-#define ARTICLE_NAME_FORMAT "%Y%m%d%H%M"
 #define ARTICLE_NAME_MINLEN 12
+/* longest name kept in a slot of the names heap */
+#define ARTICLE_NAME_LEN NAME_MAX
+
+PROBE_SEMAPHORE(article__open)
 
 int
 is_article_name(const char *article, size_t len)
 {
 	if ((strncmp(article, "20", 2) == 0 || strncmp(article, "19", 2) == 0)
-	    && len >= ARTICLE_NAME_MINLEN)
+	    && len >= ARTICLE_NAME_MINLEN
+#ifdef ARTICLES_SHARDED
+	    /* the shard is named after YYYYMM */
+	    && strspn(article, "0123456789") >= ARCHIVE_LEN-1
+#endif
+	    )
 		return 1;
 	return 0;
 }
 
+/*
+ * Extract the date from the name of the article. This is a lot cheaper than
+ * strptime(3) and the struct tm is only normalized with mktime(3) when the
+ * date is actually displayed (see format_date() in render.c).
+ */
+static int
+parse_article_date(const char *article, struct tm *tm)
+{
+	int v[5], i, j;
+	static const int width[5] = { 4, 2, 2, 2, 2 };
+
+	for (i = 0; i < 5; ++i)
+		for (v[i] = 0, j = 0; j < width[i]; ++j, ++article) {
+			if (*article < '0' || *article > '9')
+				return -1;
+			v[i] = v[i] * 10 + *article - '0';
+		}
+	if (v[1] < 1 || v[1] > 12 || v[2] < 1 || v[2] > 31 || v[3] > 23
+	    || v[4] > 59)
+		return -1;
+	memset(tm, 0, sizeof(struct tm));
+	tm->tm_year = v[0] - 1900;
+	tm->tm_mon = v[1] - 1;
+	tm->tm_mday = v[2];
+	tm->tm_hour = v[3];
+	tm->tm_min = v[4];
+	tm->tm_isdst = -1;
+	return 0;
+}
+
 int
-read_article(const char *article, article_cb *callback)
+read_article(const char *article, article_cb *callback, void *data)
 {
 	struct article a;
 	char path[MAXPATHLEN];
 	char *buf;
 	size_t len;
 	struct article_tag *at;
-	struct stat sb;
-	extern enum STATUS status;
+	struct pack_entry pe;
+	int packed;
 
 	/* extract the date */
-	memset(&a.date, 0, sizeof(struct tm));
-	if (strptime(article, ARTICLE_NAME_FORMAT, &a.date) == NULL)
+	if (parse_article_date(article, &a.date) == -1)
 		return -1;
-	mktime(&a.date);
-	/* open the content */
-	snprintf(path, MAXPATHLEN, "%s" ARTICLES_DIR "/%s/article",
-	    status & STATUS_FROMCMD ? CHROOT_DIR : "", article);
-	if ((a.body = fopen(path, "r")) == NULL) {
-		if (errno != ENOENT)
+	TIMING_BEGIN(STAGE_ARTICLE);
+	/* the "more" and "comments" files may be added later */
+	if (cache_capturing()) {
+		article_path(path, article, NULL);
+		cache_depend(path);
+	}
+	/* open the content, from the pack if there is one */
+	article_path(path, article, "article");
+	if ((packed = pack_lookup(article, &pe) == 0) && pe.article == NULL)
+		a.body = NULL;
+	else if (packed && pe.article_len != 0) {
+		if ((a.body = fmemopen((void *)pe.article, pe.article_len,
+		    "r")) == NULL)
+			warn("fmemopen: %s", article);
+	} else {
+		CACHE_DEPEND(path);
+		TIMING_COUNT(COUNTER_OPENS, 1);
+		if ((a.body = fopen(path, "r")) == NULL && errno != ENOENT)
 			warn("fopen: %s", path);
+	}
+	PROBE2(article__open, article, a.body != NULL);
+	if (a.body == NULL) {
+		pack_release(pe.map);
+		TIMING_END(STAGE_ARTICLE);
 		return -1;
 	}
 	/* extract the title */
 	if ((buf = fgetln(a.body, &len)) == NULL && !feof(a.body)) {
 		warn("fgets: %s", path);
 		fclose(a.body);
+		pack_release(pe.map);
+		TIMING_END(STAGE_ARTICLE);
 		return -1;
 	}
 	if (callback != NULL) {
 		buf[strcspn(buf, "\n")] = '\0';
 		if ((a.title = strdup(buf)) == NULL) {
 			warn("strdup");
+			fclose(a.body);
+			pack_release(pe.map);
+			TIMING_END(STAGE_ARTICLE);
 			return -1;
 		}
-		/* open more if available */
-		snprintf(path, MAXPATHLEN, "%s" ARTICLES_DIR "/%s/more",
-		    status & STATUS_FROMCMD ? CHROOT_DIR : "", article);
-		a.more = fopen(path, "r");
-		if (a.more != NULL)
-			a.more_size = stat(path, &sb) != -1 ? sb.st_size : 0;
+		a.more = NULL;
+		a.more_map = NULL;
+		a.more_size = -1;
 		a.display_more = 0;
+		a.loaded = 0;
 		a.antispam = NULL;
 		SLIST_INIT(&a.tags);
-		SLIST_FIRST(&a.tags) = get_article_tags(article);
 		a.name = article;
-		callback(&a);
+		TIMING_END(STAGE_ARTICLE);
+		callback(&a, data);
 		free(a.title);
 		if (a.more != NULL)
 			fclose(a.more);
+		pack_release(a.more_map);
 		while (!SLIST_EMPTY(&a.tags)) {
 			at = SLIST_FIRST(&a.tags);
 			SLIST_REMOVE_HEAD(&a.tags, next);
 			free(at->name);
 			free(at);
 		}
-	}
+	} else
+		TIMING_END(STAGE_ARTICLE);
 	fclose(a.body);
+	pack_release(pe.map);
 	return 0;
 }
 
-static int
-compar_fts_name_desc(const FTSENT **f1, const FTSENT **f2)
+struct article_tag_list *
+article_tags(struct article *a)
 {
-        return strcmp((*f2)->fts_name, (*f1)->fts_name);
+	if (!(a->loaded & ARTICLE_LOADED_TAGS)) {
+		SLIST_FIRST(&a->tags) = get_article_tags(a->name);
+		a->loaded |= ARTICLE_LOADED_TAGS;
+	}
+	return &a->tags;
 }
 
-unsigned long
-read_articles(const char *tag, unsigned long offset, unsigned long number,
-    article_cb *callback)
+/* whether the article has more, and its size, without opening it */
+int
+article_has_more(struct article *a)
+{
+	char path[MAXPATHLEN];
+	struct pack_entry pe;
+	struct stat sb;
+	int packed;
+
+	if (a->loaded & ARTICLE_LOADED_SIZE)
+		return a->more_size != -1;
+	a->loaded |= ARTICLE_LOADED_SIZE;
+	TIMING_BEGIN(STAGE_ARTICLE);
+	/* an empty file is not packed, as in read_article() */
+	packed = pack_lookup(a->name, &pe) == 0;
+	if (packed && pe.more_len != 0)
+		a->more_size = pe.more_len;
+	else if (!packed || pe.more != NULL) {
+		article_path(path, a->name, "more");
+		if (stat(path, &sb) != -1) {
+			CACHE_DEPEND(path);
+			a->more_size = sb.st_size;
+		} else if (errno != ENOENT)
+			warn("stat: %s", path);
+	}
+	pack_release(pe.map);
+	TIMING_END(STAGE_ARTICLE);
+	return a->more_size != -1;
+}
+
+FILE *
+article_more(struct article *a)
 {
-	FTS *fts;
-	FTSENT *e;
 	char path[MAXPATHLEN];
-	char * const path_argv[] = { path, NULL };
-	unsigned long nb_articles, nb_skipped;
+	struct pack_entry pe;
+
+	if (a->loaded & ARTICLE_LOADED_MORE)
+		return a->more;
+	a->loaded |= ARTICLE_LOADED_MORE;
+	if (!article_has_more(a))
+		return NULL;
+	TIMING_BEGIN(STAGE_ARTICLE);
+	if (pack_lookup(a->name, &pe) == 0 && pe.more_len != 0) {
+		/* the mapping is kept until a->more is closed */
+		if ((a->more = fmemopen((void *)pe.more, pe.more_len,
+		    "r")) == NULL)
+			warn("fmemopen: %s", a->name);
+		a->more_map = pe.map;
+	} else {
+		pack_release(pe.map);
+		article_path(path, a->name, "more");
+		TIMING_COUNT(COUNTER_OPENS, 1);
+		if ((a->more = fopen(path, "r")) == NULL)
+			warn("fopen: %s", path);
+	}
+	TIMING_END(STAGE_ARTICLE);
+	return a->more;
+}
+
+/*
+ * Reader of the directories of the articles and of the tags. On Linux,
+ * getdents64(2) returns many entries per system call. The type of the
+ * entries comes from d_type, so they are not stat()ed, and the links are
+ * not followed.
+ */
+struct dir_scan {
+	int		 fd;
+#ifdef __linux__
+	long		 len, pos;
+	char		 buf[16384] __attribute__((aligned(8)));
+#else
+	DIR		*dir;
+#endif
+};
+
+#ifdef __linux__
+struct linux_dirent64 {
+	uint64_t	 d_ino;
+	int64_t		 d_off;
+	unsigned short	 d_reclen;
+	unsigned char	 d_type;
+	char		 d_name[];
+};
+#endif
+
+static int
+scan_open(struct dir_scan *ds, const char *path)
+{
+	TIMING_COUNT(COUNTER_OPENS, 1);
+	CACHE_DEPEND(path);
+#ifdef __linux__
+	ds->len = ds->pos = 0;
+	if ((ds->fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) != -1)
+		return 0;
+#else
+	if ((ds->dir = opendir(path)) != NULL) {
+		ds->fd = dirfd(ds->dir);
+		return 0;
+	}
+#endif
+	if (errno != ENOENT && errno != ENOTDIR)
+		warn("open: %s", path);
+	return -1;
+}
+
+/* the next entry but "." and "..", NULL at the end of the directory */
+static const char *
+scan_next(struct dir_scan *ds, size_t *len, unsigned char *type)
+{
+	const char *name;
+#ifdef __linux__
+	struct linux_dirent64 *d;
+#else
+	struct dirent *d;
+#endif
+
+	for (;;) {
+#ifdef __linux__
+		if (ds->pos >= ds->len) {
+			ds->len = syscall(SYS_getdents64, ds->fd, ds->buf,
+			    sizeof(ds->buf));
+			if (ds->len <= 0) {
+				if (ds->len == -1)
+					warn("getdents64");
+				return NULL;
+			}
+			ds->pos = 0;
+		}
+		d = (struct linux_dirent64 *)(ds->buf + ds->pos);
+		ds->pos += d->d_reclen;
+#else
+		if ((d = readdir(ds->dir)) == NULL)
+			return NULL;
+#endif
+		name = d->d_name;
+		if (name[0] == '.' && (name[1] == '\0'
+		    || (name[1] == '.' && name[2] == '\0')))
+			continue;
+		TIMING_COUNT(COUNTER_DIRENTS, 1);
+		*len = strlen(name);
+		*type = d->d_type;
+		return name;
+	}
+}
+
+static void
+scan_close(struct dir_scan *ds)
+{
+#ifdef __linux__
+	close(ds->fd);
+#else
+	closedir(ds->dir);
+#endif
+}
+
+/* a link or an unknown type is checked with stat(2) */
+static int
+scan_is_dir(struct dir_scan *ds, const char *name, unsigned char type)
+{
+	struct stat sb;
+
+	if (type == DT_DIR)
+		return 1;
+	if (type != DT_LNK && type != DT_UNKNOWN)
+		return 0;
+	return fstatat(ds->fd, name, &sb, 0) != -1 && S_ISDIR(sb.st_mode);
+}
+
+/*
+ * An article of ARTICLES_DIR is a directory (or a link to it), the entries
+ * of a tag may be anything.
+ */
+static int
+scan_is_article(const char *name, size_t len, unsigned char type, int dirs)
+{
+	if (!is_article_name(name, len))
+		return 0;
+	return !dirs || type == DT_DIR || type == DT_LNK || type == DT_UNKNOWN;
+}
+
+static void
+list_path(char *path, const char *tag)
+{
 	extern enum STATUS status;
 
-	nb_articles = 0;
 	if (tag != NULL)
 		snprintf(path, MAXPATHLEN, "%s" TAGS_DIR "/%s",
 		    status & STATUS_FROMCMD ? CHROOT_DIR : "", tag);
 	else
 		snprintf(path, MAXPATHLEN, "%s" ARTICLES_DIR,
 		    status & STATUS_FROMCMD ? CHROOT_DIR : "");
-	if ((fts = fts_open(path_argv, FTS_LOGICAL|FTS_NOSTAT,
-	    compar_fts_name_desc)) == NULL) {
-		warn("fts_open: %s", path);
-		return 0;
-	} else if ((e = fts_read(fts)) == NULL || !(e->fts_info & FTS_D)) {
-		if (errno != ENOENT)
-			warn("fts_read: %s", path);
-		goto out;
-	} else if ((e = fts_children(fts, 0)) == NULL) {
-		if (errno != 0)
-			warn("fts_children: %s", path);
-		goto out;
+}
+
+/*
+ * The path of name in ARTICLES_DIR, or of its year, of its month or of
+ * itself in its month, by depth.
+ */
+static void
+shard_path(char *path, const char *name, int depth)
+{
+	extern enum STATUS status;
+
+	switch (depth) {
+	case 1:
+		snprintf(path, MAXPATHLEN, "%s" ARTICLES_DIR "/%.4s",
+		    status & STATUS_FROMCMD ? CHROOT_DIR : "", name);
+		break;
+	case 2:
+		snprintf(path, MAXPATHLEN, "%s" ARTICLES_DIR "/%.4s/%.2s",
+		    status & STATUS_FROMCMD ? CHROOT_DIR : "", name, name + 4);
+		break;
+	case 3:
+		snprintf(path, MAXPATHLEN, "%s" ARTICLES_DIR "/%.4s/%.2s/%s",
+		    status & STATUS_FROMCMD ? CHROOT_DIR : "", name, name + 4,
+		    name);
+		break;
+	default:
+		snprintf(path, MAXPATHLEN, "%s" ARTICLES_DIR "/%s",
+		    status & STATUS_FROMCMD ? CHROOT_DIR : "", name);
 	}
-	if (number == 0)
-		number = ULONG_MAX;
-	for (nb_skipped = 0; e != NULL && nb_articles < number;
-	    e = e->fts_link) {
-		if (is_article_name(e->fts_name, e->fts_namelen)) {
-			if (nb_skipped < offset) {
-				if (read_article(e->fts_name, NULL) != -1)
-					++nb_skipped;
-				continue;
+}
+
+/*
+ * The directory of an article, or one of its files if file is not NULL.
+ * With ARTICLES_SHARDED, it is in ARTICLES_DIR/YYYY/MM.
+ */
+void
+article_path(char *path, const char *article, const char *file)
+{
+	extern enum STATUS status;
+
+#ifdef ARTICLES_SHARDED
+	snprintf(path, MAXPATHLEN, "%s" ARTICLES_DIR "/%.4s/%.2s/%s%s%s",
+	    status & STATUS_FROMCMD ? CHROOT_DIR : "", article, article + 4,
+	    article, file != NULL ? "/" : "", file != NULL ? file : "");
+#else
+	snprintf(path, MAXPATHLEN, "%s" ARTICLES_DIR "/%s%s%s",
+	    status & STATUS_FROMCMD ? CHROOT_DIR : "", article,
+	    file != NULL ? "/" : "", file != NULL ? file : "");
+#endif
+}
+
+/*
+ * The names read by the scans, as offsets in a buffer. Without a limit, the
+ * buffer grows with each name. With a limit, each name has a slot of
+ * ARTICLE_NAME_LEN+1 bytes, and the oldest kept name is at the top of a heap
+ * and is overwritten in its slot by each newer one. With a cursor, only the
+ * names older than its article are kept, or those newer than it, and then
+ * the heap is reversed to keep the oldest ones.
+ */
+struct cursor {
+	const char	*article;
+	int		 before;
+	unsigned long	 nb;		/* names on its side */
+};
+
+struct names {
+	char		*buf;
+	size_t		 len, size;
+	size_t		*heap;
+	unsigned long	 nb, size_heap;
+	struct cursor	*cursor;
+};
+
+#define NAME(n, i)	((n)->buf + (n)->heap[i])
+#define NAME_SLOT	(ARTICLE_NAME_LEN + 1)
+
+static int
+names_add(struct names *n, const char *name, size_t len, size_t *off)
+{
+	char *buf;
+
+	if (n->len + len + 1 > n->size) {
+		n->size = MAX(n->size * 2, n->len + len + 1 + 1024);
+		if ((buf = realloc(n->buf, n->size)) == NULL) {
+			warn("realloc");
+			return -1;
+		}
+		n->buf = buf;
+	}
+	memcpy(n->buf + n->len, name, len + 1);
+	*off = n->len;
+	n->len += len + 1;
+	return 0;
+}
+
+static int
+names_push(struct names *n, const char *name, size_t len, unsigned long limit)
+{
+	size_t *heap;
+	char *buf;
+
+	if (n->nb == n->size_heap) {
+		n->size_heap = n->size_heap != 0 ? n->size_heap * 2 : 64;
+		if (limit != 0)
+			n->size_heap = MIN(n->size_heap, limit);
+		if ((heap = realloc(n->heap, n->size_heap * sizeof(size_t)))
+		    == NULL) {
+			warn("realloc");
+			return -1;
+		}
+		n->heap = heap;
+		if (limit != 0) {
+			n->size = n->size_heap * NAME_SLOT;
+			if ((buf = realloc(n->buf, n->size)) == NULL) {
+				warn("realloc");
+				return -1;
 			}
-			read_article(e->fts_name, callback);
-			++nb_articles;
+			n->buf = buf;
 		}
 	}
-out:	fts_close(fts);
-	return nb_articles;
+	if (limit == 0)
+		return names_add(n, name, len, &n->heap[n->nb++]);
+	n->heap[n->nb] = n->nb * NAME_SLOT;
+	memcpy(n->buf + n->heap[n->nb++], name, len + 1);
+	return 0;
 }
 
-struct article_tag *
-get_article_tags(const char *article)
+/* the top of the heap is the oldest name, or the newest one if reversed */
+static int
+heap_cmp(struct names *n, const char *n1, const char *n2)
 {
-	FTS *fts;
-	FTSENT *e;
-	char path[MAXPATHLEN];
-	char * const path_argv[] = { path, NULL };
-	char *tag;
-	struct article_tag *at;
-	SLIST_HEAD(, article_tag) list;
-	unsigned long number;
-	int index;
-	extern enum STATUS status;
+	if (n->cursor != NULL && n->cursor->before)
+		return strcmp(n2, n1);
+	return strcmp(n1, n2);
+}
 
-	SLIST_INIT(&list);
-	index = 0;
-	snprintf(path, MAXPATHLEN, "%s" TAGS_DIR,
-	    status & STATUS_FROMCMD ? CHROOT_DIR : "");
-again:	if ((fts = fts_open(path_argv, FTS_LOGICAL|FTS_NOSTAT,
-	    compar_fts_name_desc)) == NULL) {
-		warn("fts_open: %s", path);
-		return NULL;
-	} else if ((e = fts_read(fts)) == NULL || !(e->fts_info & FTS_D)) {
-		if (errno != ENOENT)
-			warn("fts_read: %s", path);
-		goto out;
+static void
+heap_down(struct names *n, unsigned long i)
+{
+	unsigned long c;
+	size_t tmp;
+
+	for (; (c = 2*i + 1) < n->nb; i = c) {
+		if (c + 1 < n->nb && heap_cmp(n, NAME(n, c+1), NAME(n, c)) < 0)
+			++c;
+		if (heap_cmp(n, NAME(n, i), NAME(n, c)) <= 0)
+			break;
+		tmp = n->heap[i];
+		n->heap[i] = n->heap[c];
+		n->heap[c] = tmp;
 	}
-	number = 0;
-	for (; (e = fts_read(fts)) != NULL;) {
-		tag = NULL;
-		if (article != NULL) {
-			if (e->fts_level == (2 - index)) {
-				if (e->fts_info & FTS_D) {
-					fts_set(fts, e, FTS_SKIP);
-					fts_read(fts);
-				}
-				++number;
-				if (strcmp(e->fts_name, article) == 0)
-					tag = e->fts_parent->fts_name;
-			} else
-				number = 0;
-		} else if (e->fts_info & FTS_D) {
-			if (e->fts_level == 1)
-				fts_set(fts, e, FTS_SKIP);
-			tag = e->fts_name;
+}
+
+static void
+heap_up(struct names *n, unsigned long i)
+{
+	unsigned long p;
+	size_t tmp;
+
+	for (; i > 0 && heap_cmp(n, NAME(n, (p = (i-1)/2)), NAME(n, i)) > 0;
+	    i = p) {
+		tmp = n->heap[i];
+		n->heap[i] = n->heap[p];
+		n->heap[p] = tmp;
+	}
+}
+
+static int
+compar_name_desc(const void *n1, const void *n2)
+{
+	return strcmp(*(char * const *)n2, *(char * const *)n1);
+}
+
+/*
+ * Keep a name, or only the limit newest ones if limit is not 0 (the oldest
+ * ones before a cursor).
+ */
+static int
+names_offer(struct names *n, const char *name, size_t len, unsigned long limit)
+{
+	int cmp;
+
+	if (n->cursor != NULL) {
+		cmp = strcmp(name, n->cursor->article);
+		if (n->cursor->before ? cmp <= 0 : cmp >= 0)
+			return 0;
+		++n->cursor->nb;
+	}
+	if (limit != 0 && len > ARTICLE_NAME_LEN)
+		return 0;
+	if (limit == 0 || n->nb < limit) {
+		if (names_push(n, name, len, limit) == -1)
+			return -1;
+		if (limit != 0)
+			heap_up(n, n->nb - 1);
+	} else if (heap_cmp(n, name, NAME(n, 0)) > 0) {
+		/* overwrite the name at the top of the heap */
+		memcpy(NAME(n, 0), name, len + 1);
+		heap_down(n, 0);
+	}
+	return 0;
+}
+
+/* the names kept, newest first */
+static int
+names_list(struct names *n, unsigned long limit, struct article_list *list)
+{
+	unsigned long i;
+	size_t len;
+	char *s;
+
+	list->names = NULL;
+	list->nb = 0;
+	if (n->nb == 0)
+		return 0;
+	/* the array of pointers and the names are allocated at once */
+	for (i = 0, len = 0; i < n->nb; ++i)
+		len += strlen(NAME(n, i)) + 1;
+	if ((list->names = malloc(n->nb * sizeof(char *) + len)) == NULL) {
+		warn("malloc");
+		return -1;
+	}
+	s = (char *)(list->names + n->nb);
+	list->nb = n->nb;
+	if (limit != 0) {
+		/*
+		 * The oldest is at the top of the heap, fill from the end, or
+		 * from the start if the heap is reversed.
+		 */
+		while (n->nb > 0) {
+			i = n->nb - 1;
+			if (n->cursor != NULL && n->cursor->before)
+				i = list->nb - n->nb;
+			len = strlen(NAME(n, 0)) + 1;
+			memcpy(s, NAME(n, 0), len);
+			list->names[i] = s;
+			s += len;
+			n->heap[0] = n->heap[--n->nb];
+			heap_down(n, 0);
+		}
+	} else {
+		for (i = 0; i < n->nb; ++i) {
+			len = strlen(NAME(n, i)) + 1;
+			memcpy(s, NAME(n, i), len);
+			list->names[i] = s;
+			s += len;
+		}
+		qsort(list->names, list->nb, sizeof(char *),
+		    compar_name_desc);
+	}
+	return 0;
+}
+
+static void
+names_free(struct names *n)
+{
+	free(n->buf);
+	free(n->heap);
+	memset(n, 0, sizeof(*n));
+}
+
+#ifdef ARTICLES_SHARDED
+/* the shards of a directory (YYYY or MM, by their length), newest first */
+static int
+scan_shards(const char *path, size_t digits, struct article_list *list)
+{
+	struct dir_scan ds;
+	struct names n;
+	const char *name;
+	unsigned char type;
+	size_t len;
+	int ret;
+
+	list->names = NULL;
+	list->nb = 0;
+	if (scan_open(&ds, path) == -1)
+		return 0;
+	memset(&n, 0, sizeof(n));
+	ret = 0;
+	while ((name = scan_next(&ds, &len, &type)) != NULL)
+		if (len == digits && strspn(name, "0123456789") == len
+		    && scan_is_dir(&ds, name, type)
+		    && (ret = names_push(&n, name, len, 0)) == -1)
+			break;
+	scan_close(&ds);
+	if (ret == 0)
+		ret = names_list(&n, 0, list);
+	names_free(&n);
+	return ret;
+}
+
+/*
+ * Walk through the months of ARTICLES_DIR, newest first, or only those of
+ * a period (YYYY or YYYYMM) if it is not NULL.
+ */
+struct shard_walk {
+	char			 path[MAXPATHLEN];	/* of the month */
+	char			 prefix[ARCHIVE_LEN];	/* YYYYMM */
+	const char		*period;
+	struct article_list	 years, months;
+	unsigned long		 year, month;
+};
+
+static void
+shard_walk_begin(struct shard_walk *w, const char *period)
+{
+	memset(w, 0, sizeof(*w));
+	w->period = period;
+	list_path(w->path, NULL);
+	scan_shards(w->path, 4, &w->years);
+}
+
+static int
+shard_next(struct shard_walk *w)
+{
+	char path[MAXPATHLEN];
+	const char *y, *m;
+
+	for (;;) {
+		if (w->month < w->months.nb) {
+			y = w->years.names[w->year-1];
+			m = w->months.names[w->month++];
+			if (w->period != NULL && w->period[4] != '\0'
+			    && strncmp(m, w->period + 4, 2) != 0)
+				continue;
+			snprintf(w->prefix, ARCHIVE_LEN, "%s%s", y, m);
+			shard_path(w->path, w->prefix, 2);
+			return 0;
 		}
-		if (tag == NULL)
+		free_article_list(&w->months);
+		w->month = 0;
+		if (w->year >= w->years.nb)
+			return -1;
+		y = w->years.names[w->year++];
+		if (w->period != NULL && strncmp(y, w->period, 4) != 0)
 			continue;
-		if ((at = malloc(sizeof(struct article_tag))) == NULL) {
-			warn("malloc");
+		shard_path(path, y, 1);
+		scan_shards(path, 2, &w->months);
+	}
+}
+
+static void
+shard_walk_end(struct shard_walk *w)
+{
+	free_article_list(&w->years);
+	free_article_list(&w->months);
+}
+
+/*
+ * The names of the articles of the shards, newest first. The months are
+ * read from the newest one, so with a limit, and without total, the walk
+ * stops at the first month after the limit is reached. The older months
+ * are otherwise only counted.
+ */
+static int
+scan_index(const char *period, struct cursor *c, unsigned long limit,
+    struct article_list *list, unsigned long *total)
+{
+	struct shard_walk w;
+	struct dir_scan ds;
+	struct names n;
+	const char *name;
+	unsigned char type;
+	unsigned long nb;
+	size_t len;
+	int ret;
+
+	TIMING_BEGIN(STAGE_LIST);
+	memset(&n, 0, sizeof(n));
+	n.cursor = c;
+	ret = 0;
+	nb = 0;
+	shard_walk_begin(&w, period);
+	while (ret == 0 && shard_next(&w) == 0) {
+		if (limit != 0 && n.nb == limit && total == NULL && c == NULL)
+			break;
+		if (scan_open(&ds, w.path) == -1)
 			continue;
-		}
-		if (index == 0) {
-			if ((at->name = strdup(tag)) == NULL) {
-				warn("strdup");
-				free(at);
+		while ((name = scan_next(&ds, &len, &type)) != NULL) {
+			if (!scan_is_article(name, len, type, 1)
+			    || strncmp(name, w.prefix, ARCHIVE_LEN-1) != 0)
 				continue;
-			}
-		} else
-			at->name = NULL;
-		at->number = number;
-		SLIST_INSERT_HEAD(&list, at, next);
+			++nb;
+			if ((ret = names_offer(&n, name, len, limit)) == -1)
+				break;
+		}
+		scan_close(&ds);
 	}
-	/* try again to get the articles number in the index */
-	if (article != NULL && index == 0) {
-		index = 1;
-		snprintf(path, MAXPATHLEN, "%s" ARTICLES_DIR,
-		     status & STATUS_FROMCMD ? CHROOT_DIR : "");
-		goto again;
+	shard_walk_end(&w);
+	if (total != NULL)
+		*total = nb;
+	if (ret == 0)
+		ret = names_list(&n, limit, list);
+	else {
+		list->names = NULL;
+		list->nb = 0;
 	}
-out:	fts_close(fts);
-	return SLIST_FIRST(&list);
+	names_free(&n);
+	TIMING_END(STAGE_LIST);
+	return ret;
 }
+#endif
 
-int
-read_tag(const char *tag, unsigned long page, unsigned long number,
-    tag_cb *callback)
+/*
+ * List the names of the articles of a tag (or of the index if tag is NULL),
+ * newest first. Only the directory is read, the articles are not opened.
+ * If limit is not 0, only the limit newest names are kept, selected with a
+ * heap instead of sorting the whole directory. total is set to the number
+ * of articles of the directory. The index is read from the pack if there
+ * is one. With a cursor, only the names on its side are kept, and counted.
+ */
+static int
+scan_articles(const char *tag, struct cursor *c, unsigned long limit,
+    struct article_list *list, unsigned long *total)
 {
-	struct tag t;
-	unsigned long nb_articles;
+	char path[MAXPATHLEN];
+	struct dir_scan ds;
+	struct names n;
+	const char *name;
+	unsigned char type;
+	unsigned long nb, first, newer;
+	size_t len;
+	int ret, found;
 
-	if ((nb_articles = read_articles(tag, 0, 0, NULL)) == 0)
-		if (tag != NULL || page != 0)
-			return -1;
-	t.pages = nb_articles/number + (nb_articles%number != 0 ? 1 : 0);
-	if (page > t.pages-1) {
-		if (tag != NULL || page != 0)
+	if (tag == NULL && c == NULL && pack_list(0, limit, list, total) == 0)
+		return 0;
+	/* the names of the pack are sorted, the cursor is found by search */
+	if (tag == NULL && c != NULL
+	    && (found = pack_search(c->article, &newer)) != -1) {
+		if (c->before) {
+			c->nb = newer;
+			first = limit != 0 && newer > limit ? newer - limit : 0;
+			/* nothing is newer, the list is empty */
+			if ((limit = newer - first) == 0)
+				first = ULONG_MAX;
+		} else
+			first = newer + found;
+		if (pack_list(first, limit, list, &nb) == -1)
 			return -1;
+		if (!c->before)
+			c->nb = nb > first ? nb - first : 0;
+		if (total != NULL)
+			*total = nb;
+		return 0;
 	}
-	t.next = (page != t.pages-1);
-	t.previous = (page > 0);
-	if (page && number > ULONG_MAX / page)
-		if (tag != NULL || page != 0)
-			return -1;
-	t.offset = page != 0 ? page * number : 0;
-	if (callback != NULL) {
-		t.name = tag;
-		t.page = page;
-		t.number = number;
-		callback(&t);
+#ifdef ARTICLES_SHARDED
+	if (tag == NULL)
+		return scan_index(NULL, c, limit, list, total);
+#endif
+	list->names = NULL;
+	list->nb = 0;
+	if (total != NULL)
+		*total = 0;
+	list_path(path, tag);
+	TIMING_BEGIN(STAGE_LIST);
+	if (scan_open(&ds, path) == -1) {
+		TIMING_END(STAGE_LIST);
+		return 0;
+	}
+	memset(&n, 0, sizeof(n));
+	n.cursor = c;
+	ret = 0;
+	nb = 0;
+	while ((name = scan_next(&ds, &len, &type)) != NULL) {
+		if (!scan_is_article(name, len, type, tag == NULL))
+			continue;
+		++nb;
+		if ((ret = names_offer(&n, name, len, limit)) == -1)
+			break;
+	}
+	scan_close(&ds);
+	if (total != NULL)
+		*total = nb;
+	if (ret == 0)
+		ret = names_list(&n, limit, list);
+	names_free(&n);
+	TIMING_END(STAGE_LIST);
+	return ret;
+}
+
+/*
+ * Count the articles of a directory, and those not older than article. In
+ * a shard, only the names beginning with its prefix (YYYYMM) are counted.
+ */
+static void
+count_dir(const char *path, int dirs, const char *prefix, const char *article,
+    unsigned long *nb, unsigned long *newer, int *found)
+{
+	struct dir_scan ds;
+	const char *name;
+	unsigned char type;
+	size_t len;
+	int cmp;
+
+	if (scan_open(&ds, path) == -1)
+		return;
+	while ((name = scan_next(&ds, &len, &type)) != NULL) {
+		if (!scan_is_article(name, len, type, dirs) || (prefix != NULL
+		    && strncmp(name, prefix, ARCHIVE_LEN-1) != 0))
+			continue;
+		++*nb;
+		if (article != NULL && (cmp = strcmp(name, article)) >= 0) {
+			++*newer;
+			if (cmp == 0)
+				*found = 1;
+		}
+	}
+	scan_close(&ds);
+}
+
+/*
+ * Number of articles of a tag (or of the index) and, if article is not
+ * NULL, the position of the article in the list (0 if it is not there).
+ * Nothing is allocated and nothing is sorted, and no article is opened:
+ * like the lists from which the pages are read (see read_page_articles()),
+ * the count includes the entries without an "article" file, such as a
+ * draft, which are skipped when a page is rendered. With ARTICLES_SHARDED,
+ * the position of an article in the index only needs the months down to
+ * its own, the older ones are then not counted.
+ */
+static unsigned long
+count_articles(const char *tag, const char *article, unsigned long *number)
+{
+	char path[MAXPATHLEN];
+	struct article_list l;
+#ifdef ARTICLES_SHARDED
+	struct shard_walk w;
+#endif
+	unsigned long nb, newer;
+	int found;
+
+	if (number != NULL)
+		*number = 0;
+	if (site_list(tag, &l) == 0) {
+		if (article != NULL && number != NULL) {
+			newer = article_list_search(&l, article);
+			if (newer > 0 && strcmp(l.names[newer-1], article) == 0)
+				*number = newer;
+		}
+		return l.nb;
+	}
+	if (tag == NULL && pack_count(article, &nb, number) == 0)
+		return nb;
+	nb = newer = 0;
+	found = 0;
+#ifdef ARTICLES_SHARDED
+	if (tag == NULL) {
+		shard_walk_begin(&w, NULL);
+		while (shard_next(&w) == 0) {
+			if (number != NULL && article != NULL
+			    && strncmp(w.prefix, article, ARCHIVE_LEN-1) < 0)
+				break;
+			count_dir(w.path, 1, w.prefix, article, &nb, &newer,
+			    &found);
+		}
+		shard_walk_end(&w);
+	} else
+#endif
+	{
+		list_path(path, tag);
+		count_dir(path, tag == NULL, NULL, article, &nb, &newer,
+		    &found);
 	}
+	if (found && number != NULL)
+		*number = newer;
+	return nb;
+}
+
+/*
+ * Read number articles (0 for all) of a tag or of the index, from the
+ * offset-th entry of its list, and return how many entries were read. As
+ * for the pages, an entry which cannot be read, such as a draft, takes its
+ * place in the list and in the count (see count_articles()).
+ */
+unsigned long
+read_articles(const char *tag, unsigned long offset, unsigned long number,
+    article_cb *callback, void *data)
+{
+	struct article_list list;
+	unsigned long nb_articles, i;
+	int owned;
+
+	if (number == 0)
+		number = ULONG_MAX;
+	/* only the number of articles is wanted */
+	if (callback == NULL) {
+		nb_articles = count_articles(tag, NULL, NULL);
+		return nb_articles > offset ?
+		    MIN(nb_articles - offset, number) : 0;
+	}
+	if (site_list(tag, &list) == 0)
+		owned = 0;
+	else {
+		owned = 1;
+		if (scan_articles(tag, NULL, number <= ULONG_MAX - offset ?
+		    offset + number : 0, &list, NULL) == -1)
+			return 0;
+	}
+#ifdef PREFETCH_ARTICLES
+	if (callback != NULL && offset < list.nb && number != ULONG_MAX)
+		prefetch_articles(list.names + offset,
+		    MIN(number, list.nb - offset));
+#endif
+	nb_articles = 0;
+	for (i = offset; i < list.nb && nb_articles < number; ++i) {
+		read_article(list.names[i], callback, data);
+		++nb_articles;
+	}
+	if (owned)
+		free_article_list(&list);
+	return nb_articles;
+}
+
+static struct article_tag *
+add_article_tag(struct article_tag *list, const char *tag,
+    unsigned long number)
+{
+	struct article_tag *at;
+
+	if ((at = malloc(sizeof(struct article_tag))) == NULL) {
+		warn("malloc");
+		return list;
+	}
+	at->name = NULL;
+	if (tag != NULL && (at->name = strdup(tag)) == NULL) {
+		warn("strdup");
+		free(at);
+		return list;
+	}
+	at->number = number;
+	SLIST_NEXT(at, next) = list;
+	return at;
+}
+
+/*
+ * The index and the tags of an article (sorted by name), with the position
+ * of the article in each of them, or all the tags if article is NULL.
+ */
+struct article_tag *
+get_article_tags(const char *article)
+{
+	char path[MAXPATHLEN];
+	struct dir_scan ds;
+	struct article_tag *list;
+	struct names n;
+	const char *name;
+	unsigned char type;
+	unsigned long i, number;
+	size_t len;
+	char **tags;
+	extern enum STATUS status;
+
+	if (site_article_tags(article, &list) == 0)
+		return list;
+	list = NULL;
+	snprintf(path, MAXPATHLEN, "%s" TAGS_DIR,
+	    status & STATUS_FROMCMD ? CHROOT_DIR : "");
+	TIMING_BEGIN(STAGE_TAGS);
+	if (scan_open(&ds, path) == -1) {
+		TIMING_END(STAGE_TAGS);
+		return NULL;
+	}
+	memset(&n, 0, sizeof(n));
+	tags = NULL;
+	while ((name = scan_next(&ds, &len, &type)) != NULL)
+		if (scan_is_dir(&ds, name, type)
+		    && names_push(&n, name, len, 0) == -1)
+			break;
+	scan_close(&ds);
+	if (n.nb != 0 && (tags = calloc(n.nb, sizeof(char *))) == NULL) {
+		warn("calloc");
+		n.nb = 0;
+	}
+	for (i = 0; i < n.nb; ++i)
+		tags[i] = NAME(&n, i);
+	if (n.nb != 0)
+		qsort(tags, n.nb, sizeof(char *), compar_name_desc);
+	/* from the last one, so that the list is sorted */
+	for (i = 0; i < n.nb; ++i) {
+		if (article == NULL)
+			list = add_article_tag(list, tags[i], 0);
+		else if (count_articles(tags[i], article, &number) != 0
+		    && number != 0)
+			list = add_article_tag(list, tags[i], number);
+	}
+	free(tags);
+	free(n.buf);
+	free(n.heap);
+	if (article != NULL) {
+		count_articles(NULL, article, &number);
+		if (number != 0)
+			list = add_article_tag(list, NULL, number);
+	}
+	TIMING_END(STAGE_TAGS);
+	return list;
+}
+
+/* copy the names in a new list, allocated at once like scan_articles() */
+static int
+copy_article_list(char **names, unsigned long nb, struct article_list *list)
+{
+	unsigned long i;
+	size_t size, len;
+	char *s;
+
+	list->names = NULL;
+	list->nb = 0;
+	if (nb == 0)
+		return 0;
+	for (i = 0, size = 0; i < nb; ++i)
+		size += sizeof(char *) + strlen(names[i]) + 1;
+	if ((list->names = malloc(size)) == NULL) {
+		warn("malloc");
+		return -1;
+	}
+	s = (char *)(list->names + nb);
+	for (i = 0; i < nb; ++i) {
+		len = strlen(names[i]) + 1;
+		memcpy(s, names[i], len);
+		list->names[i] = s;
+		s += len;
+	}
+	list->nb = nb;
+	return 0;
+}
+
+/*
+ * First position from i where the name is older or equal to the article.
+ * Exponential then binary search: the intersection of a small list with a
+ * large one only looks at a few names of the large one.
+ */
+static unsigned long
+gallop(struct article_list *list, unsigned long i, const char *article)
+{
+	unsigned long lo, hi, mid, step;
+
+	if (i >= list->nb || strcmp(list->names[i], article) <= 0)
+		return i;
+	for (lo = i, step = 1; lo + step < list->nb
+	    && strcmp(list->names[lo+step], article) > 0; step *= 2)
+		lo += step;
+	hi = lo + step < list->nb ? lo + step : list->nb;
+	/* names[lo] is newer, names[hi] (if any) is older or equal */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo)/2;
+		if (strcmp(list->names[mid], article) > 0)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return hi;
+}
+
+static int
+intersect_article_lists(struct article_list *a, struct article_list *b,
+    struct article_list *list)
+{
+	struct article_list *small, *large;
+	char **names;
+	unsigned long i, j, nb;
+	int ret;
+
+	small = a->nb < b->nb ? a : b;
+	large = a->nb < b->nb ? b : a;
+	if (small->nb == 0)
+		return copy_article_list(NULL, 0, list);
+	if ((names = calloc(small->nb, sizeof(char *))) == NULL) {
+		warn("calloc");
+		return -1;
+	}
+	for (i = 0, j = 0, nb = 0; i < small->nb && j < large->nb; ++i) {
+		j = gallop(large, j, small->names[i]);
+		if (j < large->nb && strcmp(large->names[j],
+		    small->names[i]) == 0)
+			names[nb++] = small->names[i];
+	}
+	ret = copy_article_list(names, nb, list);
+	free(names);
+	return ret;
+}
+
+static int
+merge_article_lists(struct article_list *a, struct article_list *b,
+    struct article_list *list)
+{
+	char **names;
+	unsigned long i, j, nb;
+	int cmp, ret;
+
+	if (a->nb + b->nb == 0)
+		return copy_article_list(NULL, 0, list);
+	if ((names = calloc(a->nb + b->nb, sizeof(char *))) == NULL) {
+		warn("calloc");
+		return -1;
+	}
+	for (i = 0, j = 0, nb = 0; i < a->nb || j < b->nb;) {
+		if (i == a->nb)
+			cmp = -1;
+		else if (j == b->nb)
+			cmp = 1;
+		else
+			cmp = strcmp(a->names[i], b->names[j]);
+		if (cmp >= 0)
+			names[nb++] = a->names[i++];
+		else
+			names[nb++] = b->names[j++];
+		/* the article is in both lists */
+		if (cmp == 0)
+			++j;
+	}
+	ret = copy_article_list(names, nb, list);
+	free(names);
+	return ret;
+}
+
+int
+is_tag_combination(const char *tag)
+{
+	return tag != NULL && strpbrk(tag, TAG_OR TAG_AND) != NULL;
+}
+
+/*
+ * Same as scan_articles() but the tag can be a combination of tags:
+ * "a,b" is the union of the articles of a and b, "a+b" (or "a b" once the
+ * URL is decoded) their intersection. The intersection has the priority.
+ */
+static int
+list_combination(const char *tag, struct article_list *list, int *nb_tags)
+{
+	char buf[MAXPATHLEN], *right;
+	struct article_list l1, l2;
+	int or, ret;
+
+	if (++*nb_tags > TAGS_MAX_COMBINATION)
+		return -1;
+	if (strlcpy(buf, tag, sizeof(buf)) >= sizeof(buf))
+		return -1;
+	if ((right = strpbrk(buf, TAG_OR)) == NULL
+	    && (right = strpbrk(buf, TAG_AND)) == NULL)
+		return scan_articles(*buf != '\0' ? buf : NULL, NULL, 0, list,
+		    NULL);
+	if (right == buf || right[1] == '\0')
+		return -1;
+	or = (*right == *TAG_OR);
+	*right++ = '\0';
+	if (list_combination(buf, &l1, nb_tags) == -1)
+		return -1;
+	if (list_combination(right, &l2, nb_tags) == -1) {
+		free_article_list(&l1);
+		return -1;
+	}
+	if (or)
+		ret = merge_article_lists(&l1, &l2, list);
+	else
+		ret = intersect_article_lists(&l1, &l2, list);
+	free_article_list(&l1);
+	free_article_list(&l2);
+	return ret;
+}
+
+int
+list_articles(const char *tag, struct article_list *list)
+{
+	struct article_list l;
+	int nb_tags;
+
+	if (site_list(tag, &l) == 0)
+		return copy_article_list(l.names, l.nb, list);
+	if (!is_tag_combination(tag))
+		return scan_articles(tag, NULL, 0, list, NULL);
+	nb_tags = 0;
+	list->names = NULL;
+	list->nb = 0;
+	return list_combination(tag, list, &nb_tags);
+}
+
+/*
+ * The list of the site model if it is loaded, which is borrowed (*owned is
+ * set to 0), or a new one.
+ */
+static int
+get_article_list(const char *tag, struct article_list *list, int *owned)
+{
+	if (site_list(tag, list) == 0) {
+		*owned = 0;
+		return 0;
+	}
+	*owned = 1;
+	return list_articles(tag, list);
+}
+
+void
+free_article_list(struct article_list *list)
+{
+	free(list->names);
+	list->names = NULL;
+	list->nb = 0;
+}
+
+/*
+ * Position of the first article older than the given name, the list is
+ * sorted newest first.
+ */
+unsigned long
+article_list_search(struct article_list *list, const char *article)
+{
+	unsigned long lo, hi, mid;
+
+	lo = 0;
+	hi = list->nb;
+	while (lo < hi) {
+		mid = lo + (hi - lo)/2;
+		if (strcmp(list->names[mid], article) >= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* the list may only hold the first names of the total */
+static int
+read_tag_page(struct tag *t, unsigned long total, const char *tag,
+    unsigned long offset, unsigned long number, tag_cb *callback,
+    void *data)
+{
+	if (total == 0 && (tag != NULL || offset != 0))
+		return -1;
+	if (offset >= total && total != 0)
+		return -1;
+	t->pages = total/number + (total%number != 0 ? 1 : 0);
+	t->page = offset/number + (offset%number != 0 ? 1 : 0);
+	t->offset = offset;
+	t->next = (offset + number < total);
+	t->previous = (offset > 0);
+	if (callback != NULL) {
+		t->name = tag;
+		t->number = number;
+		callback(t, data);
+	}
+	return 0;
+}
+
+int
+read_tag(const char *tag, unsigned long page, unsigned long number,
+    tag_cb *callback, void *data)
+{
+	struct tag t;
+	unsigned long total;
+	int ret, owned;
+
+	if (page && number > ULONG_MAX / page)
+		return -1;
+	if (page * number > ULONG_MAX - number)
+		return -1;
+	/* only the names up to the page are kept */
+	if (site_list(tag, &t.list) == 0) {
+		owned = 0;
+		total = t.list.nb;
+	} else if (!is_tag_combination(tag)) {
+		owned = 1;
+		if (scan_articles(tag, NULL, page * number + number, &t.list,
+		    &total) == -1)
+			return -1;
+	} else {
+		if (get_article_list(tag, &t.list, &owned) == -1)
+			return -1;
+		total = t.list.nb;
+	}
+	t.first = 0;
+	ret = read_tag_page(&t, total, tag, page * number, number, callback,
+	    data);
+	if (owned)
+		free_article_list(&t.list);
+	return ret;
+}
+
+/*
+ * Keyset pagination: the page starts right after (or ends right before)
+ * the given article, so the articles of the previous pages don't have to
+ * be read. Unless the list is in the site model, only the names of the
+ * page are kept while the directory is scanned. After the oldest article,
+ * the last page is read.
+ */
+int
+read_tag_cursor(const char *tag, const char *article, int before,
+    unsigned long number, tag_cb *callback, void *data)
+{
+	struct tag t;
+	struct cursor c;
+	unsigned long total, offset;
+	int ret, owned;
+
+	t.first = 0;
+	if (site_list(tag, &t.list) == 0 || is_tag_combination(tag)) {
+		if (get_article_list(tag, &t.list, &owned) == -1)
+			return -1;
+		total = t.list.nb;
+		offset = article_list_search(&t.list, article);
+		if (before) {
+			/* skip the article itself */
+			if (offset > 0
+			    && strcmp(t.list.names[offset-1], article) == 0)
+				--offset;
+			offset = offset > number ? offset - number : 0;
+		} else if (offset >= total)
+			offset = total > number ? total - number : 0;
+	} else {
+		owned = 1;
+		c.article = article;
+		c.before = before;
+		c.nb = 0;
+		if (scan_articles(tag, &c, number, &t.list, &total) == -1)
+			return -1;
+		if (!before && c.nb == 0 && total != 0) {
+			/* the oldest names, as before any article */
+			free_article_list(&t.list);
+			c.article = "";
+			c.before = 1;
+			c.nb = 0;
+			if (scan_articles(tag, &c, number, &t.list, &total)
+			    == -1)
+				return -1;
+		}
+		if (c.before && c.nb <= number) {
+			free_article_list(&t.list);
+			return read_tag(tag, 0, number, callback, data);
+		}
+		offset = c.before ? c.nb - number : total - c.nb;
+		t.first = offset;
+	}
+	ret = read_tag_page(&t, total, tag, offset, number, callback, data);
+	if (owned)
+		free_article_list(&t.list);
+	return ret;
+}
+
+/*
+ * Range of the articles of a period (YYYY or YYYYMM) in the list, found by
+ * binary search since the names begin with the date.
+ */
+static void
+article_list_range(struct article_list *list, const char *period,
+    unsigned long *first, unsigned long *last)
+{
+	char end[ARCHIVE_LEN];
+	size_t len;
+
+	len = strlcpy(end, period, sizeof(end));
+	/* the names of the period are >= period and < end */
+	++end[len-1];
+	*first = article_list_search(list, end);
+	*last = article_list_search(list, period);
+}
+
+int
+is_archive_name(const char *period)
+{
+	size_t len, i;
+
+	len = strlen(period);
+	if (len != 4 && len != 6)
+		return 0;
+	for (i = 0; i < len; ++i)
+		if (period[i] < '0' || period[i] > '9')
+			return 0;
+	/* same century check as the articles */
+	return strncmp(period, "20", 2) == 0 || strncmp(period, "19", 2) == 0;
+}
+
+/* the articles of a period are paginated like those of a tag */
+int
+read_archive(const char *period, unsigned long page, unsigned long number,
+    tag_cb *callback, void *data)
+{
+	struct tag t;
+	struct article_list list;
+	unsigned long first, last;
+	int ret, owned;
+
+	if (page && number > ULONG_MAX / page)
+		return -1;
+#ifdef ARTICLES_SHARDED
+	/* only the shards of the period are read */
+	if (site_list(NULL, &list) == 0)
+		owned = 0;
+	else {
+		owned = 1;
+		if (scan_index(period, NULL, 0, &list, NULL) == -1)
+			return -1;
+	}
+#else
+	if (get_article_list(NULL, &list, &owned) == -1)
+		return -1;
+#endif
+	article_list_range(&list, period, &first, &last);
+	t.list.names = list.names + first;
+	t.list.nb = last - first;
+	t.first = 0;
+	ret = read_tag_page(&t, t.list.nb, period, page * number, number,
+	    callback, data);
+	if (owned)
+		free_article_list(&list);
+	return ret;
+}
+
+/* the modification time of a directory, zero if it cannot be read */
+static void
+directory_mtim(const char *path, struct timespec *mtim)
+{
+	struct stat sb;
+
+	CACHE_DEPEND(path);
+	if (stat(path, &sb) == -1) {
+		if (errno != ENOENT)
+			warn("stat: %s", path);
+		mtim->tv_sec = mtim->tv_nsec = 0;
+	} else
+		*mtim = sb.st_mtim;
+}
+
+static int
+same_mtim(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+#ifdef ARTICLES_SHARDED
+static int
+later_mtim(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec > b->tv_sec
+	    || (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
+}
+#endif
+
+/*
+ * The modification time of the articles: that of ARTICLES_DIR, or the
+ * latest of ARTICLES_DIR and of its shards with ARTICLES_SHARDED, since an
+ * article is added in the directory of its month.
+ */
+void
+articles_mtim(struct timespec *mtim)
+{
+	char path[MAXPATHLEN];
+#ifdef ARTICLES_SHARDED
+	char year[MAXPATHLEN], month[MAXPATHLEN], prefix[ARCHIVE_LEN];
+	struct article_list years, months;
+	struct timespec cur;
+	unsigned long i, j;
+#endif
+
+	list_path(path, NULL);
+	directory_mtim(path, mtim);
+#ifdef ARTICLES_SHARDED
+	if (scan_shards(path, 4, &years) == -1)
+		return;
+	for (i = 0; i < years.nb; ++i) {
+		shard_path(year, years.names[i], 1);
+		directory_mtim(year, &cur);
+		if (later_mtim(&cur, mtim))
+			*mtim = cur;
+		if (scan_shards(year, 2, &months) == -1)
+			continue;
+		for (j = 0; j < months.nb; ++j) {
+			snprintf(prefix, sizeof(prefix), "%s%s",
+			    years.names[i], months.names[j]);
+			shard_path(month, prefix, 2);
+			directory_mtim(month, &cur);
+			if (later_mtim(&cur, mtim))
+				*mtim = cur;
+		}
+		free_article_list(&months);
+	}
+	free_article_list(&years);
+#endif
+}
+
+/*
+ * Number of articles per month, newest first. They are read from the pack
+ * if there is one, or counted once from the list of the articles, and kept
+ * until ARTICLES_DIR changes. The caller gets a copy, to free, since
+ * another thread may count them again.
+ */
+struct archive *
+get_archives(unsigned long *nb)
+{
+	static struct archive *archives = NULL;
+	static unsigned long nb_archives = 0;
+	static struct timespec mtim;
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	struct timespec cur;
+	struct article_list list;
+	unsigned long i;
+	struct archive *ar, *copy;
+
+	pthread_mutex_lock(&lock);
+	articles_mtim(&cur);
+	if (archives != NULL && same_mtim(&cur, &mtim))
+		goto out;
+	free(archives);
+	archives = NULL;
+	nb_archives = 0;
+	mtim = cur;
+	if ((archives = pack_archives(&nb_archives)) != NULL)
+		goto out;
+	if (list_articles(NULL, &list) == -1)
+		goto out;
+	/* there cannot be more months than articles */
+	if (list.nb == 0
+	    || (archives = calloc(list.nb, sizeof(struct archive))) == NULL) {
+		if (list.nb != 0)
+			warn("calloc");
+		free_article_list(&list);
+		goto out;
+	}
+	for (i = 0, ar = NULL; i < list.nb; ++i) {
+		if (ar == NULL || strncmp(ar->period, list.names[i],
+		    ARCHIVE_LEN-1) != 0) {
+			ar = &archives[nb_archives++];
+			strlcpy(ar->period, list.names[i], ARCHIVE_LEN);
+		}
+		++ar->number;
+	}
+	free_article_list(&list);
+out:	*nb = 0;
+	copy = NULL;
+	if (nb_archives != 0) {
+		if ((copy = reallocarray(NULL, nb_archives,
+		    sizeof(struct archive))) == NULL)
+			warn("reallocarray");
+		else {
+			memcpy(copy, archives,
+			    nb_archives * sizeof(struct archive));
+			*nb = nb_archives;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return copy;
+}
+
+/*
+ * Number of articles of the index (the first entry, named NULL) and of each
+ * tag, by name. The table is kept between the calls: the tags are listed
+ * again when TAGS_DIR changes, and a list is counted again only when its
+ * directory changes, so each call costs a stat per tag. It is updated
+ * under a lock, for the threads rendering pages at once, and the caller
+ * gets a copy, names included, to free in one call.
+ */
+struct tag_count *
+get_tag_counts(unsigned long *nb)
+{
+	static struct tag_count *counts = NULL;
+	static unsigned long nb_counts = 0;
+	static struct timespec mtim;
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	struct timespec cur;
+	char path[MAXPATHLEN];
+	struct article_tag *list, *at;
+	struct tag_count *tc, *old, *copy;
+	unsigned long i, j, nb_old;
+	size_t len;
+	char *s;
+	int cmp;
+	extern enum STATUS status;
+
+	pthread_mutex_lock(&lock);
+	snprintf(path, MAXPATHLEN, "%s" TAGS_DIR,
+	    status & STATUS_FROMCMD ? CHROOT_DIR : "");
+	directory_mtim(path, &cur);
+	if (counts == NULL || !same_mtim(&cur, &mtim)) {
+		/* keep the counts of the tags still there, both are sorted */
+		old = counts;
+		nb_old = nb_counts;
+		list = get_article_tags(NULL);
+		for (nb_counts = 1, at = list; at != NULL;
+		    at = SLIST_NEXT(at, next))
+			++nb_counts;
+		if ((counts = calloc(nb_counts, sizeof(struct tag_count)))
+		    == NULL) {
+			warn("calloc");
+			for (; list != NULL; list = at) {
+				at = SLIST_NEXT(list, next);
+				free(list->name);
+				free(list);
+			}
+			counts = old;
+			nb_counts = nb_old;
+			goto count;
+		}
+		if (old != NULL)
+			counts[0] = old[0];
+		for (i = 1, j = 1; list != NULL; ++i) {
+			at = list;
+			list = SLIST_NEXT(at, next);
+			counts[i].name = at->name;
+			free(at);
+			for (cmp = 1; j < nb_old
+			    && (cmp = strcmp(old[j].name, counts[i].name)) < 0;
+			    ++j)
+				free(old[j].name);
+			if (cmp == 0) {
+				counts[i].number = old[j].number;
+				counts[i].mtim = old[j].mtim;
+				free(old[j++].name);
+			}
+		}
+		for (; j < nb_old; ++j)
+			free(old[j].name);
+		free(old);
+		mtim = cur;
+	}
+count:	for (i = 0; i < nb_counts; ++i) {
+		tc = &counts[i];
+		if (tc->name != NULL) {
+			list_path(path, tc->name);
+			directory_mtim(path, &cur);
+		} else
+			articles_mtim(&cur);
+		if (same_mtim(&cur, &tc->mtim)
+		    && (cur.tv_sec != 0 || cur.tv_nsec != 0))
+			continue;
+		tc->mtim = cur;
+		tc->number = count_articles(tc->name, NULL, NULL);
+	}
+	/* the array and the names are allocated at once */
+	for (i = 0, len = 0; i < nb_counts; ++i)
+		if (counts[i].name != NULL)
+			len += strlen(counts[i].name) + 1;
+	*nb = 0;
+	if (nb_counts == 0 || (copy = malloc(nb_counts *
+	    sizeof(struct tag_count) + len)) == NULL) {
+		if (nb_counts != 0)
+			warn("malloc");
+		pthread_mutex_unlock(&lock);
+		return NULL;
+	}
+	s = (char *)(copy + nb_counts);
+	for (i = 0; i < nb_counts; ++i) {
+		copy[i] = counts[i];
+		if (counts[i].name == NULL)
+			continue;
+		len = strlen(counts[i].name) + 1;
+		memcpy(s, counts[i].name, len);
+		copy[i].name = s;
+		s += len;
+	}
+	*nb = nb_counts;
+	pthread_mutex_unlock(&lock);
+	return copy;
+}
+
+unsigned long
+read_page_articles(struct tag *t, article_cb *callback, void *data)
+{
+	unsigned long i, start, nb_articles;
+
+	/* the list begins at the first-th entry */
+	start = t->offset - t->first;
+#ifdef PREFETCH_ARTICLES
+	if (callback != NULL && start < t->list.nb)
+		prefetch_articles(t->list.names + start,
+		    MIN(t->number, t->list.nb - start));
+#endif
+	nb_articles = 0;
+	for (i = start; i < t->list.nb && i - start < t->number; ++i)
+		if (read_article(t->list.names[i], callback, data) != -1)
+			++nb_articles;
+	return nb_articles;
+}
+
+/*
+ * Fix the links of the tags to the articles moved by migrate_articles():
+ * a link which does not resolve any more gets the shard ("YYYY/MM/") added
+ * before the name of the article, or removed.
+ */
+static unsigned long
+migrate_links(int to_shards)
+{
+	char dir[MAXPATHLEN], link[MAXPATHLEN], target[MAXPATHLEN];
+	struct article_tag *tags, *at;
+	struct dir_scan ds;
+	struct stat sb;
+	const char *name;
+	unsigned char type;
+	unsigned long nb;
+	size_t len;
+	ssize_t n;
+
+	nb = 0;
+	tags = get_article_tags(NULL);
+	for (at = tags; at != NULL; at = SLIST_NEXT(at, next)) {
+		list_path(dir, at->name);
+		if (scan_open(&ds, dir) == -1)
+			continue;
+		while ((name = scan_next(&ds, &len, &type)) != NULL) {
+			if (type != DT_LNK && type != DT_UNKNOWN)
+				continue;
+			if (!is_article_name(name, len)
+			    || (n = readlinkat(ds.fd, name, link,
+			    sizeof(link) - 1)) == -1
+			    || fstatat(ds.fd, name, &sb, 0) != -1)
+				continue;
+			link[n] = '\0';
+			if ((size_t)n < len || strcmp(link + n - len, name) != 0)
+				continue;
+			link[n - len] = '\0';
+			if (to_shards) {
+				if (snprintf(target, sizeof(target),
+				    "%s%.4s/%.2s/%s", link, name, name + 4,
+				    name) >= (int)sizeof(target))
+					continue;
+			} else if ((size_t)n >= len + 8
+			    && strncmp(link + n - len - 8, name, 4) == 0
+			    && link[n - len - 4] == '/'
+			    && strncmp(link + n - len - 3, name + 4, 2) == 0
+			    && link[n - len - 1] == '/') {
+				link[n - len - 8] = '\0';
+				if (snprintf(target, sizeof(target), "%s%s",
+				    link, name) >= (int)sizeof(target))
+					continue;
+			} else
+				continue;
+			if (fstatat(ds.fd, target, &sb, 0) == -1)
+				continue;
+			if (unlinkat(ds.fd, name, 0) == -1
+			    || symlinkat(target, ds.fd, name) == -1)
+				warn("symlink: %s/%s", dir, name);
+			else
+				++nb;
+		}
+		scan_close(&ds);
+	}
+	for (; tags != NULL; tags = at) {
+		at = SLIST_NEXT(tags, next);
+		free(tags->name);
+		free(tags);
+	}
+	return nb;
+}
+
+/* the articles of a shard to move back, as YYYY/MM/name */
+static int
+migrate_month(const char *path, const char *year, const char *month,
+    struct names *n)
+{
+	char buf[MAXPATHLEN];
+	struct dir_scan ds;
+	const char *name;
+	unsigned char type;
+	size_t len;
+	int ret;
+
+	if (scan_open(&ds, path) == -1)
+		return 0;
+	ret = 0;
+	while ((name = scan_next(&ds, &len, &type)) != NULL) {
+		if (!scan_is_article(name, len, type, 1))
+			continue;
+		len = snprintf(buf, sizeof(buf), "%s/%s/%s", year, month, name);
+		if ((ret = names_push(n, buf, len, 0)) == -1)
+			break;
+	}
+	scan_close(&ds);
+	return ret;
+}
+
+/*
+ * Move the articles from ARTICLES_DIR to ARTICLES_DIR/YYYY/MM ("blog -p
+ * shard") or back ("blog -p flat"). The names are read first and the
+ * articles moved afterwards, whatever ARTICLES_SHARDED is.
+ */
+int
+migrate_articles(int to_shards)
+{
+	char root[MAXPATHLEN], from[MAXPATHLEN], to[MAXPATHLEN];
+	char month[ARCHIVE_LEN+1];
+	struct dir_scan ds, dy;
+	struct names n;
+	struct stat sb;
+	const char *name, *year;
+	unsigned char type;
+	unsigned long i, moved;
+	size_t len;
+	int ret;
+
+	list_path(root, NULL);
+	if (scan_open(&ds, root) == -1)
+		return -1;
+	memset(&n, 0, sizeof(n));
+	ret = 0;
+	/* the articles to move, as YYYY/MM/name when they are in a shard */
+	while (ret == 0 && (name = scan_next(&ds, &len, &type)) != NULL) {
+		if (to_shards) {
+			if (scan_is_article(name, len, type, 1)
+			    && strspn(name, "0123456789") >= ARCHIVE_LEN-1)
+				ret = names_push(&n, name, len, 0);
+			continue;
+		}
+		if (len != 4 || strspn(name, "0123456789") != 4
+		    || !scan_is_dir(&ds, name, type))
+			continue;
+		shard_path(from, name, 0);
+		if (scan_open(&dy, from) == -1)
+			continue;
+		year = name;
+		while (ret == 0 && (name = scan_next(&dy, &len, &type))
+		    != NULL) {
+			if (len != 2 || strspn(name, "0123456789") != 2)
+				continue;
+			snprintf(month, sizeof(month), "%s/%s", year, name);
+			shard_path(to, month, 0);
+			ret = migrate_month(to, year, name, &n);
+		}
+		scan_close(&dy);
+	}
+	scan_close(&ds);
+	for (i = 0, moved = 0; ret == 0 && i < n.nb; ++i) {
+		name = NAME(&n, i);
+		shard_path(from, name, 0);
+		if (to_shards) {
+			shard_path(to, name, 1);
+			if (mkdir(to, 0755) == -1 && errno != EEXIST)
+				warn("mkdir: %s", to);
+			shard_path(to, name, 2);
+			if (mkdir(to, 0755) == -1 && errno != EEXIST)
+				warn("mkdir: %s", to);
+			shard_path(to, name, 3);
+		} else
+			shard_path(to, name + 8, 0);
+		if (lstat(to, &sb) != -1) {
+			warnx("%s: already exists", to);
+			continue;
+		}
+		if (rename(from, to) == -1) {
+			warn("rename: %s", from);
+			continue;
+		}
+		++moved;
+		if (!to_shards) {
+			/* the month and the year, once empty */
+			*strrchr(from, '/') = '\0';
+			if (rmdir(from) != -1) {
+				*strrchr(from, '/') = '\0';
+				rmdir(from);
+			}
+		}
+	}
+	names_free(&n);
+	if (ret == -1)
+		return -1;
+	fprintf(stderr, "%lu articles moved, %lu links of the tags updated\n",
+	    moved, migrate_links(to_shards));
+#ifdef ARTICLES_SHARDED
+	if (!to_shards)
+#else
+	if (to_shards)
+#endif
+		warnx("ARTICLES_SHARDED must be %s in config.h to read them",
+		    to_shards ? "defined" : "undefined");
 	return 0;
 }
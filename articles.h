@@ -14,33 +14,92 @@ struct article_tag {
 	SLIST_ENTRY(article_tag) next;
 };
 
+struct pack_map;
+
+/*
+ * The tags and "more" are read on first use, through article_tags(),
+ * article_has_more() and article_more().
+ */
 struct article {
 	const char	*name;
 	char		*title;
 	struct tm	 date;
-	SLIST_HEAD(, article_tag) tags;
+	SLIST_HEAD(article_tag_list, article_tag) tags;
 	FILE		*body;
 	FILE		*more;
-	off_t		 more_size;
+	struct pack_map	*more_map;	/* of the pack, holding more */
+	off_t		 more_size;	/* -1 without more */
 	char		 display_more;
+	char		 loaded;
 	struct antispam	*antispam;
 };
 
+#define ARTICLE_LOADED_TAGS	0x1
+#define ARTICLE_LOADED_SIZE	0x2
+#define ARTICLE_LOADED_MORE	0x4
+
+struct article_list {
+	char		**names;	/* sorted newest first */
+	unsigned long	  nb;
+};
+
 struct tag {
 	const char	*name;
 	unsigned long	 page, offset, number, pages; 
 	char		 previous, next;
+	struct article_list list;
+	unsigned long	 first;		/* position of list.names[0] */
+};
+
+/* separators of the combinations of tags, e.g. "a+b" or "a,b" */
+#define TAG_OR			","
+#define TAG_AND			"+ "
+#define TAGS_MAX_COMBINATION	8
+
+/* YYYYMM */
+#define ARCHIVE_LEN	7
+
+struct archive {
+	char		 period[ARCHIVE_LEN];
+	unsigned long	 number;
+};
+
+struct tag_count {
+	char		*name;		/* NULL for the index */
+	unsigned long	 number;
+	struct timespec	 mtim;		/* of the directory */
 };
 
-typedef void (article_cb)(struct article *);
-typedef void (tag_cb)(struct tag *);
+/* the callbacks get the data given to the readers, a render for instance */
+typedef void (article_cb)(struct article *, void *);
+typedef void (tag_cb)(struct tag *, void *);
 
 int			 is_article_name(const char *, size_t);
-int			 read_article(const char *, article_cb *);
+void			 article_path(char *, const char *, const char *);
+void			 articles_mtim(struct timespec *);
+int			 migrate_articles(int);
+int			 read_article(const char *, article_cb *, void *);
+struct article_tag_list	*article_tags(struct article *);
+int			 article_has_more(struct article *);
+FILE			*article_more(struct article *);
 struct article_tag	*get_article_tags(const char *);
 unsigned long		 read_articles(const char *, unsigned long,
-			     unsigned long, article_cb *);
+			     unsigned long, article_cb *, void *);
+int			 is_tag_combination(const char *);
+int			 list_articles(const char *, struct article_list *);
+void			 free_article_list(struct article_list *);
+unsigned long		 article_list_search(struct article_list *,
+			     const char *);
 int			 read_tag(const char *, unsigned long,
-			     unsigned long, tag_cb);
+			     unsigned long, tag_cb, void *);
+int			 read_tag_cursor(const char *, const char *, int,
+			     unsigned long, tag_cb, void *);
+unsigned long		 read_page_articles(struct tag *, article_cb *,
+			     void *);
+int			 is_archive_name(const char *);
+int			 read_archive(const char *, unsigned long,
+			     unsigned long, tag_cb, void *);
+struct archive		*get_archives(unsigned long *);
+struct tag_count	*get_tag_counts(unsigned long *);
 
 #endif
@@ -0,0 +1,324 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2009 Colin Didier <cdidier@cybione.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks of the hot paths, run on synthetic corpora of growing
+ * sizes. Each operation is repeated until BENCH_TIME has elapsed and its
+ * mean latency is reported.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include "../common.h"
+#include "../articles.h"
+#include "../comments.h"
+#include "../output.h"
+#include "bench.h"
+
+/* minimal duration of each measure, in seconds */
+#define BENCH_TIME	0.5
+/* articles of the page compressed by the gzip benchmarks */
+#define GZIP_PAGE	2000
+
+void render_page_article(struct article *, struct render *);
+void render_page_tag(struct tag *, struct render *);
+void render_page_tags(struct render *);
+
+/* globals of main.c */
+enum STATUS	 status;
+
+static struct corpus corpus;
+static struct render r;
+static const char *escaped_input;
+static const char *post_input =
+    "name=Some+Reader&mail=reader%40example.org&web=http%3A%2F%2Fexample.org"
+    "%2F&comment=A+comment+with+%3Cb%3Emarkup%3C%2Fb%3E+%26+entities%2C+"
+    "%C3%A9t%C3%A9&question=4&submit=Post";
+
+static void
+article_noop(struct article *a, void *data)
+{
+	(void)a;
+	(void)data;
+}
+
+static void
+comment_noop(struct comment *c, void *data)
+{
+	(void)c;
+	(void)data;
+}
+
+static void
+tag_noop(struct tag *t, void *data)
+{
+	(void)t;
+	(void)data;
+}
+
+static void
+markers_noop(struct render *rd, const char *m, void *arg)
+{
+	(void)rd;
+	(void)m;
+	(void)arg;
+}
+
+static void
+bench_read_articles(void)
+{
+	read_articles(NULL, 0, NB_ARTICLES, article_noop, NULL);
+}
+
+static void
+bench_read_tag(void)
+{
+	read_tag(NULL, 0, NB_ARTICLES, tag_noop, NULL);
+}
+
+static void
+bench_read_tag_page(void)
+{
+	read_tag("tag0", 0, NB_ARTICLES, (tag_cb *)render_page_tag, &r);
+}
+
+static void
+bench_list_articles(void)
+{
+	struct article_list l;
+
+	if (list_articles(NULL, &l) != -1)
+		free_article_list(&l);
+}
+
+static void
+bench_get_article_tags(void)
+{
+	struct article_tag *at, *next;
+
+	for (at = get_article_tags(corpus.middle); at != NULL; at = next) {
+		next = SLIST_NEXT(at, next);
+		free(at->name);
+		free(at);
+	}
+}
+
+static void
+bench_read_comments(void)
+{
+	read_comments(corpus.middle, comment_noop, NULL);
+}
+
+static void
+bench_page_article(void)
+{
+	read_article(corpus.middle, (article_cb *)render_page_article,
+	    &r);
+}
+
+static void
+bench_page_tags(void)
+{
+	render_page_tags(&r);
+}
+
+static void
+bench_parse_template(void)
+{
+	parse_template(&r, "article.html", markers_noop, NULL);
+}
+
+static void
+bench_hput_escaped(void)
+{
+	hput_escaped(&r, escaped_input);
+}
+
+/*
+ * A page of up to GZIP_PAGE articles, several megabytes, compressed in the
+ * render or on the compression thread.
+ */
+static void
+gzip_page(int thread)
+{
+	output_gzip = 1;
+	output_gzip_thread = thread;
+	read_tag(NULL, 0, MIN(corpus.articles, GZIP_PAGE),
+	    (tag_cb *)render_page_tag, &r);
+	output_gzip = 0;
+	output_gzip_thread = -1;
+}
+
+static void
+bench_gzip_page(void)
+{
+	gzip_page(0);
+}
+
+static void
+bench_gzip_page_thread(void)
+{
+	gzip_page(1);
+}
+
+/* url_decode() of each parameter */
+static void
+bench_tokenize_query(void)
+{
+	free_query(tokenize_query(post_input));
+}
+
+static const struct {
+	const char	*name;
+	void		(*fn)(void);
+} benchs[] = {
+	{ "list_articles",	bench_list_articles },
+	{ "read_articles",	bench_read_articles },
+	{ "read_tag",		bench_read_tag },
+	{ "get_article_tags",	bench_get_article_tags },
+	{ "read_comments",	bench_read_comments },
+	{ "render_page_article", bench_page_article },
+	{ "render_page_tag",	bench_read_tag_page },
+	{ "render_page_tags",	bench_page_tags },
+	{ "parse_template",	bench_parse_template },
+	{ "hput_escaped",	bench_hput_escaped },
+	{ "tokenize_query",	bench_tokenize_query },
+	{ "gzip_page",		bench_gzip_page },
+	{ "gzip_page_thread",	bench_gzip_page_thread },
+	{ NULL,			NULL }
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+run(void)
+{
+	unsigned long i, n;
+	double begin, elapsed;
+
+	for (i = 0; benchs[i].name != NULL; ++i) {
+		benchs[i].fn();	/* warm the caches */
+		n = 0;
+		begin = now();
+		do {
+			benchs[i].fn();
+			++n;
+		} while ((elapsed = now() - begin) < BENCH_TIME);
+		printf("%-8lu %-20s %10.2f us %10lu runs\n", corpus.articles,
+		    benchs[i].name, elapsed * 1e6 / n, n);
+	}
+}
+
+static char *
+make_escaped_input(void)
+{
+	static const char chunk[] = "Some <em>text</em> & \"quotes\" ";
+	char *s;
+	size_t i, len;
+
+	len = 1024;
+	if ((s = malloc(len + 1)) == NULL)
+		err(1, "malloc");
+	for (i = 0; i < len; ++i)
+		s[i] = chunk[i % (sizeof(chunk) - 1)];
+	s[len] = '\0';
+	return s;
+}
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-l] [-c comments] [-t tags] "
+	    "[-T tags_per_article] size ...\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	FILE *out;
+	const char *errstr;
+	char *escaped;
+	int ch;
+
+	status = STATUS_FROMCMD;
+	corpus.tags = 10;
+	corpus.tags_per_article = 2;
+	corpus.comments = 5;
+	corpus.symlinks = 0;
+	while ((ch = getopt(argc, argv, "c:lt:T:")) != -1)
+		switch (ch) {
+		case 'c':
+			corpus.comments = strtonum(optarg, 0, 10000, &errstr);
+			if (errstr != NULL)
+				errx(1, "comments: %s", errstr);
+			break;
+		case 'l':
+			corpus.symlinks = 1;
+			break;
+		case 't':
+			corpus.tags = strtonum(optarg, 0, 10000, &errstr);
+			if (errstr != NULL)
+				errx(1, "tags: %s", errstr);
+			break;
+		case 'T':
+			corpus.tags_per_article = strtonum(optarg, 0, 100,
+			    &errstr);
+			if (errstr != NULL)
+				errx(1, "tags per article: %s", errstr);
+			break;
+		default:
+			usage();
+		}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0)
+		usage();
+	if ((out = fopen("/dev/null", "w")) == NULL)
+		err(1, "fopen: /dev/null");
+	render_init(&r, out);
+	escaped_input = escaped = make_escaped_input();
+	for (; argc > 0; --argc, ++argv) {
+		corpus.articles = strtonum(*argv, 1, 10000000, &errstr);
+		if (errstr != NULL)
+			errx(1, "size: %s", errstr);
+		fprintf(stderr, "generating %lu articles in %s\n",
+		    corpus.articles, CHROOT_DIR BASE_DIR);
+		if (make_corpus(&corpus) == -1)
+			errx(1, "cannot generate the corpus");
+		run();
+	}
+	free(escaped);
+	fclose(out);
+	return 0;
+}
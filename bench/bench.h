@@ -0,0 +1,17 @@
+/* $Id$ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+struct corpus {
+	unsigned long	 articles;
+	unsigned long	 tags;		/* number of tags */
+	unsigned long	 tags_per_article;
+	unsigned long	 comments;	/* comments per article */
+	int		 symlinks;	/* tags as symbolic links */
+	char		 middle[64];	/* name of an article in the middle */
+};
+
+int	make_corpus(struct corpus *);
+
+#endif
@@ -0,0 +1,221 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2009 Colin Didier <cdidier@cybione.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Synthetic corpus: articles, tags, "more" files and comments, written in
+ * the directories of config.h (below CHROOT_DIR, which the bench Makefile
+ * target points to a temporary directory).
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fts.h>
+
+#include "../common.h"
+#include "bench.h"
+
+static const char *words[] = {
+	"lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing",
+	"elit", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore",
+	"et", "dolore", "magna", "aliqua", "<b>enim</b>", "&amp;", "minim",
+	"veniam", "quis", "nostrud", "exercitation", "ullamco", "laboris",
+	"nisi", "aliquip", "commodo", "consequat", NULL
+};
+
+static int
+remove_tree(const char *path)
+{
+	FTS *fts;
+	FTSENT *e;
+	char * const path_argv[] = { (char *)path, NULL };
+
+	if ((fts = fts_open(path_argv, FTS_PHYSICAL|FTS_NOSTAT, NULL)) == NULL)
+		return -1;
+	while ((e = fts_read(fts)) != NULL) {
+		if (e->fts_info == FTS_DP)
+			rmdir(e->fts_accpath);
+		else if (e->fts_info != FTS_D)
+			unlink(e->fts_accpath);
+	}
+	fts_close(fts);
+	return 0;
+}
+
+static int
+make_dirs(char *path)
+{
+	char *p;
+
+	for (p = path + 1; (p = strchr(p, '/')) != NULL; ++p) {
+		*p = '\0';
+		if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+			warn("mkdir: %s", path);
+			return -1;
+		}
+		*p = '/';
+	}
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+		warn("mkdir: %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+write_words(FILE *f, unsigned long n, unsigned long seed)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; ++i) {
+		fputs(words[(seed + i*7) % (sizeof(words)/sizeof(words[0]) - 1)],
+		    f);
+		fputc((i+1) % 12 == 0 ? '\n' : ' ', f);
+	}
+	fputc('\n', f);
+}
+
+static int
+write_article(const char *name, unsigned long i, unsigned long comments)
+{
+	char dir[MAXPATHLEN], path[MAXPATHLEN], date[64];
+	unsigned long c;
+	time_t t;
+	FILE *f;
+
+#ifdef ARTICLES_SHARDED
+	snprintf(dir, MAXPATHLEN, CHROOT_DIR ARTICLES_DIR "/%.4s/%.2s/%s",
+	    name, name + 4, name);
+#else
+	snprintf(dir, MAXPATHLEN, CHROOT_DIR ARTICLES_DIR "/%s", name);
+#endif
+	if (make_dirs(dir) == -1)
+		return -1;
+	snprintf(path, MAXPATHLEN, "%.*s/article", MAXPATHLEN - 16, dir);
+	if ((f = fopen(path, "w")) == NULL) {
+		warn("fopen: %s", path);
+		return -1;
+	}
+	fprintf(f, "Article %lu <i>%s</i>\n<p>", i, words[i % 8]);
+	write_words(f, 150 + i % 200, i);
+	fclose(f);
+	if (i % 3 == 0) {
+		snprintf(path, MAXPATHLEN, "%.*s/more", MAXPATHLEN - 16, dir);
+		if ((f = fopen(path, "w")) == NULL) {
+			warn("fopen: %s", path);
+			return -1;
+		}
+		write_words(f, 600, i);
+		fclose(f);
+	}
+	snprintf(path, MAXPATHLEN, "%.*s/comments", MAXPATHLEN - 16, dir);
+	if ((f = fopen(path, "w")) == NULL) {
+		warn("fopen: %s", path);
+		return -1;
+	}
+	t = 1230000000 + i * 3600;
+	for (c = 0; c < comments; ++c, t += 60) {
+		strftime(date, sizeof(date), "%a, %d %b %Y %H:%M %z",
+		    gmtime(&t));
+		fprintf(f, "From www@localhost %s", ctime(&t));
+		fprintf(f, "From: Reader %lu <reader%lu@example.org>\n", c, c);
+		fprintf(f, "Date: %s\n", date);
+		fprintf(f, "X-IP: 192.0.2.%lu\n", c % 250);
+		if (c % 2 == 0)
+			fprintf(f, "X-Website: http://example.org/%lu\n", c);
+		fputc('\n', f);
+		fputs("Nice article, see http://example.org/ for more.\n", f);
+		write_words(f, 40, c);
+		fputc('\n', f);
+	}
+	fclose(f);
+	return 0;
+}
+
+int
+make_corpus(struct corpus *c)
+{
+	char path[MAXPATHLEN], name[64], target[MAXPATHLEN], cwd[MAXPATHLEN-16];
+	unsigned long i, j;
+	struct tm tm;
+	time_t t;
+	FILE *f;
+
+	remove_tree(CHROOT_DIR BASE_DIR);
+	strlcpy(path, CHROOT_DIR ARTICLES_DIR, sizeof(path));
+	if (make_dirs(path) == -1)
+		return -1;
+	strlcpy(path, CHROOT_DIR TAGS_DIR, sizeof(path));
+	if (make_dirs(path) == -1)
+		return -1;
+	/* the templates of the tree */
+	strlcpy(path, CHROOT_DIR TEMPLATES_DIR, sizeof(path));
+	*strrchr(path, '/') = '\0';
+	if (make_dirs(path) == -1 || getcwd(cwd, sizeof(cwd)) == NULL)
+		return -1;
+	snprintf(target, sizeof(target), "%s/templates", cwd);
+	if (symlink(target, CHROOT_DIR TEMPLATES_DIR) == -1) {
+		warn("symlink: %s", target);
+		return -1;
+	}
+	for (j = 0; j < c->tags; ++j) {
+		snprintf(path, MAXPATHLEN, CHROOT_DIR TAGS_DIR "/tag%lu", j);
+		if (mkdir(path, 0755) == -1) {
+			warn("mkdir: %s", path);
+			return -1;
+		}
+	}
+	/* one article every 7 hours since 2000 */
+	for (i = 0; i < c->articles; ++i) {
+		t = 946684800 + i * 7 * 3600;
+		gmtime_r(&t, &tm);
+		strftime(name, sizeof(name), "%Y%m%d%H%M", &tm);
+		if (i % 4 == 0)
+			strlcpy(name + 12, "-title", sizeof(name) - 12);
+		if (i == c->articles / 2)
+			strlcpy(c->middle, name, sizeof(c->middle));
+		if (write_article(name, i, c->comments) == -1)
+			return -1;
+		for (j = 0; j < c->tags_per_article && c->tags != 0; ++j) {
+			snprintf(path, MAXPATHLEN, CHROOT_DIR TAGS_DIR
+			    "/tag%lu/%s", (i * (j+1) + j) % c->tags, name);
+			if (c->symlinks) {
+#ifdef ARTICLES_SHARDED
+				snprintf(target, sizeof(target),
+				    "../../articles/%.4s/%.2s/%s", name,
+				    name + 4, name);
+#else
+				snprintf(target, sizeof(target),
+				    "../../articles/%s", name);
+#endif
+				if (symlink(target, path) == -1
+				    && errno != EEXIST)
+					warn("symlink: %s", path);
+			} else if ((f = fopen(path, "w")) != NULL)
+				fclose(f);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,493 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2009 Colin Didier <cdidier@cybione.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * CGI load driver: runs the blog binary like a http server would, with a
+ * fixed number of requests in flight, and reports the latency percentiles,
+ * the throughput and the output size of each route.
+ *
+ * The requests are either a mix built from the articles and tags of the
+ * blog, or replayed from a file with one request per line:
+ *	[GET|POST] [/path?]query_string [post_body]
+ */
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../common.h"
+
+#define LOAD_MAX_NAMES		256
+#define LOAD_MAX_CONCURRENCY	256
+
+/* a comment the antispam rejects, nothing is written in the blog */
+#define LOAD_POST_BODY \
+	"author=Load&mail=&web=&text=Load+test&antispam_result=0" \
+	"&antispam_hash=0&submit=Post"
+
+enum ROUTE {
+	ROUTE_INDEX,
+	ROUTE_ARTICLE,
+	ROUTE_TAG,
+	ROUTE_RSS,
+	ROUTE_TAGS,
+	ROUTE_COMMENT,
+	ROUTE_OTHER,
+	ROUTE_MAX
+};
+
+static const char *route_names[ROUTE_MAX] = {
+	"index", "article", "tag", "rss", "tags", "comment", "other"
+};
+
+struct request {
+	char		*query;
+	char		*body;		/* NULL for GET */
+	enum ROUTE	 route;
+};
+
+struct route_stats {
+	double		*latencies;
+	unsigned long	 nb, size, errors;
+	unsigned long long bytes;
+};
+
+struct slot {
+	pid_t		 pid;
+	int		 fd;
+	struct request	*r;
+	double		 begin;
+	unsigned long long bytes;
+};
+
+static struct request *requests;
+static unsigned long nb_requests;
+static struct route_stats stats[ROUTE_MAX];
+static const char *binary, *encoding;
+static int use_chroot;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static enum ROUTE
+route_of(const char *query, const char *body)
+{
+	if (strstr(query, "article=") != NULL)
+		return body != NULL ? ROUTE_COMMENT : ROUTE_ARTICLE;
+	if (strstr(query, "page=rss") != NULL)
+		return ROUTE_RSS;
+	if (strstr(query, "page=tags") != NULL)
+		return ROUTE_TAGS;
+	if (strstr(query, "tag=") != NULL)
+		return ROUTE_TAG;
+	if (*query == '\0' || strncmp(query, "page=index", 10) == 0)
+		return ROUTE_INDEX;
+	return ROUTE_OTHER;
+}
+
+static void
+add_request(const char *query, const char *body)
+{
+	struct request *r;
+
+	if (nb_requests % 1024 == 0 && (requests = realloc(requests,
+	    (nb_requests + 1024) * sizeof(struct request))) == NULL)
+		err(1, "realloc");
+	r = &requests[nb_requests++];
+	if ((r->query = strdup(query)) == NULL)
+		err(1, "strdup");
+	r->body = NULL;
+	if (body != NULL && (r->body = strdup(body)) == NULL)
+		err(1, "strdup");
+	r->route = route_of(query, body);
+}
+
+static void
+read_requests(const char *file)
+{
+	char *buf, *lbuf, *query, *body, *p;
+	size_t len;
+	int post;
+	FILE *f;
+
+	if ((f = fopen(file, "r")) == NULL)
+		err(1, "fopen: %s", file);
+	lbuf = NULL;
+	while ((buf = fgetln(f, &len)) != NULL) {
+		if (buf[len - 1] == '\n')
+			buf[len - 1] = '\0';
+		else {
+			if ((lbuf = malloc(len + 1)) == NULL)
+				err(1, NULL);
+			memcpy(lbuf, buf, len);
+			lbuf[len] = '\0';
+			buf = lbuf;
+		}
+		post = 0;
+		if (strncmp(buf, "GET ", 4) == 0)
+			buf += 4;
+		else if (strncmp(buf, "POST ", 5) == 0) {
+			buf += 5;
+			post = 1;
+		}
+		query = buf + strspn(buf, " \t");
+		body = NULL;
+		if ((p = strpbrk(query, " \t")) != NULL) {
+			*p++ = '\0';
+			if (post)
+				body = p + strspn(p, " \t");
+		}
+		if (post && body == NULL)
+			body = "";
+		if ((p = strchr(query, '?')) != NULL)
+			query = p + 1;
+		else if (*query == '/')
+			query = "";
+		add_request(query, body);
+	}
+	free(lbuf);
+	fclose(f);
+	if (nb_requests == 0)
+		errx(1, "%s: no request", file);
+}
+
+/* with depth, the names are read from the subdirectories (YYYY/MM) */
+static unsigned long
+list_names(const char *path, char **names, unsigned long nb, int depth)
+{
+	char sub[MAXPATHLEN];
+	DIR *d;
+	struct dirent *e;
+
+	if ((d = opendir(path)) == NULL) {
+		warn("opendir: %s", path);
+		return nb;
+	}
+	while (nb < LOAD_MAX_NAMES && (e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.')
+			continue;
+		if (depth > 0) {
+			snprintf(sub, sizeof(sub), "%s/%s", path, e->d_name);
+			nb = list_names(sub, names, nb, depth - 1);
+		} else if ((names[nb++] = strdup(e->d_name)) == NULL)
+			err(1, "strdup");
+	}
+	closedir(d);
+	return nb;
+}
+
+/*
+ * The default mix: half of the requests on articles, the others on the
+ * index, the tags, the RSS feed, the list of tags and some comments.
+ */
+static void
+make_requests(unsigned long n)
+{
+	char *articles[LOAD_MAX_NAMES], *tags[LOAD_MAX_NAMES];
+	char query[MAXPATHLEN];
+	unsigned long i, nb_articles, nb_tags, r;
+
+#ifdef ARTICLES_SHARDED
+	nb_articles = list_names(CHROOT_DIR ARTICLES_DIR, articles, 0, 2);
+#else
+	nb_articles = list_names(CHROOT_DIR ARTICLES_DIR, articles, 0, 0);
+#endif
+	nb_tags = list_names(CHROOT_DIR TAGS_DIR, tags, 0, 0);
+	if (nb_articles == 0)
+		errx(1, "no article in %s", CHROOT_DIR ARTICLES_DIR);
+	srandom(n);
+	for (i = 0; i < n; ++i) {
+		r = random() % 100;
+		if (r < 50) {
+			snprintf(query, sizeof(query), "article=%s",
+			    articles[random() % nb_articles]);
+			add_request(query, NULL);
+		} else if (r < 65)
+			add_request("", NULL);
+		else if (r < 80 && nb_tags > 0) {
+			snprintf(query, sizeof(query), "tag=%s",
+			    tags[random() % nb_tags]);
+			add_request(query, NULL);
+		} else if (r < 90)
+			add_request("page=rss", NULL);
+		else if (r < 95)
+			add_request("page=tags", NULL);
+		else {
+			snprintf(query, sizeof(query), "article=%s",
+			    articles[random() % nb_articles]);
+			add_request(query, LOAD_POST_BODY);
+		}
+	}
+	for (i = 0; i < nb_articles; ++i)
+		free(articles[i]);
+	for (i = 0; i < nb_tags; ++i)
+		free(tags[i]);
+}
+
+static void
+child(struct request *r, int out)
+{
+	char len[32];
+	int in[2], null;
+
+	if (r->body != NULL) {
+		/* the bodies of comments are smaller than a pipe buffer */
+		if (pipe(in) == -1)
+			err(1, "pipe");
+		write(in[1], r->body, strlen(r->body));
+		close(in[1]);
+		dup2(in[0], STDIN_FILENO);
+		close(in[0]);
+		snprintf(len, sizeof(len), "%zu", strlen(r->body));
+		setenv("REQUEST_METHOD", "POST", 1);
+		setenv("CONTENT_LENGTH", len, 1);
+	} else
+		setenv("REQUEST_METHOD", "GET", 1);
+	setenv("QUERY_STRING", r->query, 1);
+	setenv("SERVER_NAME", "localhost", 1);
+	setenv("SCRIPT_NAME", "/cgi-bin/blog", 1);
+	setenv("REMOTE_ADDR", "127.0.0.1", 1);
+	if (encoding != NULL)
+		setenv("HTTP_ACCEPT_ENCODING", encoding, 1);
+	dup2(out, STDOUT_FILENO);
+	close(out);
+	if ((null = open("/dev/null", O_WRONLY)) != -1)
+		dup2(null, STDERR_FILENO);
+	if (use_chroot && (chroot(CHROOT_DIR) == -1 || chdir("/") == -1))
+		err(1, "chroot: %s", CHROOT_DIR);
+	execl(binary, binary, (char *)NULL);
+	_exit(127);
+}
+
+static void
+start(struct slot *s, struct request *r)
+{
+	int fds[2];
+
+	if (pipe(fds) == -1)
+		err(1, "pipe");
+	s->r = r;
+	s->bytes = 0;
+	s->begin = now();
+	switch ((s->pid = fork())) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		close(fds[0]);
+		child(r, fds[1]);
+	}
+	close(fds[1]);
+	s->fd = fds[0];
+}
+
+static void
+finish(struct slot *s)
+{
+	struct route_stats *rs;
+	int st;
+
+	close(s->fd);
+	s->fd = -1;
+	while (waitpid(s->pid, &st, 0) == -1)
+		if (errno != EINTR)
+			err(1, "waitpid");
+	rs = &stats[s->r->route];
+	if (rs->nb == rs->size) {
+		rs->size = rs->size == 0 ? 1024 : rs->size * 2;
+		if ((rs->latencies = realloc(rs->latencies,
+		    rs->size * sizeof(double))) == NULL)
+			err(1, "realloc");
+	}
+	rs->latencies[rs->nb++] = now() - s->begin;
+	rs->bytes += s->bytes;
+	if (!WIFEXITED(st) || WEXITSTATUS(st) != 0 || s->bytes == 0)
+		++rs->errors;
+}
+
+static void
+run(unsigned long n, unsigned long concurrency)
+{
+	struct slot slots[LOAD_MAX_CONCURRENCY];
+	struct pollfd pfds[LOAD_MAX_CONCURRENCY];
+	char buf[BUFSIZ];
+	unsigned long i, next, running;
+	ssize_t len;
+
+	for (i = 0; i < concurrency; ++i)
+		slots[i].fd = -1;
+	next = running = 0;
+	while (next < n || running > 0) {
+		for (i = 0; i < concurrency && next < n; ++i)
+			if (slots[i].fd == -1) {
+				start(&slots[i],
+				    &requests[next++ % nb_requests]);
+				++running;
+			}
+		for (i = 0; i < concurrency; ++i) {
+			pfds[i].fd = slots[i].fd;
+			pfds[i].events = POLLIN;
+		}
+		if (poll(pfds, concurrency, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		for (i = 0; i < concurrency; ++i) {
+			if (slots[i].fd == -1
+			    || !(pfds[i].revents & (POLLIN|POLLHUP|POLLERR)))
+				continue;
+			if ((len = read(slots[i].fd, buf, sizeof(buf))) > 0)
+				slots[i].bytes += len;
+			else {
+				finish(&slots[i]);
+				--running;
+			}
+		}
+	}
+}
+
+static int
+compar_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile(struct route_stats *rs, double p)
+{
+	unsigned long i;
+
+	i = p * rs->nb;
+	if (i >= rs->nb)
+		i = rs->nb - 1;
+	return rs->latencies[i] * 1e3;
+}
+
+static void
+report(double elapsed)
+{
+	struct route_stats *rs;
+	unsigned long i, total;
+
+	printf("%-8s %8s %7s %8s %8s %8s %8s %8s %10s\n", "route", "requests",
+	    "errors", "req/s", "p50 ms", "p95 ms", "p99 ms", "p999 ms",
+	    "bytes/req");
+	for (total = i = 0; i < ROUTE_MAX; ++i) {
+		rs = &stats[i];
+		if (rs->nb == 0)
+			continue;
+		total += rs->nb;
+		qsort(rs->latencies, rs->nb, sizeof(double), compar_double);
+		printf("%-8s %8lu %7lu %8.1f %8.2f %8.2f %8.2f %8.2f %10llu\n",
+		    route_names[i], rs->nb, rs->errors, rs->nb / elapsed,
+		    percentile(rs, 0.50), percentile(rs, 0.95),
+		    percentile(rs, 0.99), percentile(rs, 0.999),
+		    rs->bytes / rs->nb);
+		free(rs->latencies);
+	}
+	printf("%lu requests in %.2f s: %.1f req/s\n", total, elapsed,
+	    total / elapsed);
+}
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-rz] [-c concurrency] [-f file] "
+	    "[-n requests] [binary]\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *errstr, *file;
+	unsigned long i, n, concurrency;
+	double begin;
+	int ch;
+
+	file = NULL;
+	n = 1000;
+	concurrency = 4;
+	encoding = NULL;
+	use_chroot = 0;
+	while ((ch = getopt(argc, argv, "c:f:n:rz")) != -1)
+		switch (ch) {
+		case 'c':
+			concurrency = strtonum(optarg, 1, LOAD_MAX_CONCURRENCY,
+			    &errstr);
+			if (errstr != NULL)
+				errx(1, "concurrency: %s", errstr);
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'n':
+			n = strtonum(optarg, 1, 100000000, &errstr);
+			if (errstr != NULL)
+				errx(1, "requests: %s", errstr);
+			break;
+		case 'r':
+			use_chroot = 1;
+			break;
+		case 'z':
+			encoding = "gzip, deflate";
+			break;
+		default:
+			usage();
+		}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1)
+		usage();
+	binary = argc == 1 ? argv[0] : "./blog";
+	if (file != NULL)
+		read_requests(file);
+	else
+		make_requests(n);
+	signal(SIGPIPE, SIG_IGN);
+	begin = now();
+	run(n, concurrency);
+	report(now() - begin);
+	for (i = 0; i < nb_requests; ++i) {
+		free(requests[i].query);
+		free(requests[i].body);
+	}
+	free(requests);
+	return 0;
+}
@@ -0,0 +1,330 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2009 Colin Didier <cdidier@cybione.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Stress test of the rendering from several threads. The pages of a
+ * synthetic corpus are first rendered one after the other, then again and
+ * again by concurrent threads, each with its own render context, and every
+ * page must be the same as the one rendered alone. With -t, another thread
+ * meanwhile touches the directories of the articles and of the tags and
+ * packs the articles again, so that the caches shared by the renders are
+ * rebuilt under them.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../common.h"
+#include "../articles.h"
+#include "../output.h"
+#include "../pack.h"
+#include "bench.h"
+
+void render_page_article(struct article *, struct render *);
+void render_page_tag(struct tag *, struct render *);
+void render_page_tags(struct render *);
+void render_page_archive(struct tag *, struct render *);
+void render_rss(struct tag *, struct render *);
+
+/* globals of main.c */
+enum STATUS	 status;
+
+struct page {
+	const char	*route;
+	char		 arg[64];
+	char		*content;	/* rendered alone */
+	size_t		 len;
+};
+
+static struct corpus corpus;
+static struct page *pages;
+static unsigned long nb_pages, rounds;
+static unsigned long mismatches;
+static pthread_mutex_t mismatches_lock = PTHREAD_MUTEX_INITIALIZER;
+static int rendering;
+
+static void
+add_page(const char *route, const char *arg)
+{
+	struct page *p;
+
+	if ((p = reallocarray(pages, nb_pages + 1, sizeof(*p))) == NULL)
+		err(1, "reallocarray");
+	pages = p;
+	p = &pages[nb_pages++];
+	memset(p, 0, sizeof(*p));
+	p->route = route;
+	if (arg != NULL)
+		strlcpy(p->arg, arg, sizeof(p->arg));
+}
+
+static void
+render_page(struct render *r, const struct page *p)
+{
+	const char *tag;
+
+	tag = p->arg[0] != '\0' ? p->arg : NULL;
+	if (strcmp(p->route, "article") == 0)
+		read_article(p->arg, (article_cb *)render_page_article, r);
+	else if (strcmp(p->route, "tag") == 0)
+		read_tag(tag, 0, NB_ARTICLES, (tag_cb *)render_page_tag, r);
+	else if (strcmp(p->route, "tag_next") == 0)
+		read_tag(tag, 1, NB_ARTICLES, (tag_cb *)render_page_tag, r);
+	else if (strcmp(p->route, "rss") == 0)
+		read_tag(tag, 0, NB_ARTICLES, (tag_cb *)render_rss, r);
+	else if (strcmp(p->route, "archive") == 0)
+		read_archive(p->arg, 0, NB_ARTICLES,
+		    (tag_cb *)render_page_archive, r);
+	else if (strcmp(p->route, "tags") == 0)
+		render_page_tags(r);
+}
+
+/* the form of the comments differs at each second, drop its antispam */
+static size_t
+mask_antispam(char *buf, size_t len)
+{
+	char *line, *end, *next;
+
+	for (line = buf; line < buf + len; line = next) {
+		if ((end = memchr(line, '\n', buf + len - line)) == NULL)
+			end = buf + len;
+		next = end < buf + len ? end + 1 : end;
+		*end = '\0';
+		if (strstr(line, "antispam_") != NULL) {
+			memmove(line, next, buf + len - next);
+			len -= next - line;
+			next = line;
+		} else if (end < buf + len)
+			*end = '\n';
+	}
+	return len;
+}
+
+/* render the page in f, which is emptied first, and return its content */
+static char *
+render_to(FILE *f, const struct page *p, size_t *len)
+{
+	struct render r;
+	char *buf;
+	long l;
+
+	rewind(f);
+	if (ftruncate(fileno(f), 0) == -1)
+		err(1, "ftruncate");
+	render_init(&r, f);
+	render_page(&r, p);
+	fflush(f);
+	if ((l = ftell(f)) == -1)
+		err(1, "ftell");
+	if ((buf = malloc(l + 1)) == NULL)
+		err(1, "malloc");
+	rewind(f);
+	if (fread(buf, 1, l, f) != (size_t)l)
+		err(1, "fread");
+	buf[l] = '\0';
+	*len = mask_antispam(buf, l);
+	return buf;
+}
+
+static void *
+stress(void *arg)
+{
+	FILE *f;
+	struct page *p;
+	unsigned long i, n, id;
+	size_t len;
+	char *buf;
+
+	id = (unsigned long)arg;
+	if ((f = tmpfile()) == NULL)
+		err(1, "tmpfile");
+	/* each thread starts with another page */
+	for (n = 0; n < rounds; ++n)
+		for (i = 0; i < nb_pages; ++i) {
+			p = &pages[(i + id) % nb_pages];
+			buf = render_to(f, p, &len);
+			if (len != p->len
+			    || memcmp(buf, p->content, len) != 0) {
+				pthread_mutex_lock(&mismatches_lock);
+				if (mismatches++ < 10)
+					warnx("thread %lu: %s %s differs", id,
+					    p->route, p->arg);
+				pthread_mutex_unlock(&mismatches_lock);
+			}
+			free(buf);
+		}
+	fclose(f);
+	return NULL;
+}
+
+/* change the mtime of the directories, and replace the pack at times */
+static void *
+touch(void *arg)
+{
+	static const char *dirs[] = { CHROOT_DIR ARTICLES_DIR,
+	    CHROOT_DIR TAGS_DIR, CHROOT_DIR TAGS_DIR "/tag0" };
+	struct timespec delay;
+	unsigned long n, i, *touches;
+
+	touches = arg;
+	delay.tv_sec = 0;
+	delay.tv_nsec = 10000000;
+	for (n = 0; __atomic_load_n(&rendering, __ATOMIC_RELAXED);
+	    ++n) {
+		for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); ++i)
+			if (utimensat(AT_FDCWD, dirs[i], NULL, 0) == -1)
+				warn("utimensat: %s", dirs[i]);
+		/* the pack is newer than the articles for a while */
+		if (n % 50 == 25)
+			build_pack();
+		++*touches;
+		nanosleep(&delay, NULL);
+	}
+	return NULL;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-t] [-n rounds] [-j threads] size\n",
+	    __progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct article_list l;
+	pthread_t *threads, toucher;
+	unsigned long nb_threads, i, touches;
+	const char *errstr;
+	char period[ARCHIVE_LEN];
+	double begin, elapsed;
+	FILE *f;
+	int ch, tflag;
+
+	status = STATUS_FROMCMD;
+	nb_threads = 8;
+	rounds = 20;
+	tflag = 0;
+	while ((ch = getopt(argc, argv, "j:n:t")) != -1)
+		switch (ch) {
+		case 'j':
+			nb_threads = strtonum(optarg, 1, 1024, &errstr);
+			if (errstr != NULL)
+				errx(1, "threads: %s", errstr);
+			break;
+		case 'n':
+			rounds = strtonum(optarg, 1, LONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "rounds: %s", errstr);
+			break;
+		case 't':
+			tflag = 1;
+			break;
+		default:
+			usage();
+		}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+	corpus.articles = strtonum(argv[0], 1, 10000000, &errstr);
+	if (errstr != NULL)
+		errx(1, "size: %s", errstr);
+	corpus.tags = 10;
+	corpus.tags_per_article = 2;
+	corpus.comments = 5;
+	fprintf(stderr, "generating %lu articles in %s\n", corpus.articles,
+	    CHROOT_DIR BASE_DIR);
+	if (make_corpus(&corpus) == -1)
+		errx(1, "cannot generate the corpus");
+
+	if (list_articles(NULL, &l) == -1 || l.nb == 0)
+		errx(1, "no article");
+	add_page("article", l.names[0]);
+	add_page("article", corpus.middle);
+	add_page("article", l.names[l.nb - 1]);
+	strlcpy(period, corpus.middle, sizeof(period));
+	add_page("archive", period);
+	free_article_list(&l);
+	add_page("tag", NULL);
+	add_page("tag_next", NULL);
+	add_page("tag", "tag0");
+	add_page("tag_next", "tag1");
+	add_page("rss", NULL);
+	add_page("rss", "tag2");
+	add_page("tags", NULL);
+
+	if ((f = tmpfile()) == NULL)
+		err(1, "tmpfile");
+	for (i = 0; i < nb_pages; ++i)
+		pages[i].content = render_to(f, &pages[i], &pages[i].len);
+	fclose(f);
+
+	if ((threads = calloc(nb_threads, sizeof(pthread_t))) == NULL)
+		err(1, "calloc");
+	touches = 0;
+	__atomic_store_n(&rendering, 1, __ATOMIC_RELAXED);
+	if (tflag && (errno = pthread_create(&toucher, NULL, touch,
+	    &touches)) != 0)
+		err(1, "pthread_create");
+	begin = now();
+	for (i = 0; i < nb_threads; ++i)
+		if ((errno = pthread_create(&threads[i], NULL, stress,
+		    (void *)i)) != 0)
+			err(1, "pthread_create");
+	for (i = 0; i < nb_threads; ++i)
+		pthread_join(threads[i], NULL);
+	elapsed = now() - begin;
+	__atomic_store_n(&rendering, 0, __ATOMIC_RELAXED);
+	if (tflag)
+		pthread_join(toucher, NULL);
+	printf("%lu pages x %lu rounds on %lu threads: %.3f s, %.0f pages/s, "
+	    "%lu mismatches", nb_pages, rounds, nb_threads, elapsed,
+	    nb_pages * rounds * nb_threads / elapsed, mismatches);
+	if (tflag)
+		printf(", %lu touches", touches);
+	putchar('\n');
+
+	for (i = 0; i < nb_pages; ++i)
+		free(pages[i].content);
+	free(pages);
+	free(threads);
+	return mismatches != 0;
+}
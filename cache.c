@@ -0,0 +1,855 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2009 Colin Didier <cdidier@cybione.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Cache of the pages rendered by the CGI, shared by the processes in the
+ * file PAGE_CACHE. The file is mapped in memory and contains:
+ *	- a header, with the position where the next entry is written;
+ *	- a table of slots indexed by the hash of the normalized query,
+ *	  pointing to the entries;
+ *	- the entries, written in a ring: the normalized query, the content
+ *	  type, the files the page depends on with their mtime and size, the
+ *	  page and the page compressed with gzip.
+ *
+ * The readers do not lock anything: a slot is protected by a sequence
+ * number, odd while the slot is written, and an entry is still intact if
+ * the ring has not been written past it since. A single writer at a time
+ * holds a fcntl(2) lock on the file; the others just don't fill the cache.
+ * A hit costs an open, a lookup in the mapping, a stat of each dependency
+ * and a write.
+ *
+ * A process rendering several requests keeps the same entries in memory
+ * too, up to MEMORY_CACHE_SIZE, and drops the least recently used first.
+ * An entry is dropped as soon as one of its dependencies changed, or
+ * when cache_invalidate() is called with one of them.
+ *
+ * The dependencies of a page are captured in its struct render. The
+ * readers of the files only see the path, they find the capture of the
+ * render of their thread with cache_depend().
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "cache.h"
+#include "output.h"
+#include "timing.h"
+
+#define CACHE_MAGIC		"CLOGPC1"
+#define CACHE_MAX_DEPS		128
+#define CACHE_MAX_KEY		1024
+#define CACHE_BUCKETS		256
+
+#define BARRIER()		__sync_synchronize()
+#define ALIGN8(x)		(((x) + 7) & ~(size_t)7)
+
+struct cache_header {
+	char		 magic[8];
+	u_int32_t	 nb_slots;
+	u_int32_t	 pad;
+	u_int64_t	 data_size;
+	volatile u_int64_t head;	/* where the next entry is written */
+};
+
+struct cache_slot {
+	volatile u_int32_t seq;
+	u_int32_t	 hash;
+	u_int64_t	 pos;		/* position of the entry in the ring */
+	u_int32_t	 len;
+	u_int32_t	 pad;
+};
+
+/* followed by the key, the type, the dependencies and the bodies */
+struct cache_entry {
+	u_int32_t	 key_len, type_len, nb_deps;
+	u_int32_t	 identity_len, gzip_len;
+	u_int32_t	 pad;
+};
+
+/* followed by the path */
+struct cache_dep {
+	int64_t		 mtime, mtime_nsec, size;
+	u_int32_t	 path_len;
+	u_int32_t	 pad;
+};
+
+struct dep {
+	char		*path;
+	struct stat	 sb;
+};
+
+/* the normalized query of a page */
+struct cache_key {
+	char		 s[CACHE_MAX_KEY];
+	size_t		 len;
+};
+
+/* what the page being rendered depends on, see cache_begin() */
+struct cache_capture {
+	struct cache_key key;
+	struct dep	 deps[CACHE_MAX_DEPS];
+	unsigned long	 nb_deps;
+	int		 overflow;
+};
+
+/* an entry of the memory cache, in the format of the file */
+struct mem_entry {
+	TAILQ_ENTRY(mem_entry)	 lru;
+	LIST_ENTRY(mem_entry)	 bucket;
+	u_int32_t		 hash;
+	size_t			 len;
+	char			*buf;
+};
+
+/* what an entry points to */
+struct page {
+	const char	*type, *identity, *gzip;
+	size_t		 type_len, identity_len, gzip_len;
+};
+
+static TAILQ_HEAD(mem_lru_head, mem_entry) mem_lru =
+    TAILQ_HEAD_INITIALIZER(mem_lru);
+static LIST_HEAD(, mem_entry) mem_buckets[CACHE_BUCKETS];
+static size_t mem_size, mem_used;
+static unsigned long mem_entries, mem_hits, mem_misses, mem_evictions,
+    mem_invalidations;
+/* the memory cache is shared by the renders */
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the capture of the render of the thread */
+static pthread_key_t capture_key;
+static pthread_once_t capture_once = PTHREAD_ONCE_INIT;
+
+extern enum STATUS status;
+
+static u_int32_t
+hash_key(const char *s, size_t len)
+{
+	u_int32_t h;
+
+	for (h = 2166136261U; len > 0; --len, ++s)
+		h = (h ^ (unsigned char)*s) * 16777619U;
+	return h;
+}
+
+static int
+compar_params(const void *p1, const void *p2)
+{
+	const struct query_param *q1 = *(struct query_param * const *)p1;
+	const struct query_param *q2 = *(struct query_param * const *)p2;
+	int r;
+
+	if ((r = strcmp(q1->key, q2->key)) != 0)
+		return r;
+	return strcmp(q1->value != NULL ? q1->value : "",
+	    q2->value != NULL ? q2->value : "");
+}
+
+/* the parameters sorted by name, the order of the query does not matter */
+static int
+normalize_query(struct query *q, struct cache_key *k)
+{
+	struct query_param *qp, *params[32];
+	unsigned long i, nb;
+	int len;
+
+	nb = 0;
+	if (q != NULL)
+		SLIST_FOREACH(qp, &q->params, next) {
+			if (nb == sizeof(params)/sizeof(params[0]))
+				return -1;
+			params[nb++] = qp;
+		}
+	qsort(params, nb, sizeof(params[0]), compar_params);
+	k->len = 0;
+	for (i = 0; i < nb; ++i) {
+		len = snprintf(k->s + k->len, sizeof(k->s) - k->len, "%s%s=%s",
+		    i > 0 ? "&" : "", params[i]->key,
+		    params[i]->value != NULL ? params[i]->value : "");
+		if (len < 0 || (size_t)len >= sizeof(k->s) - k->len)
+			return -1;
+		k->len += len;
+	}
+	return 0;
+}
+
+static int
+accepts_gzip(void)
+{
+	char *env;
+
+	return (env = getenv("HTTP_ACCEPT_ENCODING")) != NULL
+	    && strstr(env, "gzip") != NULL;
+}
+
+
+/* the file is only used by the CGI */
+static int
+shared_cache(void)
+{
+#ifdef PAGE_CACHE
+	return !(status & STATUS_FROMCMD);
+#else
+	return 0;
+#endif
+}
+
+static void
+send_page(const struct page *pg, FILE *out)
+{
+	char header[256];
+	struct iovec iov[2];
+	ssize_t w;
+	int len, gz;
+
+	TIMING_FIRST_BYTE();
+	/* no headers from the command line */
+	if (status & STATUS_FROMCMD) {
+		fwrite(pg->identity, 1, pg->identity_len, out);
+		return;
+	}
+	gz = pg->gzip_len != 0 && accepts_gzip();
+	len = snprintf(header, sizeof(header), "%sContent-type: %.*s;charset="
+	    CHARSET "\r\n\r\n", gz ? "Content-Encoding: gzip\r\n" : "",
+	    (int)pg->type_len, pg->type);
+	if (len < 0 || (size_t)len >= sizeof(header))
+		return;
+	fflush(out);
+	iov[0].iov_base = header;
+	iov[0].iov_len = len;
+	iov[1].iov_base = (void *)(gz ? pg->gzip : pg->identity);
+	iov[1].iov_len = gz ? pg->gzip_len : pg->identity_len;
+	while (iov[0].iov_len + iov[1].iov_len > 0) {
+		if ((w = writev(fileno(out), iov, 2)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		if ((size_t)w >= iov[0].iov_len) {
+			w -= iov[0].iov_len;
+			iov[0].iov_len = 0;
+			iov[1].iov_base = (char *)iov[1].iov_base + w;
+			iov[1].iov_len -= w;
+		} else {
+			iov[0].iov_base = (char *)iov[0].iov_base + w;
+			iov[0].iov_len -= w;
+		}
+	}
+}
+
+static void *
+map_cache(int fd, int prot, size_t *size)
+{
+	struct stat sb;
+	void *p;
+
+	*size = sizeof(struct cache_header)
+	    + PAGE_CACHE_SLOTS * sizeof(struct cache_slot) + PAGE_CACHE_SIZE;
+	if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < *size)
+		return NULL;
+	p = mmap(NULL, *size, prot, MAP_SHARED, fd, 0);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static int
+open_cache(int flags)
+{
+#ifdef PAGE_CACHE
+	return open(PAGE_CACHE, flags, 0600);
+#else
+	(void)flags;
+	return -1;
+#endif
+}
+
+/* check the dependencies of an entry, return the end of them */
+static const char *
+check_deps(const char *p, const char *end, u_int32_t nb)
+{
+	struct cache_dep d;
+	char path[MAXPATHLEN];
+	struct stat sb;
+
+	for (; nb > 0; --nb) {
+		if (end - p < (ptrdiff_t)sizeof(d))
+			return NULL;
+		memcpy(&d, p, sizeof(d));
+		p += sizeof(d);
+		if (d.path_len >= sizeof(path)
+		    || end - p < (ptrdiff_t)ALIGN8(d.path_len))
+			return NULL;
+		memcpy(path, p, d.path_len);
+		path[d.path_len] = '\0';
+		p += ALIGN8(d.path_len);
+		if (stat(path, &sb) == -1) {
+			if (d.size != -1)
+				return NULL;
+		} else if (d.size != sb.st_size || d.mtime != sb.st_mtime
+		    || d.mtime_nsec != sb.st_mtim.tv_nsec)
+			return NULL;
+	}
+	return p;
+}
+
+static int
+same_key(const char *buf, size_t len, const struct cache_key *k)
+{
+	struct cache_entry e;
+
+	if (len < sizeof(e))
+		return 0;
+	memcpy(&e, buf, sizeof(e));
+	return e.key_len == k->len && len - sizeof(e) >= ALIGN8(e.key_len)
+	    + ALIGN8(e.type_len) && memcmp(buf + sizeof(e), k->s, k->len) == 0;
+}
+
+/*
+ * Return -1 if the entry is not the one of the query, 0 if it is out of
+ * date, and 1 if pg points to its page.
+ */
+static int
+read_entry(const char *buf, size_t len, const struct cache_key *k,
+    struct page *pg)
+{
+	struct cache_entry e;
+	const char *p, *end;
+
+	if (!same_key(buf, len, k))
+		return -1;
+	memcpy(&e, buf, sizeof(e));
+	p = buf + sizeof(e) + ALIGN8(e.key_len);
+	end = buf + len;
+	pg->type = p;
+	pg->type_len = e.type_len;
+	p += ALIGN8(e.type_len);
+	if ((p = check_deps(p, end, e.nb_deps)) == NULL
+	    || (size_t)(end - p) < e.identity_len + e.gzip_len)
+		return 0;
+	pg->identity = p;
+	pg->identity_len = e.identity_len;
+	pg->gzip = p + e.identity_len;
+	pg->gzip_len = e.gzip_len;
+	return 1;
+}
+
+static int
+depends_on(const char *buf, size_t len, const char *path)
+{
+	struct cache_entry e;
+	struct cache_dep d;
+	const char *p, *end;
+	size_t path_len;
+	u_int32_t i;
+
+	memcpy(&e, buf, sizeof(e));
+	p = buf + sizeof(e) + ALIGN8(e.key_len) + ALIGN8(e.type_len);
+	end = buf + len;
+	path_len = strlen(path);
+	for (i = 0; i < e.nb_deps && end - p >= (ptrdiff_t)sizeof(d); ++i) {
+		memcpy(&d, p, sizeof(d));
+		p += sizeof(d);
+		if (d.path_len == path_len && memcmp(p, path, path_len) == 0)
+			return 1;
+		p += ALIGN8(d.path_len);
+	}
+	return 0;
+}
+
+static int
+shared_serve(const struct cache_key *k, u_int32_t hash, FILE *out)
+{
+	struct cache_header *h;
+	struct cache_slot *s;
+	struct page pg;
+	char *map, *data, *buf;
+	size_t size;
+	u_int32_t seq, len;
+	u_int64_t pos;
+	int fd, served;
+
+	if ((fd = open_cache(O_RDONLY)) == -1)
+		return 0;
+	map = map_cache(fd, PROT_READ, &size);
+	close(fd);
+	if (map == NULL)
+		return 0;
+	served = 0;
+	buf = NULL;
+	h = (struct cache_header *)map;
+	if (memcmp(h->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+	    || h->nb_slots != PAGE_CACHE_SLOTS
+	    || h->data_size != PAGE_CACHE_SIZE)
+		goto out;
+	s = (struct cache_slot *)(h + 1) + hash % PAGE_CACHE_SLOTS;
+	data = (char *)((struct cache_slot *)(h + 1) + PAGE_CACHE_SLOTS);
+	seq = s->seq;
+	BARRIER();
+	pos = s->pos;
+	len = s->len;
+	if (seq & 1 || s->hash != hash || len == 0 || len > PAGE_CACHE_SIZE
+	    || pos % PAGE_CACHE_SIZE + len > PAGE_CACHE_SIZE)
+		goto out;
+	if ((buf = malloc(len)) == NULL)
+		goto out;
+	memcpy(buf, data + pos % PAGE_CACHE_SIZE, len);
+	BARRIER();
+	/* the slot was rewritten or the ring went over the entry */
+	if (s->seq != seq || h->head > pos + PAGE_CACHE_SIZE)
+		goto out;
+	if (read_entry(buf, len, k, &pg) == 1) {
+		send_page(&pg, out);
+		served = 1;
+	}
+out:	free(buf);
+	munmap(map, size);
+	return served;
+}
+
+static void
+mem_remove(struct mem_entry *me)
+{
+	TAILQ_REMOVE(&mem_lru, me, lru);
+	LIST_REMOVE(me, bucket);
+	mem_used -= sizeof(*me) + me->len;
+	--mem_entries;
+	free(me->buf);
+	free(me);
+}
+
+/* drop the entries of the query, with mem_lock held */
+static void
+mem_drop(const struct cache_key *k, u_int32_t hash)
+{
+	struct mem_entry *me, *next;
+
+	for (me = LIST_FIRST(&mem_buckets[hash % CACHE_BUCKETS]); me != NULL;
+	    me = next) {
+		next = LIST_NEXT(me, bucket);
+		if (me->hash == hash && same_key(me->buf, me->len, k))
+			mem_remove(me);
+	}
+}
+
+/*
+ * The entry is copied under the lock, another render may drop it: its
+ * dependencies are checked and the page is sent without the lock.
+ */
+static int
+mem_serve(const struct cache_key *k, u_int32_t hash, FILE *out)
+{
+	struct mem_entry *me;
+	struct page pg;
+	char *buf;
+	size_t len;
+	int r;
+
+	buf = NULL;
+	pthread_mutex_lock(&mem_lock);
+	LIST_FOREACH(me, &mem_buckets[hash % CACHE_BUCKETS], bucket)
+		if (me->hash == hash && same_key(me->buf, me->len, k))
+			break;
+	if (me != NULL && (buf = malloc(me->len)) != NULL) {
+		memcpy(buf, me->buf, me->len);
+		len = me->len;
+		TAILQ_REMOVE(&mem_lru, me, lru);
+		TAILQ_INSERT_HEAD(&mem_lru, me, lru);
+	}
+	pthread_mutex_unlock(&mem_lock);
+	r = buf != NULL ? read_entry(buf, len, k, &pg) : -1;
+	if (r == 1)
+		send_page(&pg, out);
+	pthread_mutex_lock(&mem_lock);
+	if (r == 0) {
+		mem_drop(k, hash);
+		++mem_invalidations;
+	}
+	if (r == 1)
+		++mem_hits;
+	else
+		++mem_misses;
+	pthread_mutex_unlock(&mem_lock);
+	free(buf);
+	return r == 1;
+}
+
+/* keep the entry in buf, which is freed with it */
+static void
+mem_keep(const struct cache_key *k, u_int32_t hash, char *buf, size_t len)
+{
+	struct mem_entry *me;
+
+	/* a page must not push out most of the others */
+	if (sizeof(*me) + len > mem_size / 4
+	    || (me = malloc(sizeof(*me))) == NULL) {
+		free(buf);
+		return;
+	}
+	pthread_mutex_lock(&mem_lock);
+	mem_drop(k, hash);
+	while (mem_used + sizeof(*me) + len > mem_size
+	    && !TAILQ_EMPTY(&mem_lru)) {
+		mem_remove(TAILQ_LAST(&mem_lru, mem_lru_head));
+		++mem_evictions;
+	}
+	me->hash = hash;
+	me->buf = buf;
+	me->len = len;
+	TAILQ_INSERT_HEAD(&mem_lru, me, lru);
+	LIST_INSERT_HEAD(&mem_buckets[hash % CACHE_BUCKETS], me, bucket);
+	mem_used += sizeof(*me) + len;
+	++mem_entries;
+	pthread_mutex_unlock(&mem_lock);
+}
+
+/* keep up to size bytes of pages in memory */
+void
+cache_memory(size_t size)
+{
+	mem_size = size;
+}
+
+/* send the cached page of the query of r to out */
+int
+cache_serve(struct render *r, FILE *out)
+{
+	struct cache_key k;
+	u_int32_t hash;
+
+	if (mem_size == 0 && !shared_cache())
+		return 0;
+	if (normalize_query(r->query_get, &k) == -1)
+		return 0;
+	hash = hash_key(k.s, k.len);
+	if (mem_size != 0 && mem_serve(&k, hash, out))
+		return 1;
+	return shared_cache() && shared_serve(&k, hash, out);
+}
+
+static void
+make_capture_key(void)
+{
+	if (pthread_key_create(&capture_key, NULL) != 0)
+		err(1, "pthread_key_create");
+}
+
+/* capture the dependencies of the page of r, rendered by this thread */
+void
+cache_begin(struct render *r)
+{
+	struct cache_capture *c;
+
+	if (mem_size == 0 && !shared_cache())
+		return;
+	pthread_once(&capture_once, make_capture_key);
+	if ((c = malloc(sizeof(*c))) == NULL)
+		return;
+	if (normalize_query(r->query_get, &c->key) == -1) {
+		free(c);
+		return;
+	}
+	c->nb_deps = 0;
+	c->overflow = 0;
+	r->capture = c;
+	pthread_setspecific(capture_key, c);
+}
+
+/* the page rendered by this thread is kept in the cache */
+int
+cache_capturing(void)
+{
+	pthread_once(&capture_once, make_capture_key);
+	return pthread_getspecific(capture_key) != NULL;
+}
+
+void
+cache_depend(const char *path)
+{
+	struct cache_capture *c;
+	unsigned long i;
+
+	pthread_once(&capture_once, make_capture_key);
+	if ((c = pthread_getspecific(capture_key)) == NULL)
+		return;
+	for (i = 0; i < c->nb_deps; ++i)
+		if (strcmp(c->deps[i].path, path) == 0)
+			return;
+	if (c->nb_deps == CACHE_MAX_DEPS) {
+		c->overflow = 1;
+		return;
+	}
+	if ((c->deps[c->nb_deps].path = strdup(path)) == NULL) {
+		c->overflow = 1;
+		return;
+	}
+	/* a missing file is a dependency too, it may be created */
+	if (stat(path, &c->deps[c->nb_deps].sb) == -1)
+		c->deps[c->nb_deps].sb.st_size = -1;
+	++c->nb_deps;
+}
+
+/* drop the pages kept in memory which depend on path */
+void
+cache_invalidate(const char *path)
+{
+	struct mem_entry *me, *next;
+
+	pthread_mutex_lock(&mem_lock);
+	for (me = TAILQ_FIRST(&mem_lru); me != NULL; me = next) {
+		next = TAILQ_NEXT(me, lru);
+		if (depends_on(me->buf, me->len, path)) {
+			mem_remove(me);
+			++mem_invalidations;
+		}
+	}
+	pthread_mutex_unlock(&mem_lock);
+}
+
+void
+cache_report(FILE *f)
+{
+	pthread_mutex_lock(&mem_lock);
+	fprintf(f, "cache hits=%lu misses=%lu evictions=%lu invalidations=%lu "
+	    "entries=%lu bytes=%lu\n", mem_hits, mem_misses, mem_evictions,
+	    mem_invalidations, mem_entries, (unsigned long)mem_used);
+	pthread_mutex_unlock(&mem_lock);
+}
+
+static char *
+gzip_page(const char *page, size_t len, size_t *gzip_len)
+{
+	z_stream z;
+	char *out;
+	uLong bound;
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY)
+	    != Z_OK)
+		return NULL;
+	bound = deflateBound(&z, len) + 32;
+	if ((out = malloc(bound)) == NULL) {
+		deflateEnd(&z);
+		return NULL;
+	}
+	z.next_in = (Bytef *)page;
+	z.avail_in = len;
+	z.next_out = (Bytef *)out;
+	z.avail_out = bound;
+	if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&z);
+		free(out);
+		return NULL;
+	}
+	*gzip_len = z.total_out;
+	deflateEnd(&z);
+	return out;
+}
+
+/* the entry of the page being rendered, in a buffer of len bytes */
+static char *
+make_entry(const struct cache_capture *c, const struct page *pg, size_t *len)
+{
+	struct cache_entry e;
+	struct cache_dep d;
+	char *buf, *p;
+	unsigned long i;
+
+	*len = sizeof(e) + ALIGN8(c->key.len) + ALIGN8(pg->type_len)
+	    + pg->identity_len + pg->gzip_len;
+	for (i = 0; i < c->nb_deps; ++i)
+		*len += sizeof(d) + ALIGN8(strlen(c->deps[i].path));
+	*len = ALIGN8(*len);
+	if ((p = buf = calloc(1, *len)) == NULL)
+		return NULL;
+	memset(&e, 0, sizeof(e));
+	e.key_len = c->key.len;
+	e.type_len = pg->type_len;
+	e.nb_deps = c->nb_deps;
+	e.identity_len = pg->identity_len;
+	e.gzip_len = pg->gzip_len;
+	memcpy(p, &e, sizeof(e));
+	p += sizeof(e);
+	memcpy(p, c->key.s, c->key.len);
+	p += ALIGN8(c->key.len);
+	memcpy(p, pg->type, pg->type_len);
+	p += ALIGN8(pg->type_len);
+	for (i = 0; i < c->nb_deps; ++i) {
+		memset(&d, 0, sizeof(d));
+		d.size = c->deps[i].sb.st_size;
+		if (d.size != -1) {
+			d.mtime = c->deps[i].sb.st_mtime;
+			d.mtime_nsec = c->deps[i].sb.st_mtim.tv_nsec;
+		}
+		d.path_len = strlen(c->deps[i].path);
+		memcpy(p, &d, sizeof(d));
+		p += sizeof(d);
+		memcpy(p, c->deps[i].path, d.path_len);
+		p += ALIGN8(d.path_len);
+	}
+	memcpy(p, pg->identity, pg->identity_len);
+	memcpy(p + pg->identity_len, pg->gzip, pg->gzip_len);
+	return buf;
+}
+
+static void
+write_entry(u_int32_t hash, const char *buf, size_t len)
+{
+	struct cache_header *h;
+	struct cache_slot *s;
+	struct flock fl;
+	char *map, *data;
+	size_t size;
+	u_int64_t pos;
+	int fd;
+
+	/* a page must not push out most of the others */
+	if (len > PAGE_CACHE_SIZE / 4)
+		return;
+	if ((fd = open_cache(O_RDWR|O_CREAT)) == -1)
+		return;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	/* only one writer, the others don't wait */
+	if (fcntl(fd, F_SETLK, &fl) == -1) {
+		close(fd);
+		return;
+	}
+	/* map_cache() sets the size even if the file is too small */
+	if ((map = map_cache(fd, PROT_READ|PROT_WRITE, &size)) == NULL) {
+		if (ftruncate(fd, size) == -1 || (map = map_cache(fd,
+		    PROT_READ|PROT_WRITE, &size)) == NULL)
+			goto out;
+	}
+	h = (struct cache_header *)map;
+	if (memcmp(h->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+	    || h->nb_slots != PAGE_CACHE_SLOTS
+	    || h->data_size != PAGE_CACHE_SIZE) {
+		memset(map, 0, sizeof(struct cache_header)
+		    + PAGE_CACHE_SLOTS * sizeof(struct cache_slot));
+		h->nb_slots = PAGE_CACHE_SLOTS;
+		h->data_size = PAGE_CACHE_SIZE;
+		BARRIER();
+		memcpy(h->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	}
+	s = (struct cache_slot *)(h + 1) + hash % PAGE_CACHE_SLOTS;
+	data = (char *)((struct cache_slot *)(h + 1) + PAGE_CACHE_SLOTS);
+	s->seq |= 1;
+	BARRIER();
+	/* reserve the space before writing in it, see shared_serve() */
+	pos = h->head;
+	if (pos % PAGE_CACHE_SIZE + len > PAGE_CACHE_SIZE)
+		pos += PAGE_CACHE_SIZE - pos % PAGE_CACHE_SIZE;
+	h->head = pos + len;
+	BARRIER();
+	memcpy(data + pos % PAGE_CACHE_SIZE, buf, len);
+	s->hash = hash;
+	s->pos = pos;
+	s->len = len;
+	BARRIER();
+	++s->seq;
+	munmap(map, size);
+out:	fl.l_type = F_UNLCK;
+	fcntl(fd, F_SETLK, &fl);
+	close(fd);
+}
+
+/*
+ * Called by close_output() with the rendered page: send it (to out from the
+ * command line) and keep it in the caches.
+ */
+void
+cache_store(struct render *r, const char *type, FILE *body, FILE *out)
+{
+	struct cache_capture *c = r->capture;
+	struct page pg;
+	char *page, *gzip, *entry, buf[BUFSIZ];
+	size_t page_len, gzip_len, len;
+	u_int32_t hash;
+	long l;
+
+	page = gzip = NULL;
+	gzip_len = 0;
+	fflush(body);
+	if ((l = ftell(body)) == -1 || (page = malloc(l + 1)) == NULL)
+		goto copy;
+	page_len = l;
+	rewind(body);
+	if (fread(page, 1, page_len, body) != page_len)
+		goto copy;
+	gzip = gzip_page(page, page_len, &gzip_len);
+	pg.type = type;
+	pg.type_len = strlen(type);
+	pg.identity = page;
+	pg.identity_len = page_len;
+	pg.gzip = gzip;
+	pg.gzip_len = gzip_len;
+	send_page(&pg, out);
+	if (!c->overflow && gzip != NULL
+	    && (entry = make_entry(c, &pg, &len)) != NULL) {
+		hash = hash_key(c->key.s, c->key.len);
+		if (shared_cache())
+			write_entry(hash, entry, len);
+		if (mem_size != 0)
+			mem_keep(&c->key, hash, entry, len);
+		else
+			free(entry);
+	}
+	free(page);
+	free(gzip);
+	return;
+
+copy:	/* send it as is */
+	free(page);
+	if (!(status & STATUS_FROMCMD))
+		fprintf(out, "Content-type: %s;charset=" CHARSET "\r\n\r\n",
+		    type);
+	rewind(body);
+	while ((len = fread(buf, 1, sizeof(buf), body)) > 0)
+		fwrite(buf, 1, len, out);
+	fflush(out);
+}
+
+void
+cache_end(struct render *r)
+{
+	struct cache_capture *c;
+	unsigned long i;
+
+	if ((c = r->capture) == NULL)
+		return;
+	for (i = 0; i < c->nb_deps; ++i)
+		free(c->deps[i].path);
+	free(c);
+	r->capture = NULL;
+	pthread_setspecific(capture_key, NULL);
+}
@@ -0,0 +1,23 @@
+/* $Id$ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+
+struct render;
+
+/* the page being rendered by this thread depends on this file */
+#define CACHE_DEPEND(path)	cache_depend(path)
+
+void	cache_memory(size_t);
+int	cache_serve(struct render *, FILE *);
+void	cache_begin(struct render *);
+int	cache_capturing(void);
+void	cache_depend(const char *);
+void	cache_invalidate(const char *);
+void	cache_store(struct render *, const char *, FILE *, FILE *);
+void	cache_end(struct render *);
+void	cache_report(FILE *);
+
+#endif
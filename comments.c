@@ -32,6 +32,11 @@
 #include "common.h"
 #include "antispam.h"
 #include "comments.h"
+#include "cache.h"
+#include "output.h"
+#include "probes.h"
+#include "site.h"
+#include "timing.h"
 
 void	strchomp(char *);
 time_t	rfc822_date(char *);
@@ -49,18 +54,29 @@ time_t	rfc822_date(char *);
 #define TEXT_LEN	2048
 #define MAX_COMMENT_LEN	(4*INPUT_LEN+TEXT_LEN+128)
 
+PROBE_SEMAPHORE(comment__lock__start)
+PROBE_SEMAPHORE(comment__lock__end)
+PROBE_SEMAPHORE(comments__parse__start)
+PROBE_SEMAPHORE(comments__parse__end)
+
+static void
+comments_path(char *path, const char *article)
+{
+	article_path(path, article, "comments");
+}
+
 static FILE *
 open_comments_file(const char *article, const char *mode)
 {
 	char path[MAXPATHLEN];
 	int fd;
 	FILE *f;
-	extern char status;
 
-	snprintf(path, MAXPATHLEN, "%s" ARTICLES_DIR "/%s/comments",
-	    status & STATUS_FROMCMD ? CHROOT_DIR : "", article);
-	if ((fd = open(path,
-	    mode == MODE_APPEND ? O_WRONLY|O_APPEND : O_RDONLY , 0)) == -1)
+	comments_path(path, article);
+	if (strcmp(mode, MODE_READ) == 0)
+		CACHE_DEPEND(path);
+	if ((fd = open(path, strcmp(mode, MODE_APPEND) == 0 ?
+	    O_WRONLY|O_APPEND : O_RDONLY, 0)) == -1)
 		return NULL;
 	if ((f = fdopen(fd, mode)) == NULL) {
 		close(fd);
@@ -73,7 +89,10 @@ int
 are_comments_writable(const char *article)
 {
 	FILE *f;
+	int writable;
 
+	if (site_comments(article, NULL, NULL, &writable) == 0)
+		return writable;
 	if ((f = open_comments_file(article, MODE_APPEND)) == NULL)
 		return 0;
 	fclose(f);
@@ -101,8 +120,12 @@ write_comment(const char *article, const char *author, const char *mail,
 	fl.l_start = 0;
 	fl.l_len = 0;
 	fl.l_pid = getpid();
-	if (fcntl(fd, F_SETLKW, &fl) == -1)
+	PROBE1(comment__lock__start, article);
+	if (fcntl(fd, F_SETLKW, &fl) == -1) {
+		PROBE2(comment__lock__end, article, -1);
 		goto err;
+	}
+	PROBE2(comment__lock__end, article, 0);
 	if (gethostname(host, MAXHOSTNAMELEN) == -1)
 		goto err2;
 	time(&now);
@@ -154,63 +177,65 @@ err:	if (f != NULL)
 	return -1;
 }
 
+/* the error and the posted form are kept in the render, for the page */
 int
-post_comment(const char *article)
+post_comment(struct render *r, const char *article)
 {
-	char buf[MAX_COMMENT_LEN+1];
+	char buf[MAX_COMMENT_LEN+1], path[MAXPATHLEN];
 	char *author, *mail, *web, *text;
 	const char *errstr;
 	size_t len;
-	extern char *error_str;
-	extern struct query *query_post;
 
 	assert(!EMPTYSTRING(article));
-	if (query_post == NULL) {
+	if (r->query_post == NULL) {
 		len = strtonum(getenv("CONTENT_LENGTH"), 0, LONG_MAX, &errstr);
 		if (errstr != NULL) {
-			error_str = ERR_COMMENT_FORM_READ;
+			r->error_str = ERR_COMMENT_FORM_READ;
 			return -1;
 		}
 		if (len > MAX_COMMENT_LEN) {
-			error_str = ERR_COMMENT_FORM_LEN;
+			r->error_str = ERR_COMMENT_FORM_LEN;
 			return -1;
 		}
 		if (fread(buf, len, 1, stdin) == 0 && !feof(stdin)) {
-			error_str = ERR_COMMENT_FORM_READ;
+			r->error_str = ERR_COMMENT_FORM_READ;
 			return -1; 
 		}
 		buf[len] = '\0';
-		if ((query_post = tokenize_query(buf)) == NULL) {
-			error_str = ERR_COMMENT_FORM_READ;
+		if ((r->query_post = tokenize_query(buf)) == NULL) {
+			r->error_str = ERR_COMMENT_FORM_READ;
 			return -1;
 		}
 	}
-	author = get_query_param(query_post, "author");
+	author = get_query_param(r->query_post, "author");
 	strchomp(author);
-	mail = get_query_param(query_post, "mail");
+	mail = get_query_param(r->query_post, "mail");
 	strchomp(mail);
-	web = get_query_param(query_post, "web");
+	web = get_query_param(r->query_post, "web");
 	strchomp(web);
-	text = get_query_param(query_post, "text");
+	text = get_query_param(r->query_post, "text");
 	strchomp(text);
 	if (EMPTYSTRING(author)) {
-		error_str = ERR_COMMENT_FORM_AUTHOR;
+		r->error_str = ERR_COMMENT_FORM_AUTHOR;
 		return -1;
 	}
 	if (EMPTYSTRING(text)) {
-		error_str = ERR_COMMENT_FORM_TEXT;
+		r->error_str = ERR_COMMENT_FORM_TEXT;
 		return -1;
 	}
 	if (!antispam_verify(article,
-	    get_query_param(query_post, "antispam_result"),
-	    get_query_param(query_post, "antispam_hash"))) {
-		error_str = ERR_COMMENT_FORM_ANTISPAM;
+	    get_query_param(r->query_post, "antispam_result"),
+	    get_query_param(r->query_post, "antispam_hash"))) {
+		r->error_str = ERR_COMMENT_FORM_ANTISPAM;
 		return -1;
 	}
 	if (write_comment(article, author, mail, web, text) == -1) {
-		error_str = ERR_COMMENT_FORM_WRITE;
+		r->error_str = ERR_COMMENT_FORM_WRITE;
 		return -1;
 	}
+	/* the article, its tags and the lists showing the comment count */
+	comments_path(path, article);
+	cache_invalidate(path);
 	return 0;
 }
 
@@ -218,7 +243,10 @@ int
 are_comments_readable(const char *article)
 {
 	FILE *f;
+	int readable;
 
+	if (site_comments(article, NULL, &readable, NULL) == 0)
+		return readable;
 	if ((f = open_comments_file(article, MODE_READ)) == NULL)
 		return 0;
 	fclose(f);
@@ -226,7 +254,7 @@ are_comments_readable(const char *article)
 }
 
 unsigned long
-read_comments(const char *article, comment_cb *callback)
+read_comments(const char *article, comment_cb *callback, void *data)
 {
 	FILE *f;
 	char *buf, *s;
@@ -235,8 +263,16 @@ read_comments(const char *article, comment_cb *callback)
 	struct comment c;
 
 	assert(article != NULL && *article != '\0');
-	if ((f = open_comments_file(article, MODE_READ)) == NULL)
+	if (callback == NULL
+	    && site_comments(article, &nb_comments, NULL, NULL) == 0)
+		return nb_comments;
+	TIMING_BEGIN(STAGE_COMMENTS);
+	TIMING_COUNT(COUNTER_OPENS, 1);
+	PROBE1(comments__parse__start, article);
+	if ((f = open_comments_file(article, MODE_READ)) == NULL) {
+		TIMING_END(STAGE_COMMENTS);
 		return 0;
+	}
 	nb_comments = 0;
 	while (!feof(f)) {
 		c.author = c.ip = c.mail = c.web = NULL;
@@ -295,7 +331,7 @@ read_comments(const char *article, comment_cb *callback)
 				if (callback != NULL) {
 					c.number = nb_comments;
 					c.body = f;
-					callback(&c);
+					callback(&c, data);
 				}
 			}
 			if (!c.body_read) {
@@ -310,6 +346,8 @@ next:		free(c.author);
 		free(c.web);
 	}
 	fclose(f);
+	PROBE2(comments__parse__end, article, nb_comments);
+	TIMING_END(STAGE_COMMENTS);
 	return nb_comments;
 }
 
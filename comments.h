@@ -17,12 +17,14 @@ struct comment {
 	char	 body_read;
 };
 
-typedef void (comment_cb)(struct comment *);
+typedef void (comment_cb)(struct comment *, void *);
+
+struct render;
 
 int		 are_comments_writable(const char *);
-int		 post_comment(const char *);
+int		 post_comment(struct render *, const char *);
 int		 are_comments_readable(const char *);
-unsigned long	 read_comments(const char *, comment_cb);
+unsigned long	 read_comments(const char *, comment_cb, void *);
 char		*read_commentln(struct comment *, int *);
 
 #endif
@@ -6,6 +6,39 @@
  */
 #define DEFAULT_STATIC
 
+/* Define DEBUG_TIMING to send the time spent in each stage of the requests
+ * in a Server-Timing header (the pages are then buffered before being sent).
+ * From the command line, use the -t option instead.
+ */
+/* #define DEBUG_TIMING */
+
+/* Define PAGE_CACHE to keep the pages rendered by the CGI in a file shared by
+ * all the processes. A page is served again from there as long as the files
+ * it was made of are not modified. The file must be writable by the CGI (it
+ * is relative to the chroot).
+ */
+/* #define PAGE_CACHE	"/var/tmp/clog.cache" */
+/* Size of the pages kept in the cache, and number of pages */
+#define PAGE_CACHE_SIZE		(8*1024*1024)
+#define PAGE_CACHE_SLOTS	1024
+/* Size of the pages kept in memory when a process renders several requests
+ * (see the -C option).
+ */
+#define MEMORY_CACHE_SIZE	(16*1024*1024)
+
+/* Define EARLY_FLUSH as the routes (index, tag, article, archive, search,
+ * tags) whose head, page.html up to %%PAGE_BODY%%, is sent before their body
+ * is rendered, so that the browsers fetch the style sheets meanwhile. It is
+ * not sent early when the pages are buffered (PAGE_CACHE, DEBUG_TIMING).
+ */
+#define EARLY_FLUSH	"index tag archive search"
+
+/* Define PREFETCH_ARTICLES to read ahead the files of the articles of a page
+ * before rendering it, in a batch (with io_uring on Linux). It helps when they
+ * are not in the cache of the system.
+ */
+#define PREFETCH_ARTICLES
+
 /* The URL of the binary of the blog engine */
 #define BIN_URL		"http://cybione.org/~cdidier/cgi-bin/blog"
 /* The URL of the blog base directory */
@@ -18,15 +51,25 @@
 
 /* This is the absolute path of the directory where the http server is chrooted
  * (leave empty if not chrooted) */
+#ifndef CHROOT_DIR
 #define CHROOT_DIR	"/var/www"
+#endif
 /* Where the static pages are written */
 #define BASE_DIR	"/users/cdidier/blog"
 /* Where the templates are stored */
 #define TEMPLATES_DIR	BASE_DIR"/src/templates"
 /* Where the articles are stored */
 #define ARTICLES_DIR	BASE_DIR"/articles"
+/* Define ARTICLES_SHARDED to store the articles in ARTICLES_DIR/YYYY/MM
+ * instead of ARTICLES_DIR ("blog -p shard" moves them there) */
+/* #define ARTICLES_SHARDED */
 /* Where the tags are stored */
 #define TAGS_DIR	BASE_DIR"/tags"
+/* The index of the full-text search (generated by "blog -s index") */
+#define SEARCH_INDEX	BASE_DIR"/search.idx"
+/* The pack of the articles (generated by "blog -p pack"), read instead of
+ * ARTICLES_DIR as long as it is newer than it and than the edited articles */
+#define ARTICLES_PACK	BASE_DIR"/articles.pack"
 
 /* Number of articles per page (and also per RSS feed) */
 #define NB_ARTICLES	5
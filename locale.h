@@ -7,6 +7,8 @@
 
 #define NO_TAG			"none"
 
+#define SEARCH_NORESULT		"No article found."
+
 #define COMMENTS_NOCOMMENT	"Comment?"
 #define COMMENTS_1COMMENT	"1 comment"
 #define COMMENTS_COMMENTS	"comments"
@@ -21,152 +21,389 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "common.h"
 #include "output.h"
 #include "articles.h"
 #include "comments.h"
+#include "search.h"
+#include "cache.h"
+#include "pack.h"
+#include "probes.h"
+#include "timing.h"
 
-void render_page_article(struct article *);
-void render_page_tag(struct tag *);
-void render_page_tags(void);
-void render_rss(struct tag *);
+void render_page_article(struct article *, struct render *);
+void render_page_tag(struct tag *, struct render *);
+void render_page_tags(struct render *);
+void render_page_archive(struct tag *, struct render *);
+void render_page_search(struct tag *, struct render *);
+void render_rss(struct tag *, struct render *);
 void sanitize_input(char *);
 void generate_static(const char *cmd);
+void watch_static(void);
 
 enum STATUS	 status;
-char		*error_str;
-struct query	*query_get, *query_post;
+
+PROBE_SEMAPHORE(request__start)
+PROBE_SEMAPHORE(request__end)
+
+static void
+handle_search(struct render *r)
+{
+	char *q, *s;
+	unsigned long p, n;
+	const char *errstr;
+
+	p = 0;
+	if ((s = get_query_param(r->query_get, "p")) != NULL) {
+		p = strtonum(s, 0, LONG_MAX, &errstr);
+		if (errstr != NULL) {
+			document_not_found(r);
+			return;
+		}
+	}
+	n = NB_ARTICLES;
+	if ((s = get_query_param(r->query_get, "n")) != NULL) {
+		n  = strtonum(s, 0, LONG_MAX, &errstr);
+		if (errstr != NULL || n == 0)
+			n = NB_ARTICLES;
+	}
+	if ((q = get_query_param(r->query_get, "q")) == NULL)
+		q = "";
+	if (search_articles(q, p, n, (tag_cb *)render_page_search, r) == -1)
+		document_not_found(r);
+}
+
+static void
+redirect_page_tag(struct tag *t, struct render *r)
+{
+	document_begin_redirection(r);
+	if (r->status & STATUS_STATIC)
+		hput_url(r, "tag", t->name, t->page, t->number);
+	else
+		hput_url(r, "tag_after", t->name,
+		    t->list.names[t->offset-t->first-1], t->number);
+	document_end_redirection(r);
+}
+
+/*
+ * Handle the keyset pagination parameters, "after" and "before" are the
+ * name of the last (resp. first) article of the previous (resp. next) page.
+ * Return 0 if there is no such parameter.
+ */
+static int
+handle_cursor(struct render *r, const char *tag, unsigned long n,
+    tag_cb *callback)
+{
+	char *s;
+	int before;
+
+	before = 0;
+	if ((s = get_query_param(r->query_get, "after")) == NULL) {
+		if ((s = get_query_param(r->query_get, "before")) == NULL)
+			return 0;
+		before = 1;
+	}
+	if (!is_article_name(s, strlen(s))
+	    || read_tag_cursor(tag, s, before, n, callback, r) == -1)
+		document_not_found(r);
+	return 1;
+}
 
 #ifdef DEFAULT_STATIC
+static void handle_url(struct render *);
+
 static void
-handle_static_url(void)
+handle_static_url(struct render *r)
 {
 	char *q, *s;
 	unsigned long p;
 	const char *errstr;
 
-	status |= STATUS_STATIC;
-	if ((q = get_query_param(query_get, "page")) != NULL && *q != '\0') {
+	r->status |= STATUS_STATIC;
+	/* there is no static file for the combinations of tags */
+	if ((q = get_query_param(r->query_get, "tag")) != NULL
+	    && is_tag_combination(q)) {
+		handle_url(r);
+		return;
+	}
+	if ((q = get_query_param(r->query_get, "page")) != NULL && *q != '\0') {
 		if (strcmp(q, "tags") == 0) {
-			document_begin_redirection();
-			hput_url("tags");
-			document_end_redirection();
+			document_begin_redirection(r);
+			hput_url(r, "tags");
+			document_end_redirection(r);
 		} else if (strcmp(q, "rss") == 0) {
-			if ((q = get_query_param(query_get, "tag")) != NULL) {
+			if ((q = get_query_param(r->query_get, "tag"))
+			    != NULL) {
 				if (*q != '\0')
 					sanitize_input(q);
 				else
 					q = NULL;
 			}
-			document_begin_redirection();
-			hput_url("rss", q);
-			document_end_redirection();
-		} else
-			document_not_found();
-	} else if ((q = get_query_param(query_get, "article")) != NULL) {
+			document_begin_redirection(r);
+			hput_url(r, "rss", q);
+			document_end_redirection(r);
+		} else if (strcmp(q, "search") == 0)
+			handle_search(r);
+		else
+			document_not_found(r);
+	} else if ((q = get_query_param(r->query_get, "article")) != NULL) {
 		if (!is_article_name(q, strlen(q))) {
-			document_not_found();
+			document_not_found(r);
 			return;
 		}
 		sanitize_input(q);
-		if (status & STATUS_POST) {
-			if (post_comment(q) == -1) {
-				if (read_article(q, render_page_article) == -1)
-					document_not_found();
+		if (r->status & STATUS_POST) {
+			if (post_comment(r, q) == -1) {
+				if (read_article(q,
+				    (article_cb *)render_page_article, r) == -1)
+					document_not_found(r);
 				return;
 			}
 			generate_static(q);
 		}
-		document_begin_redirection();
-		hput_url("article", q);
-		document_end_redirection();
+		document_begin_redirection(r);
+		hput_url(r, "article", q);
+		document_end_redirection(r);
+	} else if ((q = get_query_param(r->query_get, "archive")) != NULL) {
+		if (!is_archive_name(q)) {
+			document_not_found(r);
+			return;
+		}
+		/* extract the page */
+		p = 0;
+		if ((s = get_query_param(r->query_get, "p")) != NULL) {
+			p = strtonum(s, 0, LONG_MAX, &errstr);
+			if (errstr != NULL) {
+				document_not_found(r);
+				return;
+			}
+		}
+		document_begin_redirection(r);
+		hput_url(r, "archive", q, p);
+		document_end_redirection(r);
 	} else {
 		/* extract the page */
 		p = 0;
-		if ((s = get_query_param(query_get, "p")) != NULL) {
+		if ((s = get_query_param(r->query_get, "p")) != NULL) {
 			p = strtonum(s, 0, LONG_MAX, &errstr);
 			if (errstr != NULL) {
-				document_not_found();
+				document_not_found(r);
 				return;
 			}
 		}
 		/* extract the tag */
-		if ((q = get_query_param(query_get, "tag")) != NULL) {
+		if ((q = get_query_param(r->query_get, "tag")) != NULL) {
 			if (*q != '\0')
 				sanitize_input(q);
 			else
 				q = NULL;
 		}
-		document_begin_redirection();
-		hput_url("tag", q, p, NB_ARTICLES);
-		document_end_redirection();
+		if (handle_cursor(r, q, NB_ARTICLES,
+		    (tag_cb *)redirect_page_tag))
+			return;
+		document_begin_redirection(r);
+		hput_url(r, "tag", q, p, NB_ARTICLES);
+		document_end_redirection(r);
 	}
 }
 #endif
 
 static void
-handle_url(void)
+handle_url(struct render *r)
 {
 	char *q, *s;
 	unsigned long p, n;
 	const char *errstr;
 
-	if ((q = get_query_param(query_get, "page")) != NULL && *q != '\0') {
+	if ((q = get_query_param(r->query_get, "page")) != NULL && *q != '\0') {
 		if (strcmp(q, "tags") == 0)
-			render_page_tags();
+			render_page_tags(r);
 		else if (strcmp(q, "rss") == 0) {
-			if ((q = get_query_param(query_get, "tag")) != NULL) {
+			if ((q = get_query_param(r->query_get, "tag"))
+			    != NULL) {
 				if (*q != '\0')
 					sanitize_input(q);
 				else
 					q = NULL;
 			}
-			if (read_tag(q, 0, NB_ARTICLES, render_rss) == -1)
-				document_not_found();
-		} else
-			document_not_found();
-	} else if ((q = get_query_param(query_get, "article")) != NULL) {
+			if (read_tag(q, 0, NB_ARTICLES, (tag_cb *)render_rss,
+			    r) == -1)
+				document_not_found(r);
+		} else if (strcmp(q, "search") == 0)
+			handle_search(r);
+		else
+			document_not_found(r);
+	} else if ((q = get_query_param(r->query_get, "article")) != NULL) {
 		if (!is_article_name(q, strlen(q))) {
-			document_not_found();
+			document_not_found(r);
 			return;
 		}
 		sanitize_input(q);
-		if (status & STATUS_POST && post_comment(q) != -1
-		    && !(status & STATUS_FROMCMD)) {
-			document_begin_redirection();
-			hput_url("article", q);
-			document_end_redirection();
-		} else if (read_article(q, render_page_article) == -1)
-			document_not_found();
+		if (r->status & STATUS_POST && post_comment(r, q) != -1
+		    && !(r->status & STATUS_FROMCMD)) {
+			document_begin_redirection(r);
+			hput_url(r, "article", q);
+			document_end_redirection(r);
+		} else if (read_article(q, (article_cb *)render_page_article,
+		    r) == -1)
+			document_not_found(r);
+	} else if ((q = get_query_param(r->query_get, "archive")) != NULL) {
+		/* extract the page */
+		p = 0;
+		if ((s = get_query_param(r->query_get, "p")) != NULL) {
+			p = strtonum(s, 0, LONG_MAX, &errstr);
+			if (errstr != NULL) {
+				document_not_found(r);
+				return;
+			}
+		}
+		if (!is_archive_name(q) || read_archive(q, p, NB_ARTICLES,
+		    (tag_cb *)render_page_archive, r) == -1)
+			document_not_found(r);
 	} else {
 		/* extract the page */
 		p = 0;
-		if ((s = get_query_param(query_get, "p")) != NULL) {
+		if ((s = get_query_param(r->query_get, "p")) != NULL) {
 			p = strtonum(s, 0, LONG_MAX, &errstr);
 			if (errstr != NULL) {
-				document_not_found();
+				document_not_found(r);
 				return;
 			}
 		}
 		/* extract the number of article per page */
 		n = NB_ARTICLES;
-		if ((s = get_query_param(query_get, "n")) != NULL) {
+		if ((s = get_query_param(r->query_get, "n")) != NULL) {
 			n  = strtonum(s, 0, LONG_MAX, &errstr);
 			if (errstr != NULL || n == 0)
 				n = NB_ARTICLES;
 		}
 		/* extract the tag */
-		if ((q = get_query_param(query_get, "tag")) != NULL) {
+		if ((q = get_query_param(r->query_get, "tag")) != NULL) {
 			if (*q != '\0')
 				sanitize_input(q);
 			else
 				q = NULL;
 		}
-		if (read_tag(q, p, n, render_page_tag) == -1)
-			document_not_found();
+		if (handle_cursor(r, q, n, (tag_cb *)render_page_tag))
+			return;
+		/* the page numbers are redirected to the keyset pagination */
+		if (p != 0 && !(r->status & STATUS_FROMCMD)) {
+			if (read_tag(q, p, n, (tag_cb *)redirect_page_tag,
+			    r) == -1)
+				document_not_found(r);
+		} else if (read_tag(q, p, n, (tag_cb *)render_page_tag,
+		    r) == -1)
+			document_not_found(r);
+	}
+}
+
+#ifdef USE_SDT
+/* name of the route, for the tracepoints */
+static const char *
+request_route(struct query *q)
+{
+	char *page;
+
+	if (get_query_param(q, "article") != NULL)
+		return status & STATUS_POST ? "comment" : "article";
+	if ((page = get_query_param(q, "page")) != NULL)
+		return page;
+	if (get_query_param(q, "archive") != NULL)
+		return "archive";
+	if (get_query_param(q, "tag") != NULL)
+		return "tag";
+	return "index";
+}
+#endif
+
+/* of the uncompressed output with -z */
+static uLong
+output_checksum(FILE *f)
+{
+	char buf[BUFSIZ];
+	gzFile gzf;
+	int len;
+	uLong crc;
+
+	fflush(f);
+	rewind(f);
+	crc = crc32(0L, Z_NULL, 0);
+	if ((gzf = gzdopen(dup(fileno(f)), "rb")) != NULL) {
+		while ((len = gzread(gzf, buf, sizeof(buf))) > 0)
+			crc = crc32(crc, (Bytef *)buf, len);
+		gzclose(gzf);
 	}
+	fclose(f);
+	return crc;
+}
+
+/* through the memory cache if -C was given */
+static void
+render(FILE *out, struct query *q)
+{
+	struct render r;
+
+	render_init(&r, out);
+	r.query_get = q;
+	if (cache_serve(&r, out))
+		return;
+	cache_begin(&r);
+	handle_url(&r);
+	cache_end(&r);
+	free_query(r.query_post);
+}
+
+/*
+ * Render the query several times in the same process, for the profilers.
+ * The output of the first (warm-up) run and of the last run are
+ * checksummed, they differ if some state leaks between the requests.
+ */
+static void
+replay(unsigned long runs, int cached, struct query *q)
+{
+	struct timespec begin, end;
+	double elapsed;
+	unsigned long i;
+	uLong first, last;
+	FILE *out;
+
+	if ((out = tmpfile()) == NULL)
+		err(1, "tmpfile");
+	render(out, q);
+	first = output_checksum(out);
+	if ((out = fopen("/dev/null", "w")) == NULL)
+		err(1, "fopen: /dev/null");
+	timing_start();
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < runs; ++i) {
+		if (i == runs - 1) {
+			fclose(out);
+			if ((out = tmpfile()) == NULL)
+				err(1, "tmpfile");
+		}
+		timing_request();
+		PROBE2(request__start, getenv("QUERY_STRING"),
+		    request_route(q));
+		render(out, q);
+		PROBE2(request__end, getenv("QUERY_STRING"),
+		    request_route(q));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	last = output_checksum(out);
+	elapsed = (end.tv_sec - begin.tv_sec)
+	    + (end.tv_nsec - begin.tv_nsec) / 1e9;
+	fprintf(stderr, "%lu runs in %.3f s: %.1f runs/s, %.3f ms/run\n",
+	    runs, elapsed, runs / elapsed, elapsed * 1e3 / runs);
+	fprintf(stderr, "checksum first=%08lx last=%08lx%s\n", first, last,
+	    first != last ? " (differ)" : "");
+	timing_report(getenv("QUERY_STRING"), runs);
+	if (cached)
+		cache_report(stderr);
+	timing_enabled = 0;
 }
 
 static void
@@ -174,11 +411,19 @@ usage(void)
 {
 	extern char *__progname;
 
-	fprintf(stderr, "usage: %s [-h] [-q query] [-s [page]]\n"
+	fprintf(stderr, "usage: %s [-Chtwz] [-B runs] [-p pack|shard|flat] "
+	    "[-q query] [-s [page]]\n"
+	    "\t -B render the query several times and report the throughput.\n"
+	    "\t -C with -B, keep the rendered pages in memory.\n"
 	    "\t -h display this help.\n"
+	    "\t -p pack the articles in a single file, or move them to the\n"
+	    "\t    directories of their month (shard) or back (flat).\n"
 	    "\t -q query a page (everything after '?' in an URL).\n"
+	    "\t -t report the time spent in each stage on stderr.\n"
 	    "\t -s if no argument is given, the links will point to the static files.\n"
-	    "\t    if an argument is given, static files of the page will be generated.\n",
+	    "\t    if an argument is given, static files of the page will be generated.\n"
+	    "\t -w watch the articles and keep the static files up to date.\n"
+	    "\t -z compress the page with gzip.\n",
 	    __progname);
 	exit(1);
 }
@@ -188,19 +433,48 @@ main(int argc, char **argv)
 {
 	char ch;
 	char *env;
-	extern FILE *hout;
+	const char *errstr;
+	unsigned long runs;
+	int cached, ret;
+	struct render r;
+	struct query *query;
 
-	hout = stdout;
 	status = STATUS_NONE;
 	if (getenv("SERVER_NAME") == NULL)
 		status |= STATUS_FROMCMD;
 	if ((env = getenv("REQUEST_METHOD")) != NULL
 	    && strcmp(env, "POST") == 0)
 		status |= STATUS_POST;
-	error_str = NULL;
+	runs = 0;
+	cached = 0;
+	query = NULL;
+#ifdef DEBUG_TIMING
+	if (!(status & STATUS_FROMCMD))
+		timing_start();
+#endif
 	if (status & STATUS_FROMCMD) {
-		while ((ch = getopt(argc, argv, "hq:s")) != -1)
+		while ((ch = getopt(argc, argv, "B:Chp:q:stwz")) != -1)
 			switch (ch) {
+			case 'B':
+				runs = strtonum(optarg, 1, LONG_MAX, &errstr);
+				if (errstr != NULL)
+					errx(1, "runs: %s", errstr);
+				break;
+			case 'C':
+				cached = 1;
+				break;
+			case 'p':
+				if (strcmp(optarg, "pack") == 0)
+					ret = build_pack();
+				else if (strcmp(optarg, "shard") == 0)
+					ret = migrate_articles(1);
+				else if (strcmp(optarg, "flat") == 0)
+					ret = migrate_articles(0);
+				else
+					usage();
+				if (ret == -1)
+					exit(1);
+				goto out;
 			case 'q':
 				if (setenv("QUERY_STRING", optarg, 1) == -1)
 					err(1, "setenv");
@@ -213,22 +487,47 @@ main(int argc, char **argv)
 					goto out;
 				}
 				break;
+			case 't':
+				timing_start();
+				break;
+			case 'w':
+				watch_static();
+				goto out;
+			case 'z':
+				output_gzip = 1;
+				break;
 			default:
 				usage();
 			}
 	}
-	query_get = tokenize_query(getenv("QUERY_STRING"));
-	query_post = NULL;
+	query = tokenize_query(getenv("QUERY_STRING"));
+	render_init(&r, stdout);
+	r.query_get = query;
+	if (runs != 0) {
+		if (cached)
+			cache_memory(MEMORY_CACHE_SIZE);
+		replay(runs, cached, query);
+		goto out;
+	}
+	PROBE2(request__start, getenv("QUERY_STRING"), request_route(query));
+	if (!(status & (STATUS_FROMCMD|STATUS_POST)) && !timing_enabled) {
+		if (cache_serve(&r, stdout))
+			goto end;
+		cache_begin(&r);
+	}
 #ifdef DEFAULT_STATIC
 	if (status & STATUS_FROMCMD)
-		handle_url();
+		handle_url(&r);
 	else
-		handle_static_url();
+		handle_static_url(&r);
 #else
-	handle_url();
+	handle_url(&r);
 #endif
-out:	free_query(query_get);
-	if (status & STATUS_POST)
-		free_query(query_post);
+	cache_end(&r);
+	free_query(r.query_post);
+end:	PROBE2(request__end, getenv("QUERY_STRING"), request_route(query));
+out:	if (timing_enabled && status & STATUS_FROMCMD)
+		timing_report(getenv("QUERY_STRING"), 1);
+	free_query(query);
 	return 0;
 }
@@ -19,72 +19,592 @@
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/param.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <zlib.h>
 
 #include "common.h"
 #include "output.h"
+#include "articles.h"
+#include "cache.h"
+#include "probes.h"
+#include "timing.h"
 
 #define MARKER_TAG "%%"
 
-FILE		*hout = NULL;
-static gzFile	 gz = NULL;
+/* shorter spans are compressed with the rest of the page */
+#define FRAGMENT_MIN	512
+/* memory used by the compressed files */
+#define FRAGMENTS_SIZE	(4*1024*1024)
+#define GZIP_BUFSIZ	16384
+/* the window of deflate */
+#define GZIP_WINDOW	(1 << MAX_WBITS)
+/* chunks of the ring, and size from which a page is compressed aside */
+#define GZIP_PIPE_CHUNKS	8
+#define GZIP_PIPE_MIN		(128*1024)
+/* shorter files are copied through stdio */
+#define DIRECT_MIN	BUFSIZ
+
+/*
+ * A span of the page compressed on its own and ending with a full flush:
+ * it can be copied as is in a deflate stream flushed the same way.
+ */
+struct fragment {
+	uLong		 crc, len;	/* of the uncompressed span */
+	size_t		 size;
+	unsigned char	*data;
+	size_t		 tail_len;	/* the end of the span */
+	unsigned char	*tail;
+};
+
+/*
+ * A chunk of the page given to the compression thread: the data is
+ * deflated with flush (-1 not to deflate it), then the fragment is spliced.
+ */
+struct gz_chunk {
+	size_t		 len;
+	int		 flush;
+	struct fragment	 frag;		/* a copy, freed once spliced */
+	unsigned char	 data[GZIP_BUFSIZ];
+};
+
+/*
+ * Bounded ring between the render and the compression thread, without
+ * lock: each side has its own index, and two semaphores count the chunks
+ * filled and the ones free.
+ */
+struct gz_pipe {
+	pthread_t	 thread;
+	sem_t		 filled, free;
+	unsigned long	 head;		/* filled by the render */
+	unsigned long	 tail;		/* compressed by the thread */
+	struct gz_chunk	 chunks[GZIP_PIPE_CHUNKS];
+};
+
+/*
+ * The gzip stream of the page, in which fragments are spliced. Once the
+ * pipe is started, the stream (z, crc, started and out) belongs to the
+ * compression thread until it ends.
+ */
+struct gzip {
+	int		 fd;
+	int		 started;	/* the header is written */
+	int		 pending;	/* deflated since the last flush */
+	z_stream	 z;
+	uLong		 crc, len;
+	unsigned char	*in;		/* buf, or the chunk being filled */
+	size_t		 in_len;
+	struct gz_pipe	*pipe;
+	unsigned char	 buf[GZIP_BUFSIZ], out[GZIP_BUFSIZ];
+};
+
+/* a text of a template, or a marker */
+struct span {
+	char		*text;
+	size_t		 len;
+	char		*marker;
+	struct fragment	 frag;
+};
+
+/* a template split at its markers, kept while the file is not modified */
+struct template {
+	SLIST_ENTRY(template) next;
+	char		*path;
+	struct stat	 sb;
+	struct span	*spans;
+	size_t		 nb_spans;
+	int		 busy, stale;
+};
+
+/* the end of a file, from offset, held by the list and by the renders */
+struct file_fragment {
+	SLIST_ENTRY(file_fragment) next;
+	unsigned long	 refs;
+	dev_t		 dev;
+	ino_t		 ino;
+	off_t		 size, offset;
+	struct timespec	 mtim;
+	struct fragment	 frag;
+};
+
+int		 output_gzip = 0;
+int		 output_gzip_thread = -1;
+/* the templates and the fragments are shared by the renders */
+static pthread_mutex_t templates_lock = PTHREAD_MUTEX_INITIALIZER;
+static SLIST_HEAD(, template) templates = SLIST_HEAD_INITIALIZER(templates);
+static SLIST_HEAD(, file_fragment) file_fragments =
+    SLIST_HEAD_INITIALIZER(file_fragments);
+static size_t file_fragments_size = 0;
 extern enum STATUS status;
 
+PROBE_SEMAPHORE(template__begin)
+PROBE_SEMAPHORE(template__end)
+PROBE_SEMAPHORE(template__marker)
+PROBE_SEMAPHORE(gzip__flush__start)
+PROBE_SEMAPHORE(gzip__flush__end)
+
+static void
+write_all(int fd, const void *buf, size_t len)
+{
+	const char *p;
+	ssize_t w;
+
+	for (p = buf; len > 0; p += w, len -= w)
+		if ((w = write(fd, p, len)) == -1) {
+			if (errno != EINTR)
+				return;
+			w = 0;
+		}
+}
+
+static int
+gz_open(struct render *r, int fd)
+{
+	struct gzip *gz;
+
+	if ((gz = malloc(sizeof(struct gzip))) == NULL)
+		return -1;
+	memset(&gz->z, 0, sizeof(gz->z));
+	if (deflateInit2(&gz->z, 9, Z_DEFLATED, -MAX_WBITS, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(gz);
+		return -1;
+	}
+	gz->fd = fd;
+	gz->started = gz->pending = 0;
+	gz->crc = crc32(0L, Z_NULL, 0);
+	gz->len = 0;
+	gz->in = gz->buf;
+	gz->in_len = 0;
+	gz->pipe = NULL;
+	r->gz = gz;
+	return 0;
+}
+
+/* the header is written with the data, after the HTTP headers */
+static void
+gz_start(struct gzip *gz)
+{
+	static const unsigned char header[10] = {
+		0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 2, 3
+	};
+
+	if (!gz->started) {
+		write_all(gz->fd, header, sizeof(header));
+		gz->started = 1;
+	}
+}
+
+static void
+gz_compress(struct gzip *gz, const unsigned char *in, size_t len, int flush)
+{
+	gz_start(gz);
+	gz->crc = crc32(gz->crc, in, len);
+	gz->z.next_in = (Bytef *)in;
+	gz->z.avail_in = len;
+	do {
+		gz->z.next_out = gz->out;
+		gz->z.avail_out = sizeof(gz->out);
+		deflate(&gz->z, flush);
+		write_all(gz->fd, gz->out, sizeof(gz->out) - gz->z.avail_out);
+	} while (gz->z.avail_out == 0);
+}
+
+/*
+ * The stream is flushed to a byte boundary and the fragment, which does
+ * not refer to anything before itself, is copied. What follows may refer
+ * to the fragment: the end of it is added to the window as a dictionary
+ * (a whole window replaces it).
+ */
+static void
+gz_copy_fragment(struct gzip *gz, const struct fragment *f)
+{
+	gz_start(gz);
+	write_all(gz->fd, f->data, f->size);
+	gz->crc = crc32_combine(gz->crc, f->crc, f->len);
+	deflateSetDictionary(&gz->z, f->tail, f->tail_len);
+}
+
+static void *
+gz_thread(void *arg)
+{
+	struct gzip *gz = arg;
+	struct gz_pipe *p = gz->pipe;
+	struct gz_chunk *c;
+	int flush;
+
+	do {
+		while (sem_wait(&p->filled) == -1 && errno == EINTR)
+			;
+		c = &p->chunks[p->tail++ % GZIP_PIPE_CHUNKS];
+		if ((flush = c->flush) != -1)
+			gz_compress(gz, c->data, c->len, flush);
+		if (c->frag.data != NULL) {
+			gz_copy_fragment(gz, &c->frag);
+			free(c->frag.data);
+			c->frag.data = NULL;
+		}
+		sem_post(&p->free);
+	} while (flush != Z_FINISH);
+	return NULL;
+}
+
+/* the next chunk to fill, once the thread is done with it */
+static void
+gz_pipe_next(struct gzip *gz)
+{
+	struct gz_pipe *p = gz->pipe;
+
+	TIMING_BEGIN(STAGE_GZIP);
+	while (sem_wait(&p->free) == -1 && errno == EINTR)
+		;
+	TIMING_END(STAGE_GZIP);
+	gz->in = p->chunks[p->head % GZIP_PIPE_CHUNKS].data;
+	gz->in_len = 0;
+}
+
+/*
+ * From now on the page is compressed by another thread, if the system has
+ * more than one processor (or if output_gzip_thread is 1).
+ */
+static void
+gz_pipe_start(struct gzip *gz)
+{
+	struct gz_pipe *p;
+
+	if (output_gzip_thread == 0 || (output_gzip_thread == -1
+	    && sysconf(_SC_NPROCESSORS_ONLN) <= 1))
+		return;
+	if ((p = malloc(sizeof(struct gz_pipe))) == NULL)
+		return;
+	p->head = p->tail = 0;
+	if (sem_init(&p->filled, 0, 0) == -1) {
+		free(p);
+		return;
+	}
+	if (sem_init(&p->free, 0, GZIP_PIPE_CHUNKS) == -1) {
+		sem_destroy(&p->filled);
+		free(p);
+		return;
+	}
+	gz->pipe = p;
+	if (pthread_create(&p->thread, NULL, gz_thread, gz) != 0) {
+		gz->pipe = NULL;
+		sem_destroy(&p->filled);
+		sem_destroy(&p->free);
+		free(p);
+		return;
+	}
+	gz_pipe_next(gz);
+}
+
+/* give the chunk being filled to the thread, with a fragment to splice */
+static void
+gz_pipe_push(struct gzip *gz, int flush, const struct fragment *f)
+{
+	struct gz_pipe *p = gz->pipe;
+	struct gz_chunk *c;
+
+	c = &p->chunks[p->head % GZIP_PIPE_CHUNKS];
+	c->len = gz->in_len;
+	c->flush = flush;
+	c->frag.data = NULL;
+	if (f != NULL) {
+		if ((c->frag.data = malloc(f->size + f->tail_len)) == NULL)
+			err(1, NULL);
+		memcpy(c->frag.data, f->data, f->size);
+		c->frag.size = f->size;
+		c->frag.crc = f->crc;
+		c->frag.len = f->len;
+		c->frag.tail = c->frag.data + f->size;
+		memcpy(c->frag.tail, f->tail, f->tail_len);
+		c->frag.tail_len = f->tail_len;
+	}
+	++p->head;
+	sem_post(&p->filled);
+	if (flush != Z_FINISH)
+		gz_pipe_next(gz);
+}
+
+static void
+gz_deflate(struct gzip *gz, int flush)
+{
+	gz->len += gz->in_len;
+	gz->pending = flush == Z_NO_FLUSH;
+	if (gz->pipe != NULL) {
+		gz_pipe_push(gz, flush, NULL);
+		return;
+	}
+	TIMING_BEGIN(STAGE_GZIP);
+	gz_compress(gz, gz->in, gz->in_len, flush);
+	gz->in_len = 0;
+	TIMING_END(STAGE_GZIP);
+	/* a large page goes on in the pipe */
+	if (flush == Z_NO_FLUSH && gz->len >= GZIP_PIPE_MIN)
+		gz_pipe_start(gz);
+}
+
+static void
+gz_write(struct gzip *gz, const char *s, size_t len)
+{
+	size_t n;
+
+	for (; len > 0; s += n, len -= n) {
+		if (gz->in_len == GZIP_BUFSIZ)
+			gz_deflate(gz, Z_NO_FLUSH);
+		n = MIN(len, GZIP_BUFSIZ - gz->in_len);
+		memcpy(gz->in + gz->in_len, s, n);
+		gz->in_len += n;
+	}
+}
+
+/*
+ * Splice a fragment after what was written. With the pipe, the fragment
+ * is copied: it may be freed before the thread gets to it.
+ */
+static void
+gz_splice(struct gzip *gz, const struct fragment *f)
+{
+	int flush;
+
+	TIMING_COUNT(COUNTER_BYTES, f->len);
+	flush = gz->pending || gz->in_len > 0 ? Z_SYNC_FLUSH : -1;
+	if (gz->pipe != NULL) {
+		gz->len += gz->in_len + f->len;
+		gz->pending = 0;
+		gz_pipe_push(gz, flush, f);
+		return;
+	}
+	if (flush != -1)
+		gz_deflate(gz, flush);
+	gz->len += f->len;
+	TIMING_BEGIN(STAGE_GZIP);
+	gz_copy_fragment(gz, f);
+	TIMING_END(STAGE_GZIP);
+}
+
+static void
+gz_close(struct render *r)
+{
+	struct gzip *gz = r->gz;
+	struct gz_pipe *p;
+	unsigned char trailer[8];
+	int i;
+
+	gz_deflate(gz, Z_FINISH);
+	if ((p = gz->pipe) != NULL) {
+		TIMING_BEGIN(STAGE_GZIP);
+		pthread_join(p->thread, NULL);
+		TIMING_END(STAGE_GZIP);
+		sem_destroy(&p->filled);
+		sem_destroy(&p->free);
+		free(p);
+	}
+	for (i = 0; i < 4; ++i) {
+		trailer[i] = gz->crc >> (8 * i);
+		trailer[i + 4] = gz->len >> (8 * i);
+	}
+	write_all(gz->fd, trailer, sizeof(trailer));
+	deflateEnd(&gz->z);
+	close(gz->fd);
+	free(gz);
+	r->gz = NULL;
+}
+
+static int
+make_fragment(struct fragment *f, const char *s, size_t len)
+{
+	z_stream z;
+	uLong bound;
+
+	TIMING_BEGIN(STAGE_GZIP);
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, 9, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY)
+	    != Z_OK)
+		goto err;
+	bound = deflateBound(&z, len) + 16;
+	if ((f->data = malloc(bound)) == NULL) {
+		deflateEnd(&z);
+		goto err;
+	}
+	z.next_in = (Bytef *)s;
+	z.avail_in = len;
+	z.next_out = f->data;
+	z.avail_out = bound;
+	if (deflate(&z, Z_FULL_FLUSH) != Z_OK || z.avail_in != 0
+	    || z.avail_out == 0) {
+		deflateEnd(&z);
+		free(f->data);
+		f->data = NULL;
+		goto err;
+	}
+	f->size = bound - z.avail_out;
+	f->crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)s, len);
+	f->len = len;
+	f->tail_len = MIN(len, GZIP_WINDOW);
+	if ((f->tail = malloc(f->tail_len)) == NULL) {
+		deflateEnd(&z);
+		free(f->data);
+		f->data = NULL;
+		goto err;
+	}
+	memcpy(f->tail, s + len - f->tail_len, f->tail_len);
+	deflateEnd(&z);
+	TIMING_END(STAGE_GZIP);
+	return 0;
+
+err:	TIMING_END(STAGE_GZIP);
+	return -1;
+}
+
 void
-open_output(const char *type)
+render_init(struct render *r, FILE *out)
+{
+	memset(r, 0, sizeof(*r));
+	r->out = out;
+	r->status = status;
+}
+
+void
+open_output(struct render *r, const char *type)
 {
 	char *env;
+	int fd;
 
-	if (status & STATUS_FROMCMD || status & STATUS_STATIC)
+	if (r->status & STATUS_STATIC)
 		return;
-	if ((env = getenv("HTTP_ACCEPT_ENCODING")) != NULL
+	/* from the command line, only the cache needs the page */
+	if (r->status & STATUS_FROMCMD && r->capture == NULL) {
+		if (output_gzip) {
+			fflush(r->out);
+			if ((fd = dup(fileno(r->out))) != -1
+			    && gz_open(r, fd) == -1) {
+				warnx("deflateInit2");
+				close(fd);
+			}
+		}
+		return;
+	}
+	fd = fileno(r->out);
+	/* buffered to send the Server-Timing header first, or to cache it */
+	if (timing_enabled || r->capture != NULL) {
+		if ((r->body = tmpfile()) == NULL) {
+			warn("tmpfile");
+			cache_end(r);
+		} else {
+			r->body_out = r->out;
+			r->out = r->body;
+			fd = dup(fileno(r->body));
+			r->body_type = type;
+		}
+	}
+	/* the cache compresses the page itself */
+	if (!(r->status & STATUS_FROMCMD) && r->capture == NULL
+	    && (env = getenv("HTTP_ACCEPT_ENCODING")) != NULL
 	    && strstr(env, "gzip") != NULL) {
-		if ((gz = gzdopen(fileno(stdout), "wb9")) == NULL) {
-			if (errno != 0)
-				warn("gzdopen");
-			else
-				warnx("gzdopen");
-		} else
-			fputs("Content-Encoding: gzip\r\n", stdout);
+		if (gz_open(r, fd) == -1)
+			warnx("deflateInit2");
+		else if (r->body == NULL)
+			fputs("Content-Encoding: gzip\r\n", r->out);
+	}
+	if (r->body != NULL) {
+		if (r->gz == NULL)
+			close(fd);
+		return;
 	}
-	fprintf(stdout, "Content-type: %s;charset=" CHARSET "\r\n\r\n", type);
-	fflush(stdout);
+	if (r->status & STATUS_FROMCMD)
+		return;
+	fprintf(r->out, "Content-type: %s;charset=" CHARSET "\r\n\r\n", type);
+	fflush(r->out);
 }
 
 void
-close_output(void)
+close_output(struct render *r)
 {
-	if (gz != NULL)
-		gzclose(gz);
-	else
-		fflush(hout);
+	char buf[BUFSIZ];
+	size_t len;
+	int gzipped;
+
+	if ((gzipped = r->gz != NULL)) {
+		PROBE1(gzip__flush__start, (long)(r->gz->len + r->gz->in_len));
+		gz_close(r);
+		PROBE1(gzip__flush__end, 0);
+	} else
+		fflush(r->out);
+	TIMING_FIRST_BYTE();
+	if (r->body == NULL)
+		return;
+	r->out = r->body_out;
+	if (r->capture != NULL)
+		cache_store(r, r->body_type, r->body, r->out);
+	else {
+		if (gzipped)
+			fputs("Content-Encoding: gzip\r\n", r->out);
+		timing_header(r->out);
+		fprintf(r->out, "Content-type: %s;charset=" CHARSET "\r\n\r\n",
+		    r->body_type);
+		rewind(r->body);
+		while ((len = fread(buf, 1, sizeof(buf), r->body)) > 0)
+			fwrite(buf, 1, len, r->out);
+	}
+	fclose(r->body);
+	r->body = NULL;
+	fflush(r->out);
+}
+
+/*
+ * Send what is rendered so far, before the rest of the page is computed.
+ * The gzip stream ends with a sync flush, so that the client can inflate
+ * it. Nothing is sent if the page is buffered.
+ */
+void
+output_flush(struct render *r)
+{
+	if (r->body != NULL)
+		return;
+	if (r->gz != NULL) {
+		if (r->gz->pending || r->gz->in_len > 0)
+			gz_deflate(r->gz, Z_SYNC_FLUSH);
+	} else
+		fflush(r->out);
+	TIMING_FIRST_BYTE();
 }
 
 void
-document_begin_redirection(void)
+document_begin_redirection(struct render *r)
 {
-	fputs("Status: 302\r\nLocation: ", stdout);	
+	fputs("Status: 302\r\nLocation: ", r->out);
 }
 
 void
-document_end_redirection(void)
+document_end_redirection(struct render *r)
 {
-	fputs("\r\n\r\n", stdout);
-	fflush(stdout);
+	fputs("\r\n", r->out);
+	if (timing_enabled)
+		timing_header(r->out);
+	fputs("\r\n", r->out);
+	fflush(r->out);
 }
 
 void
-document_not_found(void)
+document_not_found(struct render *r)
 {
-	if (status & STATUS_STATIC && !(status & STATUS_FROMCMD))
+	if (r->status & STATUS_STATIC && !(r->status & STATUS_FROMCMD))
 		return;
-	else if (status & STATUS_FROMCMD)
+	else if (r->status & STATUS_FROMCMD)
 		warnx("Document not found.");
 	else {
 		fputs("Status: 404 Not found\r\n"
@@ -94,45 +614,235 @@ document_not_found(void)
 		    "<TITLE>404 Not Found</TITLE>\n"
 		    "</HEAD><BODY>\n"
 		    "<H1>Not Found</H1>\n"
-		    "The requested URL ", stdout);
-		fputs(getenv("SCRIPT_NAME"), stdout);
-		fputc('?', stdout);
-		fputs(getenv("QUERY_STRING"), stdout);
+		    "The requested URL ", r->out);
+		fputs(getenv("SCRIPT_NAME"), r->out);
+		fputc('?', r->out);
+		fputs(getenv("QUERY_STRING"), r->out);
 		fputs(" was not found on this server.<P>\n"
-		    "</BODY></HTML>\n", stdout);
-		fflush(stdout);
+		    "</BODY></HTML>\n", r->out);
+		fflush(r->out);
 	}
 }
 
-void
-hputc(const char c)
+static void
+hwrite(struct render *r, const char *s, size_t len)
 {
-	if (gz != NULL)
-		gzputc(gz, c);
+	TIMING_COUNT(COUNTER_BYTES, len);
+	if (r->gz != NULL)
+		gz_write(r->gz, s, len);
 	else
-		fputc(c, hout);
+		fwrite(s, 1, len, r->out);
 }
 
 void
-hputs(const char *s)
+hputc(struct render *r, const char c)
 {
-	if (gz != NULL)
-		gzputs(gz, s);
-	else
-		fputs(s, hout);
+	hwrite(r, &c, 1);
 }
 
 void
-hputd(const long long l)
+hputs(struct render *r, const char *s)
 {
-	if (gz != NULL)
-		gzprintf(gz, "%lld", l);
-	else
-		fprintf(hout, "%lld", l);
+	hwrite(r, s, strlen(s));
 }
 
 void
-hput_escaped(const char *s)
+hputd(struct render *r, const long long l)
+{
+	char buf[32];
+	int len;
+
+	if ((len = snprintf(buf, sizeof(buf), "%lld", l)) > 0)
+		hwrite(r, buf, len);
+}
+
+static void
+free_fragment(struct fragment *f)
+{
+	free(f->data);
+	free(f->tail);
+	memset(f, 0, sizeof(*f));
+}
+
+static void
+unref_file_fragment(struct file_fragment *ff)
+{
+	if (--ff->refs > 0)
+		return;
+	free_fragment(&ff->frag);
+	free(ff);
+}
+
+/* the fragment of the file from offset, with a reference taken */
+static struct file_fragment *
+find_file_fragment(const struct stat *sb, off_t offset)
+{
+	struct file_fragment *ff;
+
+	SLIST_FOREACH(ff, &file_fragments, next)
+		if (ff->ino == sb->st_ino && ff->dev == sb->st_dev
+		    && ff->offset == offset)
+			break;
+	if (ff == NULL)
+		return NULL;
+	if (ff->size != sb->st_size
+	    || ff->mtim.tv_sec != sb->st_mtim.tv_sec
+	    || ff->mtim.tv_nsec != sb->st_mtim.tv_nsec) {
+		/* modified, compressed again */
+		SLIST_REMOVE(&file_fragments, ff, file_fragment, next);
+		file_fragments_size -= sizeof(*ff) + ff->frag.size
+		    + ff->frag.tail_len;
+		unref_file_fragment(ff);
+		return NULL;
+	}
+	++ff->refs;
+	return ff;
+}
+
+/*
+ * Splice the rest of the file, compressed on its own the first time and
+ * kept for the next pages. The file is compressed and the fragment is
+ * spliced without the lock: the reference keeps the fragment meanwhile.
+ */
+static int
+hput_file_fragment(struct render *r, FILE *f)
+{
+	struct file_fragment *ff, *other;
+	struct stat sb;
+	off_t offset;
+	size_t len;
+	char *s;
+
+	if (fstat(fileno(f), &sb) == -1 || (offset = ftello(f)) == -1
+	    || sb.st_size - offset < FRAGMENT_MIN
+	    || sb.st_size - offset > FRAGMENTS_SIZE / 16)
+		return 0;
+	pthread_mutex_lock(&templates_lock);
+	ff = find_file_fragment(&sb, offset);
+	pthread_mutex_unlock(&templates_lock);
+	if (ff == NULL) {
+		if ((ff = calloc(1, sizeof(*ff))) == NULL
+		    || (s = malloc(sb.st_size - offset)) == NULL) {
+			free(ff);
+			return 0;
+		}
+		if ((len = fread(s, 1, sb.st_size - offset, f))
+		    != (size_t)(sb.st_size - offset)
+		    || make_fragment(&ff->frag, s, len) == -1) {
+			hwrite(r, s, len);
+			free(s);
+			free(ff);
+			return 1;
+		}
+		free(s);
+		ff->dev = sb.st_dev;
+		ff->ino = sb.st_ino;
+		ff->size = sb.st_size;
+		ff->offset = offset;
+		ff->mtim = sb.st_mtim;
+		ff->refs = 1;
+		pthread_mutex_lock(&templates_lock);
+		/* another render may have made it meanwhile */
+		if ((other = find_file_fragment(&sb, offset)) != NULL) {
+			unref_file_fragment(ff);
+			ff = other;
+		} else {
+			/* forget them all, they are made again as needed */
+			if (file_fragments_size > FRAGMENTS_SIZE)
+				while ((other = SLIST_FIRST(&file_fragments))
+				    != NULL) {
+					SLIST_REMOVE_HEAD(&file_fragments,
+					    next);
+					unref_file_fragment(other);
+				}
+			if (SLIST_EMPTY(&file_fragments))
+				file_fragments_size = 0;
+			++ff->refs;
+			SLIST_INSERT_HEAD(&file_fragments, ff, next);
+			file_fragments_size += sizeof(*ff) + ff->frag.size
+			    + ff->frag.tail_len;
+		}
+		pthread_mutex_unlock(&templates_lock);
+	}
+	gz_splice(r->gz, &ff->frag);
+	pthread_mutex_lock(&templates_lock);
+	unref_file_fragment(ff);
+	pthread_mutex_unlock(&templates_lock);
+	return 1;
+}
+
+/*
+ * Send the rest of the file from the kernel (or from a mapping), after what
+ * is buffered in r->out. Return 0 if some is left to copy.
+ */
+static int
+hput_file_direct(struct render *r, FILE *f)
+{
+	struct stat sb;
+	off_t offset;
+	size_t len, total;
+	ssize_t w;
+#ifndef __linux__
+	char *p;
+#endif
+
+	if (fstat(fileno(f), &sb) == -1 || !S_ISREG(sb.st_mode)
+	    || (offset = ftello(f)) == -1 || sb.st_size - offset < DIRECT_MIN)
+		return 0;
+	if (fflush(r->out) == EOF)
+		return 0;
+	total = len = sb.st_size - offset;
+#ifdef __linux__
+	for (; len > 0; len -= w)
+		if ((w = sendfile(fileno(r->out), fileno(f), &offset,
+		    len)) <= 0) {
+			if (w == -1 && errno == EINTR) {
+				w = 0;
+				continue;
+			}
+			/* copy the rest */
+			TIMING_COUNT(COUNTER_BYTES, total - len);
+			fseeko(f, offset, SEEK_SET);
+			return 0;
+		}
+#else
+	if ((p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fileno(f), 0))
+	    == MAP_FAILED)
+		return 0;
+	for (; len > 0; offset += w, len -= w)
+		if ((w = write(fileno(r->out), p + offset, len)) <= 0) {
+			if (w == -1 && errno == EINTR) {
+				w = 0;
+				continue;
+			}
+			/* copy the rest */
+			munmap(p, sb.st_size);
+			TIMING_COUNT(COUNTER_BYTES, total - len);
+			fseeko(f, offset, SEEK_SET);
+			return 0;
+		}
+	munmap(p, sb.st_size);
+#endif
+	TIMING_COUNT(COUNTER_BYTES, total);
+	fseeko(f, 0, SEEK_END);
+	return 1;
+}
+
+/* copy the rest of a file, an article for instance */
+void
+hput_file(struct render *r, FILE *f)
+{
+	char buf[BUFSIZ];
+	size_t len;
+
+	if (r->gz != NULL ? hput_file_fragment(r, f) : hput_file_direct(r, f))
+		return;
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+		hwrite(r, buf, len);
+}
+
+void
+hput_escaped(struct render *r, const char *s)
 {
 	char *a, *b;
 	char c;
@@ -140,68 +850,98 @@ hput_escaped(const char *s)
 	for (a = (char *)s; (b = strpbrk(a, "<>'\"&\n")) != NULL; a = b+1) {
 		c = *b;
 		*b = '\0';
-		hputs(a);
+		hputs(r, a);
 		*b = c;
 		switch(c) {
 		case '<':
-			hputs("&lt;");
+			hputs(r, "&lt;");
 			break;
 		case '>':
-			hputs("&gt;");
+			hputs(r, "&gt;");
 			break;
 		case '\'':
-			hputs("&#039;");
+			hputs(r, "&#039;");
 			break;
 		case '"':
-			hputs("&quot;");
+			hputs(r, "&quot;");
 			break;
 		case '&':
-			hputs("&amp;");
+			hputs(r, "&amp;");
 			break;
 		case '\n':
-			hputs("<br>\n");
+			hputs(r, "<br>\n");
 			break;
 		case '\r':
 			break;
 		default:
-			hputc(c);
+			hputc(r, c);
 		}
 	}
-	hputs(a);
+	hputs(r, a);
 }
 
 void
-hput_url(char *page, ...)
+hput_urlencoded(struct render *r, const char *s)
 {
-	va_list ap;
-	char *s;
+	static const char *hex = "0123456789ABCDEF";
+
+	for (; *s != '\0'; ++s) {
+		if ((*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z')
+		    || (*s >= '0' && *s <= '9') || strchr("-_.", *s) != NULL)
+			hputc(r, *s);
+		else if (*s == ' ')
+			hputc(r, '+');
+		else {
+			hputc(r, '%');
+			hputc(r, hex[(unsigned char)*s >> 4]);
+			hputc(r, hex[(unsigned char)*s & 0xf]);
+		}
+	}
+}
+
+void
+hput_url(struct render *r, char *page, ...)
+{
+	va_list ap, aq;
+	char *s, *c;
 	unsigned long p, n;
+	int static_url;
 
-	hputs(status & STATUS_STATIC ? BASE_URL : BIN_URL);
 	va_start(ap, page);
+	/* the search, the keyset pagination and the combinations of tags are
+	 * always dynamic */
+	static_url = r->status & STATUS_STATIC && strcmp(page, "search") != 0
+	    && strncmp(page, "tag_", 4) != 0;
+	if (static_url
+	    && (strcmp(page, "tag") == 0 || strcmp(page, "rss") == 0)) {
+		va_copy(aq, ap);
+		static_url = !is_tag_combination(va_arg(aq, char *));
+		va_end(aq);
+	}
+	hputs(r, static_url ? BASE_URL : BIN_URL);
 	if (strcmp(page, "article") == 0) {
 		s = va_arg(ap, char *);
-		if (status & STATUS_STATIC) {
-			hputs(s);
-			hputs(".html");
+		if (static_url) {
+			hputs(r, s);
+			hputs(r, ".html");
 		} else {
-			 hputs("?article=");
-			 hputs(s);
+			 hputs(r, "?article=");
+			 hputs(r, s);
 		}
 	} else if (strcmp(page, "rss") == 0) {
 		s = va_arg(ap, char *);
-		if (status & STATUS_STATIC) {
-			hputs("rss");
+		if (static_url) {
+			hputs(r, "rss");
 			if (!EMPTYSTRING(s)) {
-				hputc('_');
-				hputs(s);
+				hputc(r, '_');
+				hputs(r, s);
 			}
-			hputs(".xml");
+			hputs(r, ".xml");
 		} else {
-			hputs("?page=rss");
+			hputs(r, "?page=rss");
 			if (!EMPTYSTRING(s)) {
-				hputs("&tag=");
-				hputs(s);
+				hputs(r, "&tag=");
+				hput_urlencoded(r, s);
 			}
 
 		}
@@ -209,77 +949,180 @@ hput_url(char *page, ...)
 		s = va_arg(ap, char *);
 		p = va_arg(ap, unsigned long);
 		n = va_arg(ap, unsigned long);
-		if (status & STATUS_STATIC) {
-			hputs("index");
+		if (static_url) {
+			hputs(r, "index");
 			if (!EMPTYSTRING(s)) {
-				hputc('_');
-				hputs(s);
+				hputc(r, '_');
+				hputs(r, s);
 			}
 			if (p != 0) {
-				hputc('-');
-				hputd(p);
+				hputc(r, '-');
+				hputd(r, p);
 			}
-			hputs(".html");
+			hputs(r, ".html");
 		} else {
 			if (!EMPTYSTRING(s) || p != 0 || n != NB_ARTICLES)
-				hputc('?');
+				hputc(r, '?');
 			if (!EMPTYSTRING(s)) {
-				hputs("tag=");
-				hputs(s);
+				hputs(r, "tag=");
+				hput_urlencoded(r, s);
 			}
 			if (!EMPTYSTRING(s) && p != 0)
-				hputc('&');
+				hputc(r, '&');
 			if (p != 0) {
-				hputs("p=");
-				hputd(p);
+				hputs(r, "p=");
+				hputd(r, p);
 			}
 			if ((!EMPTYSTRING(s) || p != 0) && n != NB_ARTICLES)
-				hputc('&');
+				hputc(r, '&');
 			if (n != NB_ARTICLES) {
-				hputs("n=");
-				hputd(n);
+				hputs(r, "n=");
+				hputd(r, n);
+			}
+		}
+	} else if (strcmp(page, "tag_after") == 0
+	    || strcmp(page, "tag_before") == 0) {
+		/* keyset pagination, only for the dynamic pages */
+		s = va_arg(ap, char *);
+		c = va_arg(ap, char *);
+		n = va_arg(ap, unsigned long);
+		hputc(r, '?');
+		if (!EMPTYSTRING(s)) {
+			hputs(r, "tag=");
+			hput_urlencoded(r, s);
+			hputc(r, '&');
+		}
+		hputs(r, page + sizeof("tag_")-1);
+		hputc(r, '=');
+		hputs(r, c);
+		if (n != NB_ARTICLES) {
+			hputs(r, "&n=");
+			hputd(r, n);
+		}
+	} else if (strcmp(page, "archive") == 0) {
+		s = va_arg(ap, char *);
+		p = va_arg(ap, unsigned long);
+		if (static_url) {
+			hputs(r, "archive_");
+			hputs(r, s);
+			if (p != 0) {
+				hputc(r, '-');
+				hputd(r, p);
+			}
+			hputs(r, ".html");
+		} else {
+			hputs(r, "?archive=");
+			hputs(r, s);
+			if (p != 0) {
+				hputs(r, "&p=");
+				hputd(r, p);
 			}
 		}
+	} else if (strcmp(page, "search") == 0) {
+		s = va_arg(ap, char *);
+		p = va_arg(ap, unsigned long);
+		n = va_arg(ap, unsigned long);
+		hputs(r, "?page=search&q=");
+		hput_urlencoded(r, s);
+		if (p != 0) {
+			hputs(r, "&p=");
+			hputd(r, p);
+		}
+		if (n != NB_ARTICLES) {
+			hputs(r, "&n=");
+			hputd(r, n);
+		}
 	} else if (strcmp(page, "tags") == 0) {
-		if (status & STATUS_STATIC)
-			hputs("tags.html");
+		if (static_url)
+			hputs(r, "tags.html");
 		else
-			hputs("?page=tags");
+			hputs(r, "?page=tags");
 	}
 	va_end(ap);
 }
 
-static int
-hput_generic_markers(const char *m)
+static const char *
+generic_marker(const char *m)
 { 
 	if (strcmp(m, "BASE_URL") == 0)
-		hputs(BASE_URL);
+		return BASE_URL;
+	else if (strcmp(m, "BIN_URL") == 0)
+		return BIN_URL;
 	else if (strcmp(m, "SITE_NAME") == 0)
-		hputs(SITE_NAME);
+		return SITE_NAME;
 	else if (strcmp(m, "DESCRIPTION") == 0)
-		hputs(DESCRIPTION);
+		return DESCRIPTION;
 	else if (strcmp(m, "CHARSET") == 0)
-		hputs(CHARSET);
+		return CHARSET;
 	else if (strcmp(m, "COPYRIGHT") == 0)
-		hputs(COPYRIGHT);
-	else
-		return 0;
-	return 1;
+		return COPYRIGHT;
+	return NULL;
 }
 
-void
-parse_template(const char *file, markers_cb cb, void *data)
+static struct span *
+add_span(struct template *t)
+{
+	struct span *sp;
+
+	if ((t->nb_spans & 15) == 0 && (t->spans = realloc(t->spans,
+	    (t->nb_spans + 16) * sizeof(struct span))) == NULL)
+		err(1, NULL);
+	sp = &t->spans[t->nb_spans++];
+	memset(sp, 0, sizeof(*sp));
+	return sp;
+}
+
+/* append to the text of the last span */
+static void
+add_text(struct template *t, const char *s, size_t len)
+{
+	struct span *sp;
+
+	if (t->nb_spans == 0 || t->spans[t->nb_spans - 1].marker != NULL)
+		add_span(t);
+	sp = &t->spans[t->nb_spans - 1];
+	if ((sp->text = realloc(sp->text, sp->len + len + 1)) == NULL)
+		err(1, NULL);
+	memcpy(sp->text + sp->len, s, len);
+	sp->len += len;
+	sp->text[sp->len] = '\0';
+}
+
+static void
+free_template(struct template *t)
 {
-	char path[MAXPATHLEN], *buf, *lbuf, *a, *b;
+	size_t i;
+
+	for (i = 0; i < t->nb_spans; ++i) {
+		free(t->spans[i].text);
+		free(t->spans[i].marker);
+		free_fragment(&t->spans[i].frag);
+	}
+	free(t->spans);
+	free(t->path);
+	free(t);
+}
+
+/* the generic markers are replaced here, the others are kept as spans */
+static struct template *
+compile_template(const char *path, const struct stat *sb)
+{
+	struct template *t;
+	struct span *sp;
+	const char *s;
+	char *buf, *lbuf, *a, *b;
 	FILE *f;
 	size_t len;
 
-	snprintf(path, MAXPATHLEN, "%s" TEMPLATES_DIR "/%s",
-	    status & STATUS_FROMCMD ? CHROOT_DIR : "", file);
+	TIMING_COUNT(COUNTER_OPENS, 1);
 	if ((f = fopen(path, "r")) == NULL) {
 		 warn("fopen: %s", path);
-		 return;
+		 return NULL;
 	}
+	if ((t = calloc(1, sizeof(struct template))) == NULL
+	    || (t->path = strdup(path)) == NULL)
+		err(1, NULL);
+	t->sb = *sb;
 	lbuf = NULL;
 	while ((buf = fgetln(f, &len))) {
 		if (buf[len - 1] == '\n')
@@ -293,18 +1136,127 @@ parse_template(const char *file, markers_cb cb, void *data)
 			buf = lbuf;
 		}
 		for (a = buf; (b = strstr(a, MARKER_TAG)) != NULL; a = b+2) {
-			*b = '\0';
-			hputs(a);
+			add_text(t, a, b - a);
 			a = b+2;
-			if ((b = strstr(a, MARKER_TAG)) != NULL) {
-				*b = '\0';
-				if (hput_generic_markers(a));
-				else if (cb != NULL)
-					cb(a, data);
+			if ((b = strstr(a, MARKER_TAG)) == NULL) {
+				/* not closed, kept as is */
+				a -= 2;
+				break;
+			}
+			*b = '\0';
+			if ((s = generic_marker(a)) != NULL)
+				add_text(t, s, strlen(s));
+			else {
+				sp = add_span(t);
+				if ((sp->marker = strdup(a)) == NULL)
+					err(1, NULL);
 			}
 		}
-		hputs(a);
-		hputc('\n');
+		add_text(t, a, strlen(a));
+		add_text(t, "\n", 1);
 	}
 	free(lbuf);
+	fclose(f);
+	return t;
+}
+
+static struct template *
+get_template(const char *path)
+{
+	struct template *t;
+	struct stat sb;
+
+	if (stat(path, &sb) == -1) {
+		warn("stat: %s", path);
+		return NULL;
+	}
+	SLIST_FOREACH(t, &templates, next)
+		if (strcmp(t->path, path) == 0)
+			break;
+	if (t != NULL) {
+		if (t->sb.st_ino == sb.st_ino && t->sb.st_size == sb.st_size
+		    && t->sb.st_mtim.tv_sec == sb.st_mtim.tv_sec
+		    && t->sb.st_mtim.tv_nsec == sb.st_mtim.tv_nsec)
+			return t;
+		SLIST_REMOVE(&templates, t, template, next);
+		/* still being rendered */
+		if (t->busy)
+			t->stale = 1;
+		else
+			free_template(t);
+	}
+	if ((t = compile_template(path, &sb)) != NULL)
+		SLIST_INSERT_HEAD(&templates, t, next);
+	return t;
+}
+
+/*
+ * Compressed on its own the first time it is sent, without the lock. The
+ * fragment is not modified nor freed while the template is used, it is
+ * spliced without the lock too.
+ */
+static void
+hput_span(struct render *r, struct span *sp)
+{
+	struct fragment f;
+	int made;
+
+	if (r->gz == NULL || sp->len < FRAGMENT_MIN) {
+		hwrite(r, sp->text, sp->len);
+		return;
+	}
+	pthread_mutex_lock(&templates_lock);
+	made = sp->frag.data != NULL;
+	pthread_mutex_unlock(&templates_lock);
+	if (!made) {
+		if (make_fragment(&f, sp->text, sp->len) == -1) {
+			hwrite(r, sp->text, sp->len);
+			return;
+		}
+		/* the first one made is kept */
+		pthread_mutex_lock(&templates_lock);
+		if (sp->frag.data == NULL)
+			sp->frag = f;
+		else
+			free_fragment(&f);
+		pthread_mutex_unlock(&templates_lock);
+	}
+	gz_splice(r->gz, &sp->frag);
+}
+
+void
+parse_template(struct render *r, const char *file, markers_cb cb, void *data)
+{
+	char path[MAXPATHLEN];
+	struct template *t;
+	size_t i;
+
+	snprintf(path, MAXPATHLEN, "%s" TEMPLATES_DIR "/%s",
+	    status & STATUS_FROMCMD ? CHROOT_DIR : "", file);
+	TIMING_BEGIN(STAGE_TEMPLATE);
+	PROBE1(template__begin, file);
+	CACHE_DEPEND(path);
+	pthread_mutex_lock(&templates_lock);
+	if ((t = get_template(path)) == NULL) {
+		 pthread_mutex_unlock(&templates_lock);
+		 PROBE1(template__end, file);
+		 TIMING_END(STAGE_TEMPLATE);
+		 return;
+	}
+	++t->busy;
+	pthread_mutex_unlock(&templates_lock);
+	for (i = 0; i < t->nb_spans; ++i)
+		if (t->spans[i].marker == NULL)
+			hput_span(r, &t->spans[i]);
+		else {
+			PROBE2(template__marker, file, t->spans[i].marker);
+			if (cb != NULL)
+				cb(r, t->spans[i].marker, data);
+		}
+	pthread_mutex_lock(&templates_lock);
+	if (--t->busy == 0 && t->stale)
+		free_template(t);
+	pthread_mutex_unlock(&templates_lock);
+	PROBE1(template__end, file);
+	TIMING_END(STAGE_TEMPLATE);
 }
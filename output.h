@@ -3,27 +3,60 @@
 #ifndef RENDER_TOOLS_H
 #define RENDER_TOOLS_H
 
-typedef void (markers_cb)(const char *, void *);
+#include <stdio.h>
+#include "common.h"
 
-void	open_output(const char *);
-void	close_output(void);
-void	document_begin_redirection(void);
-void	document_end_redirection(void);
-void	document_not_found(void);
+/*
+ * The state of the rendering of a page, given to the writers and to the
+ * markers, so that several pages can be rendered at once by different
+ * threads. The status is copied from the one of the process.
+ */
+struct render {
+	FILE		*out;		/* where the page is written */
+	enum STATUS	 status;
+	char		*error_str;	/* of the comment posted */
+	struct query	*query_get, *query_post;
+	struct cache_capture *capture;	/* NULL if the page is not cached */
+	/* private to output.c */
+	struct gzip	*gz;
+	FILE		*body, *body_out;
+	const char	*body_type;
+};
+
+typedef void (markers_cb)(struct render *, const char *, void *);
+
+/* compress the pages rendered from the command line */
+extern int	output_gzip;
+/* compress large pages on a thread: 0 no, 1 yes, -1 if several CPUs */
+extern int	output_gzip_thread;
+
+void	render_init(struct render *, FILE *);
+void	open_output(struct render *, const char *);
+void	close_output(struct render *);
+void	document_begin_redirection(struct render *);
+void	document_end_redirection(struct render *);
+void	document_not_found(struct render *);
+void	output_flush(struct render *);
 
-void	hputc(const char);
-void	hputs(const char *);
-void	hputd(const long long);
-void	hput_escaped(const char *);
+void	hputc(struct render *, const char);
+void	hputs(struct render *, const char *);
+void	hputd(struct render *, const long long);
+void	hput_escaped(struct render *, const char *);
+void	hput_urlencoded(struct render *, const char *);
+void	hput_file(struct render *, FILE *);
 
 /*
  * format:
  *     "article", "<article_name>"
  *     "rss", "<tag>"
  *     "tag", "<tag>", <page_number>, <articles_per_page>
+ *     "tag_after", "<tag>", "<article_name>", <articles_per_page>
+ *     "tag_before", "<tag>", "<article_name>", <articles_per_page>
+ *     "archive", "<YYYY or YYYYMM>", <page_number>
+ *     "search", "<query>", <page_number>, <articles_per_page>
  */
-void	hput_url(char *, ...);
+void	hput_url(struct render *, char *, ...);
 
-void	parse_template(const char *, markers_cb, void *);
+void	parse_template(struct render *, const char *, markers_cb, void *);
 
 #endif
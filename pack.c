@@ -0,0 +1,608 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2009 Colin Didier <cdidier@cybione.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Pack of the articles. "blog -p pack" copies the files of ARTICLES_DIR in
+ * ARTICLES_PACK, which is mmap()ed and read instead of the directories as
+ * long as it is newer than ARTICLES_DIR, and an article as long as the pack
+ * is newer than its directory and its files.
+ *
+ * Pack format (the integers are 32 bits, big endian):
+ *	header:		"CLOGPAK2", number of articles, offset of the table,
+ *			number of months, size of the file
+ *	records:	per article, newest first, its name (NUL terminated),
+ *			the content of "article" and of "more"
+ *	table:		sorted newest first, offset of the name, offset and
+ *			length of "article" and of "more" (offset 0 if the
+ *			file is missing)
+ *	months:		newest first, YYYYMM and its number of articles, so
+ *			that the archives are not counted by each process
+ * The records are written one after the other and the tables at the end,
+ * so a full rebuild reads the pack from the beginning to the end.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "articles.h"
+#include "cache.h"
+#include "pack.h"
+
+#define PACK_MAGIC	"CLOGPAK2"
+#define HEADER_SIZE	(sizeof(PACK_MAGIC)-1 + 4*4)
+#define ENTRY_SIZE	(5*4)
+#define MONTH_SIZE	(ARCHIVE_LEN-1 + 4)
+
+/*
+ * A mapping of the pack. The entries returned by pack_lookup() hold a
+ * reference, so it is unmapped once replaced and no longer read.
+ */
+struct pack_map {
+	void		*base;
+	size_t		 size;
+	unsigned long	 refs;
+};
+
+static struct {
+	struct pack_map		*map;
+	const unsigned char	*base;
+	size_t			 size;
+	unsigned long		 nb;
+	const unsigned char	*table, *months;
+	size_t			 table_off;
+	unsigned long		 nb_months;
+	dev_t			 dev;
+	ino_t			 ino;
+	struct timespec		 mtim;
+	time_t			 checked;
+} pack;
+static pthread_mutex_t pack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+put_uint32(unsigned char *p, unsigned long v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static unsigned long
+get_uint32(const unsigned char *p)
+{
+	return (unsigned long)p[0] << 24 | (unsigned long)p[1] << 16
+	    | (unsigned long)p[2] << 8 | p[3];
+}
+
+static void
+pack_path(char *path)
+{
+	extern enum STATUS status;
+
+	snprintf(path, MAXPATHLEN, "%s" ARTICLES_PACK,
+	    status & STATUS_FROMCMD ? CHROOT_DIR : "");
+}
+
+static void
+unref_map(struct pack_map *m)
+{
+	if (--m->refs > 0)
+		return;
+	munmap(m->base, m->size);
+	free(m);
+}
+
+static void
+close_pack(void)
+{
+	if (pack.map != NULL)
+		unref_map(pack.map);
+	memset(&pack, 0, sizeof(pack));
+}
+
+static int
+map_pack(const char *path)
+{
+	struct stat sb;
+	void *p;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		warn("open: %s", path);
+		return -1;
+	}
+	if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)HEADER_SIZE
+	    || sb.st_size > 0xffffffffL) {
+		warnx("%s: invalid pack", path);
+		close(fd);
+		return -1;
+	}
+	if ((pack.map = malloc(sizeof(struct pack_map))) == NULL) {
+		warn("malloc");
+		close(fd);
+		return -1;
+	}
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		warn("mmap: %s", path);
+		free(pack.map);
+		pack.map = NULL;
+		return -1;
+	}
+	pack.map->base = p;
+	pack.map->size = sb.st_size;
+	pack.map->refs = 1;
+	pack.base = p;
+	pack.size = sb.st_size;
+	pack.dev = sb.st_dev;
+	pack.ino = sb.st_ino;
+	pack.mtim = sb.st_mtim;
+	if (memcmp(pack.base, PACK_MAGIC, sizeof(PACK_MAGIC)-1) != 0)
+		goto invalid;
+	pack.nb = get_uint32(pack.base + sizeof(PACK_MAGIC)-1);
+	pack.table_off = get_uint32(pack.base + sizeof(PACK_MAGIC)-1 + 4);
+	pack.nb_months = get_uint32(pack.base + sizeof(PACK_MAGIC)-1 + 8);
+	if (get_uint32(pack.base + sizeof(PACK_MAGIC)-1 + 12) != pack.size
+	    || pack.table_off < HEADER_SIZE || pack.table_off > pack.size
+	    || pack.nb > (pack.size - pack.table_off) / ENTRY_SIZE
+	    || pack.nb_months > (pack.size - pack.table_off
+	    - pack.nb*ENTRY_SIZE) / MONTH_SIZE)
+		goto invalid;
+	pack.table = pack.base + pack.table_off;
+	pack.months = pack.table + pack.nb*ENTRY_SIZE;
+	return 0;
+
+invalid:
+	warnx("%s: invalid pack", path);
+	close_pack();
+	return -1;
+}
+
+/*
+ * Map the pack if it is not older than the articles. This is checked again
+ * at most once per second, and the pack is mapped again when it is replaced.
+ */
+static int
+check_pack(void)
+{
+	char path[MAXPATHLEN], dir[MAXPATHLEN];
+	struct timespec mtim;
+	struct stat sb;
+	time_t now;
+	extern enum STATUS status;
+
+	pack_path(path);
+	snprintf(dir, MAXPATHLEN, "%s" ARTICLES_DIR,
+	    status & STATUS_FROMCMD ? CHROOT_DIR : "");
+	CACHE_DEPEND(path);
+	CACHE_DEPEND(dir);
+	now = time(NULL);
+	if (pack.checked == now)
+		return pack.base != NULL ? 0 : -1;
+	if (stat(path, &sb) == -1)
+		goto none;
+	articles_mtim(&mtim);
+	if (sb.st_mtim.tv_sec < mtim.tv_sec || (sb.st_mtim.tv_sec
+	    == mtim.tv_sec && sb.st_mtim.tv_nsec < mtim.tv_nsec))
+		goto none;
+	if (pack.base == NULL || pack.dev != sb.st_dev
+	    || pack.ino != sb.st_ino
+	    || pack.mtim.tv_sec != sb.st_mtim.tv_sec
+	    || pack.mtim.tv_nsec != sb.st_mtim.tv_nsec) {
+		close_pack();
+		if (map_pack(path) == -1)
+			goto none;
+	}
+	pack.checked = now;
+	return 0;
+
+none:	close_pack();
+	pack.checked = now;
+	return -1;
+}
+
+/* the pack is read under its lock, which is kept if it returns 0 */
+static int
+open_pack(void)
+{
+	pthread_mutex_lock(&pack_lock);
+	if (check_pack() == 0)
+		return 0;
+	pthread_mutex_unlock(&pack_lock);
+	return -1;
+}
+
+/* name of an entry of the table, NULL if it is invalid */
+static const char *
+entry_name(unsigned long i)
+{
+	unsigned long off;
+
+	off = get_uint32(pack.table + i*ENTRY_SIZE);
+	if (off < HEADER_SIZE || off >= pack.table_off
+	    || memchr(pack.base + off, '\0', pack.table_off - off) == NULL)
+		return NULL;
+	return (const char *)pack.base + off;
+}
+
+static const char *
+entry_file(unsigned long i, int file, size_t *len)
+{
+	unsigned long off;
+
+	off = get_uint32(pack.table + i*ENTRY_SIZE + 4 + file*8);
+	*len = get_uint32(pack.table + i*ENTRY_SIZE + 8 + file*8);
+	if (off == 0 || off > pack.table_off || *len > pack.table_off - off) {
+		*len = 0;
+		return NULL;
+	}
+	return (const char *)pack.base + off;
+}
+
+/* binary search of an article, the table is sorted newest first */
+static int
+find_entry(const char *article, unsigned long *i)
+{
+	unsigned long lo, hi, mid;
+	const char *name;
+	int cmp;
+
+	lo = 0;
+	hi = pack.nb;
+	while (lo < hi) {
+		mid = lo + (hi - lo)/2;
+		if ((name = entry_name(mid)) == NULL)
+			break;
+		if ((cmp = strcmp(name, article)) == 0) {
+			*i = mid;
+			return 0;
+		} else if (cmp > 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*i = lo;
+	return -1;
+}
+
+/*
+ * The latest modification time of the directory and of the files of an
+ * article: editing a file changes neither ARTICLES_DIR nor the directory.
+ */
+static void
+entry_mtim(const char *article, struct timespec *mtim)
+{
+	static const char *files[] = { NULL, "article", "more" };
+	char path[MAXPATHLEN];
+	struct stat sb;
+	size_t i;
+
+	mtim->tv_sec = mtim->tv_nsec = 0;
+	for (i = 0; i < sizeof(files)/sizeof(files[0]); ++i) {
+		article_path(path, article, files[i]);
+		CACHE_DEPEND(path);
+		if (stat(path, &sb) == -1)
+			continue;
+		if (sb.st_mtim.tv_sec > mtim->tv_sec
+		    || (sb.st_mtim.tv_sec == mtim->tv_sec
+		    && sb.st_mtim.tv_nsec > mtim->tv_nsec))
+			*mtim = sb.st_mtim;
+	}
+}
+
+/*
+ * The files of an article, from the pack. Return -1 if there is no pack to
+ * read from, or if the article was changed after the pack was written,
+ * p->article is NULL if the article is not in the pack. The files stay
+ * mapped until pack_release(p->map).
+ */
+int
+pack_lookup(const char *article, struct pack_entry *p)
+{
+	struct timespec mtim;
+	unsigned long i;
+
+	memset(p, 0, sizeof(*p));
+	entry_mtim(article, &mtim);
+	if (open_pack() == -1)
+		return -1;
+	if (mtim.tv_sec > pack.mtim.tv_sec || (mtim.tv_sec == pack.mtim.tv_sec
+	    && mtim.tv_nsec > pack.mtim.tv_nsec)) {
+		pthread_mutex_unlock(&pack_lock);
+		return -1;
+	}
+	if (find_entry(article, &i) == 0) {
+		p->article = entry_file(i, 0, &p->article_len);
+		p->more = entry_file(i, 1, &p->more_len);
+		p->map = pack.map;
+		++p->map->refs;
+	}
+	pthread_mutex_unlock(&pack_lock);
+	return 0;
+}
+
+void
+pack_release(struct pack_map *m)
+{
+	if (m == NULL)
+		return;
+	pthread_mutex_lock(&pack_lock);
+	unref_map(m);
+	pthread_mutex_unlock(&pack_lock);
+}
+
+/*
+ * The names of the articles, newest first, as scan_articles() does for
+ * ARTICLES_DIR, from the first-th one. Return -1 if there is no pack to
+ * read from.
+ */
+int
+pack_list(unsigned long first, unsigned long limit, struct article_list *list,
+    unsigned long *total)
+{
+	const char *name;
+	unsigned long i, nb;
+	size_t len;
+	char *s;
+	int ret;
+
+	list->names = NULL;
+	list->nb = 0;
+	if (open_pack() == -1)
+		return -1;
+	if (total != NULL)
+		*total = pack.nb;
+	ret = -1;
+	nb = first < pack.nb ? pack.nb - first : 0;
+	if (limit != 0)
+		nb = MIN(limit, nb);
+	for (i = 0, len = 0; i < nb; ++i) {
+		if ((name = entry_name(first + i)) == NULL)
+			goto out;
+		len += strlen(name) + 1;
+	}
+	ret = 0;
+	if (nb == 0)
+		goto out;
+	if ((list->names = malloc(nb * sizeof(char *) + len)) == NULL) {
+		warn("malloc");
+		ret = -1;
+		goto out;
+	}
+	s = (char *)(list->names + nb);
+	for (i = 0; i < nb; ++i) {
+		len = strlen(entry_name(first + i)) + 1;
+		memcpy(s, entry_name(first + i), len);
+		list->names[i] = s;
+		s += len;
+	}
+	list->nb = nb;
+out:	pthread_mutex_unlock(&pack_lock);
+	return ret;
+}
+
+/*
+ * The number of articles newer than an article, and 1 if it is in the
+ * pack, 0 if not. Return -1 if there is no pack.
+ */
+int
+pack_search(const char *article, unsigned long *newer)
+{
+	int ret;
+
+	if (open_pack() == -1)
+		return -1;
+	ret = find_entry(article, newer) == 0;
+	pthread_mutex_unlock(&pack_lock);
+	return ret;
+}
+
+/*
+ * Number of articles and position of an article (0 if it is not there), as
+ * count_articles() does for ARTICLES_DIR. Return -1 if there is no pack.
+ */
+int
+pack_count(const char *article, unsigned long *total, unsigned long *number)
+{
+	unsigned long i;
+
+	if (open_pack() == -1)
+		return -1;
+	*total = pack.nb;
+	if (number != NULL)
+		*number = article != NULL && find_entry(article, &i) == 0 ?
+		    i + 1 : 0;
+	pthread_mutex_unlock(&pack_lock);
+	return 0;
+}
+
+/*
+ * Number of articles per month, newest first, as get_archives() counts
+ * them. NULL if there is no pack, or no article.
+ */
+struct archive *
+pack_archives(unsigned long *nb)
+{
+	struct archive *archives;
+	const unsigned char *m;
+	unsigned long i;
+
+	*nb = 0;
+	if (open_pack() == -1)
+		return NULL;
+	archives = NULL;
+	if (pack.nb_months != 0 && (archives = calloc(pack.nb_months,
+	    sizeof(struct archive))) == NULL)
+		warn("calloc");
+	for (i = 0; archives != NULL && i < pack.nb_months; ++i) {
+		m = pack.months + i*MONTH_SIZE;
+		memcpy(archives[i].period, m, ARCHIVE_LEN-1);
+		archives[i].number = get_uint32(m + ARCHIVE_LEN-1);
+	}
+	if (archives != NULL)
+		*nb = pack.nb_months;
+	pthread_mutex_unlock(&pack_lock);
+	return archives;
+}
+
+int
+is_packed(void)
+{
+	char path[MAXPATHLEN];
+
+	pack_path(path);
+	return access(path, F_OK) == 0;
+}
+
+/* append a file of an article, the offset is 0 if it does not exist */
+static int
+write_file(FILE *f, const char *article, const char *file,
+    unsigned char *entry)
+{
+	char path[MAXPATHLEN], buf[BUFSIZ];
+	unsigned long off, len;
+	size_t n;
+	FILE *in;
+
+	put_uint32(entry, 0);
+	put_uint32(entry+4, 0);
+	article_path(path, article, file);
+	if ((in = fopen(path, "r")) == NULL) {
+		if (errno != ENOENT) {
+			warn("fopen: %s", path);
+			return -1;
+		}
+		return 0;
+	}
+	off = ftell(f);
+	for (len = 0; (n = fread(buf, 1, sizeof(buf), in)) > 0; len += n)
+		fwrite(buf, 1, n, f);
+	if (ferror(in)) {
+		warn("fread: %s", path);
+		fclose(in);
+		return -1;
+	}
+	fclose(in);
+	put_uint32(entry, off);
+	put_uint32(entry+4, len);
+	return 0;
+}
+
+int
+build_pack(void)
+{
+	char path[MAXPATHLEN], tmp[MAXPATHLEN+sizeof(".tmp")];
+	struct article_list list;
+	unsigned char header[HEADER_SIZE], *table, month[MONTH_SIZE];
+	unsigned long i, j, nb_months;
+	long off;
+	FILE *f;
+	extern enum STATUS status;
+
+	/* the directories, not the previous pack */
+	pthread_mutex_lock(&pack_lock);
+	close_pack();
+	pack.checked = time(NULL);
+	pthread_mutex_unlock(&pack_lock);
+	if (list_articles(NULL, &list) == -1)
+		return -1;
+	table = NULL;
+	if (list.nb != 0 && (table = calloc(list.nb, ENTRY_SIZE)) == NULL) {
+		warn("calloc");
+		free_article_list(&list);
+		return -1;
+	}
+	pack_path(path);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (status & STATUS_FROMCMD)
+		fprintf(stderr, "Writing %s...\n", path);
+	if ((f = fopen(tmp, "w")) == NULL) {
+		warn("fopen: %s", tmp);
+		goto err;
+	}
+	memset(header, 0, sizeof(header));
+	fwrite(header, sizeof(header), 1, f);
+	for (i = 0; i < list.nb; ++i) {
+		put_uint32(table + i*ENTRY_SIZE, ftell(f));
+		fwrite(list.names[i], strlen(list.names[i]) + 1, 1, f);
+		if (write_file(f, list.names[i], "article",
+		    table + i*ENTRY_SIZE + 4) == -1
+		    || write_file(f, list.names[i], "more",
+		    table + i*ENTRY_SIZE + 12) == -1)
+			goto err_tmp;
+	}
+	off = ftell(f);
+	if (list.nb != 0)
+		fwrite(table, ENTRY_SIZE, list.nb, f);
+	/* the names are sorted, the articles of a month follow each other */
+	for (i = 0, nb_months = 0; i < list.nb; i = j, ++nb_months) {
+		for (j = i + 1; j < list.nb && strncmp(list.names[i],
+		    list.names[j], ARCHIVE_LEN-1) == 0; ++j)
+			;
+		memcpy(month, list.names[i], ARCHIVE_LEN-1);
+		put_uint32(month + ARCHIVE_LEN-1, j - i);
+		fwrite(month, MONTH_SIZE, 1, f);
+	}
+	if (off == -1 || ftell(f) > 0xffffffffL) {
+		warnx("%s: too large", tmp);
+		goto err_tmp;
+	}
+	memcpy(header, PACK_MAGIC, sizeof(PACK_MAGIC)-1);
+	put_uint32(header+sizeof(PACK_MAGIC)-1, list.nb);
+	put_uint32(header+sizeof(PACK_MAGIC)-1+4, off);
+	put_uint32(header+sizeof(PACK_MAGIC)-1+8, nb_months);
+	put_uint32(header+sizeof(PACK_MAGIC)-1+12, ftell(f));
+	rewind(f);
+	fwrite(header, sizeof(header), 1, f);
+	if (ferror(f) | (fclose(f) == EOF)) {
+		warn("fwrite: %s", tmp);
+		unlink(tmp);
+		goto err;
+	}
+	if (rename(tmp, path) == -1) {
+		warn("rename: %s", path);
+		unlink(tmp);
+		goto err;
+	}
+	free(table);
+	free_article_list(&list);
+	pthread_mutex_lock(&pack_lock);
+	pack.checked = 0;
+	pthread_mutex_unlock(&pack_lock);
+	return 0;
+
+err_tmp:
+	fclose(f);
+	unlink(tmp);
+err:	free(table);
+	free_article_list(&list);
+	return -1;
+}
@@ -0,0 +1,26 @@
+/* $Id$ */
+
+#ifndef PACK_H
+#define PACK_H
+
+#include "articles.h"
+
+struct pack_map;
+
+struct pack_entry {
+	const char	*article, *more;	/* NULL if missing */
+	size_t		 article_len, more_len;
+	struct pack_map	*map;
+};
+
+int	build_pack(void);
+int	is_packed(void);
+int	pack_lookup(const char *, struct pack_entry *);
+void	pack_release(struct pack_map *);
+int	pack_list(unsigned long, unsigned long, struct article_list *,
+	    unsigned long *);
+int	pack_search(const char *, unsigned long *);
+struct archive *pack_archives(unsigned long *);
+int	pack_count(const char *, unsigned long *, unsigned long *);
+
+#endif
@@ -0,0 +1,292 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2009 Colin Didier <cdidier@cybione.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Read ahead of the files of the articles of a page, before rendering it.
+ * On Linux, the files are opened by a batch of requests to io_uring, then
+ * read ahead and closed by a second batch, so that the kernel looks them up
+ * and reads them in parallel. Elsewhere, or when io_uring is not available,
+ * each file is opened and posix_fadvise(2) starts reading it. Nothing is
+ * read here: the pages come from the page cache afterwards.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "common.h"
+#include "articles.h"
+#include "pack.h"
+#include "prefetch.h"
+#include "timing.h"
+
+/* files opened by a submission, each one needs two requests afterwards */
+#define PREFETCH_BATCH	32
+
+#ifdef __linux__
+static struct {
+	int			 init;
+	int			 fd;	/* -1 if io_uring is not available */
+	unsigned		*sq_tail, *sq_mask, *sq_array;
+	unsigned		*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+} ring = { 0 };
+
+/*
+ * The opcodes used are those of Linux 5.6, where IORING_REGISTER_PROBE
+ * appeared as well: on an older kernel the probe fails, the ring is not
+ * used.
+ */
+static int
+ring_supported(void)
+{
+	static const int ops[] = { IORING_OP_OPENAT, IORING_OP_FADVISE,
+	    IORING_OP_CLOSE };
+	struct io_uring_probe *p;
+	unsigned i;
+	int ret;
+
+	if ((p = calloc(1, sizeof(*p) + 256 * sizeof(p->ops[0]))) == NULL)
+		return 0;
+	ret = syscall(SYS_io_uring_register, ring.fd, IORING_REGISTER_PROBE,
+	    p, 256) != -1;
+	for (i = 0; ret && i < sizeof(ops) / sizeof(ops[0]); ++i)
+		ret = ops[i] < p->ops_len
+		    && p->ops[ops[i]].flags & IO_URING_OP_SUPPORTED;
+	free(p);
+	return ret;
+}
+
+static int
+ring_init(void)
+{
+	struct io_uring_params p;
+	unsigned char *sq, *cq;
+	size_t sq_len, cq_len;
+
+	ring.init = 1;
+	memset(&p, 0, sizeof(p));
+	if ((ring.fd = syscall(SYS_io_uring_setup, 2*PREFETCH_BATCH,
+	    &p)) == -1)
+		return -1;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !ring_supported())
+		goto fail;
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((sq = mmap(NULL, MAX(sq_len, cq_len), PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING))
+	    == MAP_FAILED)
+		goto fail;
+	cq = sq;
+	if ((ring.sqes = mmap(NULL, p.sq_entries *
+	    sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQES))
+	    == MAP_FAILED) {
+		munmap(sq, MAX(sq_len, cq_len));
+		goto fail;
+	}
+	ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+fail:	close(ring.fd);
+	ring.fd = -1;
+	return -1;
+}
+
+static struct io_uring_sqe *
+ring_sqe(unsigned i, int opcode, int fd, uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	tail = *ring.sq_tail + i;
+	idx = tail & *ring.sq_mask;
+	sqe = &ring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = data;
+	ring.sq_array[idx] = idx;
+	return sqe;
+}
+
+/*
+ * Submit the nb requests prepared and wait until all of them completed:
+ * io_uring_enter(2) may return once they are submitted, if a signal
+ * interrupts the wait, and no completion may be left for the next batch.
+ * On an error, the ring is closed with its requests and not used again.
+ */
+static int
+ring_wait(unsigned nb)
+{
+	unsigned submitted, ready;
+	int n;
+
+	__atomic_store_n(ring.sq_tail, *ring.sq_tail + nb, __ATOMIC_RELEASE);
+	for (submitted = 0;;) {
+		ready = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)
+		    - *ring.cq_head;
+		if (submitted == nb && ready >= nb)
+			return 0;
+		if ((n = syscall(SYS_io_uring_enter, ring.fd, nb - submitted,
+		    nb - MIN(ready, nb), IORING_ENTER_GETEVENTS, NULL, 0))
+		    == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("io_uring_enter");
+			close(ring.fd);
+			ring.fd = -1;
+			return -1;
+		}
+		submitted += n;
+	}
+}
+
+/* the i-th completion of the batch, once ring_wait() returned */
+static struct io_uring_cqe *
+ring_cqe(unsigned i)
+{
+	return &ring.cqes[(*ring.cq_head + i) & *ring.cq_mask];
+}
+
+/* the nb completions of the batch are read */
+static void
+ring_seen(unsigned nb)
+{
+	__atomic_store_n(ring.cq_head, *ring.cq_head + nb, __ATOMIC_RELEASE);
+}
+
+static int
+ring_prefetch(char paths[][MAXPATHLEN], unsigned long nb)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int fds[PREFETCH_BATCH];
+	unsigned long i, n;
+
+	for (i = 0; i < nb; ++i) {
+		fds[i] = -1;
+		sqe = ring_sqe(i, IORING_OP_OPENAT, AT_FDCWD, i);
+		sqe->addr = (uintptr_t)paths[i];
+		sqe->open_flags = O_RDONLY|O_CLOEXEC;
+	}
+	if (ring_wait(nb) == -1)
+		return -1;
+	for (i = 0; i < nb; ++i) {
+		cqe = ring_cqe(i);
+		if (cqe->user_data < nb)
+			fds[cqe->user_data] = cqe->res;
+	}
+	ring_seen(nb);
+	TIMING_COUNT(COUNTER_OPENS, nb);
+	/* the file is closed once its read ahead is started */
+	for (i = 0, n = 0; i < nb; ++i) {
+		if (fds[i] < 0)
+			continue;
+		sqe = ring_sqe(n++, IORING_OP_FADVISE, fds[i], 0);
+		sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+		sqe->flags = IOSQE_IO_LINK;
+		ring_sqe(n++, IORING_OP_CLOSE, fds[i], fds[i] + 1);
+	}
+	if (n == 0)
+		return 0;
+	/* some may be closed already: the others are left open */
+	if (ring_wait(n) == -1)
+		return 0;
+	for (i = 0; i < n; ++i) {
+		cqe = ring_cqe(i);
+		if (cqe->user_data != 0 && cqe->res == -ECANCELED)
+			close(cqe->user_data - 1);
+	}
+	ring_seen(n);
+	return 0;
+}
+#endif /* __linux__ */
+
+static void
+prefetch_files(char paths[][MAXPATHLEN], unsigned long nb)
+{
+	unsigned long i;
+	int fd;
+
+	if (nb == 0)
+		return;
+#ifdef __linux__
+	if (!ring.init)
+		ring_init();
+	if (ring.fd != -1 && ring_prefetch(paths, nb) == 0)
+		return;
+#endif
+	for (i = 0; i < nb; ++i) {
+		TIMING_COUNT(COUNTER_OPENS, 1);
+		if ((fd = open(paths[i], O_RDONLY|O_CLOEXEC)) == -1)
+			continue;
+#ifdef POSIX_FADV_WILLNEED
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+		close(fd);
+	}
+}
+
+/*
+ * Read ahead "article", "more" and "comments" of the nb articles, or only
+ * "comments" if the articles come from the pack.
+ */
+void
+prefetch_articles(char **names, unsigned long nb)
+{
+	static char paths[PREFETCH_BATCH][MAXPATHLEN];
+	static const char *files[] = { "comments", "article", "more" };
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	unsigned long i, n, f, nb_files;
+
+	nb_files = is_packed() ? 1 : 3;
+	/* the paths and the ring are shared */
+	pthread_mutex_lock(&lock);
+	TIMING_BEGIN(STAGE_ARTICLE);
+	for (i = 0, n = 0; i < nb; ++i)
+		for (f = 0; f < nb_files; ++f) {
+			article_path(paths[n++], names[i], files[f]);
+			if (n == PREFETCH_BATCH) {
+				prefetch_files(paths, n);
+				n = 0;
+			}
+		}
+	prefetch_files(paths, n);
+	TIMING_END(STAGE_ARTICLE);
+	pthread_mutex_unlock(&lock);
+}
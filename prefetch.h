@@ -0,0 +1,8 @@
+/* $Id$ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+void	prefetch_articles(char **, unsigned long);
+
+#endif
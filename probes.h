@@ -0,0 +1,36 @@
+/* $Id$ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * Static tracepoints of the provider "clog", for bpftrace, perf or dtrace
+ * (see bench/trace/). They are only compiled with USE_SDT (which needs the
+ * <sys/sdt.h> of systemtap or dtrace). Each probe has a semaphore, which
+ * the tracers increment while they are attached to it: until then a probe
+ * costs a test, and its arguments are not evaluated. PROBE_SEMAPHORE()
+ * defines the semaphore, in the file using the probe.
+ */
+#ifdef USE_SDT
+#define _SDT_HAS_SEMAPHORES	1
+#include <sys/sdt.h>
+
+#define PROBE_SEMAPHORE(n)						\
+	unsigned short clog_##n##_semaphore				\
+	    __attribute__((section(".probes")));
+#define PROBE_ENABLED(n)	__builtin_expect(clog_##n##_semaphore, 0)
+#define PROBE1(n, a)		do {					\
+	if (PROBE_ENABLED(n))						\
+		DTRACE_PROBE1(clog, n, a);				\
+} while (0)
+#define PROBE2(n, a, b)		do {					\
+	if (PROBE_ENABLED(n))						\
+		DTRACE_PROBE2(clog, n, a, b);				\
+} while (0)
+#else
+#define PROBE_SEMAPHORE(n)
+#define PROBE1(n, a)		do { } while (0)
+#define PROBE2(n, a, b)		do { } while (0)
+#endif
+
+#endif
@@ -18,6 +18,7 @@
 
 #include <ctype.h>
 #include <err.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,40 +30,174 @@
 #include "articles.h"
 #include "comments.h"
 
+size_t	rfc822_format(const struct tm *, char *, size_t);
+
+/*
+ * The formatted dates are memoized: static builds render the same article
+ * (article page, index and tag pages, RSS feeds) and the same comments
+ * many times. The memo is shared by the renders, a date is copied in the
+ * buffer of the caller.
+ */
+#define DATE_CACHE_SIZE	64
+#define DATE_LEN	64
+
+enum DATE_FORMAT {
+	DATE_ARTICLE,
+	DATE_ARTICLE_RFC822,
+	DATE_COMMENT,
+};
+
+static struct date_cache {
+	enum DATE_FORMAT format;
+	long long	 key;
+	char		 str[DATE_LEN];
+} date_cache[DATE_CACHE_SIZE];
+static pthread_mutex_t date_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *
+format_date(enum DATE_FORMAT format, struct tm *tm, time_t t,
+    char buf[DATE_LEN])
+{
+	struct date_cache *dc;
+	struct tm ltm;
+	long long key;
+
+	/* the articles dates are not normalized, use them as the key */
+	if (format == DATE_COMMENT)
+		key = t;
+	else
+		key = ((((tm->tm_year * 100LL + tm->tm_mon) * 100 + tm->tm_mday)
+		    * 100 + tm->tm_hour) * 100 + tm->tm_min);
+	dc = &date_cache[(unsigned long long)(key * 31 + format)
+	    % DATE_CACHE_SIZE];
+	pthread_mutex_lock(&date_lock);
+	if (dc->str[0] != '\0' && dc->key == key && dc->format == format) {
+		memcpy(buf, dc->str, DATE_LEN);
+		pthread_mutex_unlock(&date_lock);
+		return buf;
+	}
+	pthread_mutex_unlock(&date_lock);
+	if (format == DATE_COMMENT)
+		tm = localtime_r(&t, &ltm);
+	else {
+		ltm = *tm;
+		mktime(&ltm);
+		tm = &ltm;
+	}
+	if (tm == NULL)
+		buf[0] = '\0';
+	else if (format == DATE_ARTICLE_RFC822)
+		rfc822_format(tm, buf, DATE_LEN);
+	else if (strftime(buf, DATE_LEN, TIME_FORMAT, tm) == 0)
+		buf[0] = '\0';
+	pthread_mutex_lock(&date_lock);
+	memcpy(dc->str, buf, DATE_LEN);
+	dc->format = format;
+	dc->key = key;
+	pthread_mutex_unlock(&date_lock);
+	return buf;
+}
+
+static void
+render_archives(struct render *r)
+{
+	struct archive *archives;
+	unsigned long nb_archives, i;
+	char year[5];
+
+	archives = get_archives(&nb_archives);
+	for (i = 0; i < nb_archives; ++i) {
+		if (i == 0 || strncmp(archives[i].period,
+		    archives[i-1].period, 4) != 0) {
+			if (i != 0)
+				hputs(r, "<br>\n");
+			strlcpy(year, archives[i].period, sizeof(year));
+			hputs(r, "<a href=\"");
+			hput_url(r, "archive", year, 0);
+			hputs(r, "\">");
+			hputs(r, year);
+			hputs(r, "</a>:");
+		}
+		hputs(r, " <a href=\"");
+		hput_url(r, "archive", archives[i].period, 0);
+		hputs(r, "\">");
+		hputs(r, archives[i].period+4);
+		hputs(r, "</a> (");
+		hputd(r, archives[i].number);
+		hputc(r, ')');
+	}
+	free(archives);
+}
+
+/*
+ * At %%PAGE_BODY%%: send the head of the page if the route is one of
+ * EARLY_FLUSH, before the articles are read.
+ */
 static void
-markers_comment(const char *m, struct comment *c)
+flush_head(struct render *r, const char *route)
 {
-	char date[BUFSIZ], *buf, *a, *b, ch;
+#ifdef EARLY_FLUSH
+	const char *list = EARLY_FLUSH, *s;
+	size_t len;
+
+	len = strlen(route);
+	for (s = list; (s = strstr(s, route)) != NULL; s += len)
+		if ((s == list || s[-1] == ' ')
+		    && (s[len] == '\0' || s[len] == ' ')) {
+			output_flush(r);
+			return;
+		}
+#else
+	(void)r;
+	(void)route;
+#endif
+}
+
+/* markers of page.html which don't depend on the page */
+static int
+markers_page(struct render *r, const char *m)
+{
+	if (strcmp(m, "ARCHIVES") == 0)
+		render_archives(r);
+	else
+		return 0;
+	return 1;
+}
+
+static void
+markers_comment(struct render *r, const char *m, struct comment *c)
+{
+	char date[DATE_LEN];
+	char *buf, *a, *b, ch;
 	int freeln;
 
 	if (strcmp(m, "COMMENT_AUTHOR") == 0) {
 		if (!EMPTYSTRING(c->mail)) {
-			hputs("<a href=\"mailto:");
-			hput_escaped(c->mail);
-			hputs("\">");
+			hputs(r, "<a href=\"mailto:");
+			hput_escaped(r, c->mail);
+			hputs(r, "\">");
 		}
-		hput_escaped(c->author);
+		hput_escaped(r, c->author);
 		if (!EMPTYSTRING(c->mail))
-			hputs("</a>");
+			hputs(r, "</a>");
 	} else if (strcmp(m, "COMMENT_NB") == 0) {
-		hputd(c->number);
+		hputd(r, c->number);
 	} else if (strcmp(m, "COMMENT_DATE") == 0) {
-		strftime(date, sizeof(date), TIME_FORMAT, localtime(&c->date));
-		hputs(date);
+		hputs(r, format_date(DATE_COMMENT, NULL, c->date, date));
 	} else if (strcmp(m, "COMMENT_IP") == 0) {
 		if (!EMPTYSTRING(c->ip))
-			hputs(c->ip);
+			hputs(r, c->ip);
 	} else if (strcmp(m, "COMMENT_MAIL") == 0) {
 		if (!EMPTYSTRING(c->mail)) {
-			hputs("<a href=\"mailto:");
-			hput_escaped(c->mail);
-			hputs("\">mail</a>");
+			hputs(r, "<a href=\"mailto:");
+			hput_escaped(r, c->mail);
+			hputs(r, "\">mail</a>");
 		}
 	} else if (strcmp(m, "COMMENT_WEB") == 0) {
 		if (!EMPTYSTRING(c->web)) {
-			hputs("<a href=\"");
-			hput_escaped(c->web);
-			hputs("\">web</a>");
+			hputs(r, "<a href=\"");
+			hput_escaped(r, c->web);
+			hputs(r, "\">web</a>");
 		}
 	} else if (strcmp(m, "COMMENT_TEXT") == 0) {
 		while ((buf = read_commentln(c, &freeln))) {
@@ -70,7 +205,7 @@ markers_comment(const char *m, struct comment *c)
 			for (a = buf; (b = strstr(a, "http://")) != NULL
 			    || (b = strstr(a, "https://")) != NULL; a = b) {
 				*b = '\0';
-				hput_escaped(a);
+				hput_escaped(r, a);
 				*b = 'h';
 				a = b;
 				for (ch = '\0'; ch == '\0' && *b != '\0' ; ++b)
@@ -83,15 +218,15 @@ markers_comment(const char *m, struct comment *c)
 						*b = '\0';
 					}
 				--b;
-				hputs("<a href=\"");
-				hput_escaped(a);
-				hputs("\">");
-				hput_escaped(a);
-				hputs("</a>");
+				hputs(r, "<a href=\"");
+				hput_escaped(r, a);
+				hputs(r, "\">");
+				hput_escaped(r, a);
+				hputs(r, "</a>");
 				*b = ch;
 			}
-			hput_escaped(a);
-			hputs("<br>\n");
+			hput_escaped(r, a);
+			hputs(r, "<br>\n");
 			if (freeln)
 				free(buf);
 		}
@@ -99,133 +234,128 @@ markers_comment(const char *m, struct comment *c)
 }
 
 static void
-render_comment(struct comment *c)
+render_comment(struct comment *c, struct render *r)
 {
-	parse_template("article_comment.html", (markers_cb *)markers_comment,
-	    c);
+	parse_template(r, "article_comment.html",
+	    (markers_cb *)markers_comment, c);
 }
 
 static void
-markers_comment_form(const char *m, struct article *a)
+markers_comment_form(struct render *r, const char *m,
+    struct article *a)
 {
-	extern char *error_str;
-	extern struct query *query_post;
 	char *s;
 
 	if (strcmp(m, "FORM_POST_URL") == 0) {
-		hputs(BIN_URL "?article=");
-		hputs(a->name);
+		hputs(r, BIN_URL "?article=");
+		hputs(r, a->name);
 	} else if (strcmp(m, "ANTISPAM_JAM1") == 0) {
 		if (a->antispam != NULL) {
-			hputs("&#");
-			hputd(a->antispam->jam1+48);
-			hputc(';');
+			hputs(r, "&#");
+			hputd(r, a->antispam->jam1+48);
+			hputc(r, ';');
 		}
 	} else if (strcmp(m, "ANTISPAM_JAM2") == 0) {
 		if (a->antispam != NULL) {
-			hputs("&#");
-			hputd(a->antispam->jam2+48);
-			hputc(';');
+			hputs(r, "&#");
+			hputd(r, a->antispam->jam2+48);
+			hputc(r, ';');
 		}
 	} else if (strcmp(m, "ANTISPAM_HASH") == 0) {
 		if (a->antispam != NULL)
-			hputs(a->antispam->hash);
-	} else if (error_str == NULL)
+			hputs(r, a->antispam->hash);
+	} else if (r->error_str == NULL)
 		return; /* ignore the following if there is no error */
 	if (strcmp(m, "FORM_ERROR") == 0) {
-		hputs("<span style=\"color: red;\"><b>");
-		hputs(error_str);
-		hputs("</b></span>");
+		hputs(r, "<span style=\"color: red;\"><b>");
+		hputs(r, r->error_str);
+		hputs(r, "</b></span>");
 	} else if (strcmp(m, "FORM_AUTHOR") == 0) {
-		if ((s = get_query_param(query_post, "author")) != NULL)
-			hput_escaped(s);
+		if ((s = get_query_param(r->query_post, "author")) != NULL)
+			hput_escaped(r, s);
 	} else if (strcmp(m, "FORM_MAIL") == 0) {
-		if ((s = get_query_param(query_post, "mail")) != NULL)
-			hput_escaped(s);
+		if ((s = get_query_param(r->query_post, "mail")) != NULL)
+			hput_escaped(r, s);
 	} else if (strcmp(m, "FORM_WEB") == 0) {
-		if ((s = get_query_param(query_post, "web")) != NULL)
-			hput_escaped(s);
+		if ((s = get_query_param(r->query_post, "web")) != NULL)
+			hput_escaped(r, s);
 	} else if (strcmp(m, "FORM_TEXT") == 0) {
-		if ((s = get_query_param(query_post, "text")) != NULL)
-			hput_escaped(s);
+		if ((s = get_query_param(r->query_post, "text")) != NULL)
+			hput_escaped(r, s);
 	}
 }
 
 static void
-markers_article(const char *m, struct article *a)
+markers_article(struct render *r, const char *m, struct article *a)
 {
 	struct article_tag *at;
-	char buf[BUFSIZ];
+	char date[DATE_LEN];
+	FILE *more;
 	ulong nb_comments;
-	extern char *error_str;
 
 	if (strcmp(m, "ARTICLE_TITLE") == 0) {
-		hputs(a->title);
+		hputs(r, a->title);
 	} else if (strcmp(m, "ARTICLE_DATE") == 0) {
-		strftime(buf, sizeof(buf), TIME_FORMAT, &a->date);
-		hputs(buf);
+		hputs(r, format_date(DATE_ARTICLE, &a->date, 0, date));
 	} else if (strcmp(m, "ARTICLE_TAGS") == 0) {
-		SLIST_FOREACH(at, &a->tags, next) {
+		SLIST_FOREACH(at, article_tags(a), next) {
 			if (at->name == NULL)
 				continue;
-			hputs("<a href=\"");
-			hput_url("tag", at->name, 0, NB_ARTICLES);
-			hputs("\">");
-			hputs(at->name);
-			hputs("</a>");
+			hputs(r, "<a href=\"");
+			hput_url(r, "tag", at->name, 0, NB_ARTICLES);
+			hputs(r, "\">");
+			hputs(r, at->name);
+			hputs(r, "</a>");
 			if (SLIST_NEXT(at, next) != NULL)
-				hputs(" / ");
+				hputs(r, " / ");
 		}
 	} else if (strcmp(m, "ARTICLE_BODY") == 0) {
-		while (fgets(buf, sizeof(buf), a->body) != NULL)
-			hputs(buf);
-		if (a->more != NULL) {
-			if (a->display_more)
-				while (fgets(buf, sizeof(buf), a->more) != NULL)
-					hputs(buf);
-			else {
-				hputs("<b><a href=\"");
-				hput_url("article", a->name);
-				hputs("\">" NAVIGATION_READMORE "</a></b>");
-				if (a->more_size != 0) {
-					hputs(" (");
-					hputd(a->more_size);
-					hputc(' ');
-					hputs(NAVIGATION_BYTES);
-					hputc(')');
-				}
+		hput_file(r, a->body);
+		if (a->display_more) {
+			if ((more = article_more(a)) != NULL)
+				hput_file(r, more);
+		} else if (article_has_more(a)) {
+			hputs(r, "<b><a href=\"");
+			hput_url(r, "article", a->name);
+			hputs(r, "\">" NAVIGATION_READMORE "</a></b>");
+			if (a->more_size != 0) {
+				hputs(r, " (");
+				hputd(r, a->more_size);
+				hputc(r, ' ');
+				hputs(r, NAVIGATION_BYTES);
+				hputc(r, ')');
 			}
 		}
 	} else if (strcmp(m, "ARTICLE_URL") == 0) {
-		hput_url("article", a->name);
+		hput_url(r, "article", a->name);
 	} else if (strcmp(m, "ARTICLE_COMMENTS_INFO") == 0) {
 		if (are_comments_readable(a->name)
 		    || are_comments_writable(a->name)) {
-			nb_comments = read_comments(a->name, NULL);
-			hputs("<a href=\"");
-			hput_url("article", a->name);
-			hputs("#coms\">[");
+			nb_comments = read_comments(a->name, NULL, NULL);
+			hputs(r, "<a href=\"");
+			hput_url(r, "article", a->name);
+			hputs(r, "#coms\">[");
 			switch (nb_comments) {
 			case 0:
-				hputs(COMMENTS_NOCOMMENT);
+				hputs(r, COMMENTS_NOCOMMENT);
 				break;
 			case 1:
-				hputs(COMMENTS_1COMMENT);
+				hputs(r, COMMENTS_1COMMENT);
 				break;
 			default:
-				hputd(nb_comments);
-				hputc(' ');
-				hputs(COMMENTS_COMMENTS);
+				hputd(r, nb_comments);
+				hputc(r, ' ');
+				hputs(r, COMMENTS_COMMENTS);
 			}
-			hputs("]</a>");
+			hputs(r, "]</a>");
 		}
 	} else if (strcmp(m, "ARTICLE_COMMENTS") == 0) {
 		if (a->display_more) {
-			read_comments(a->name, render_comment);
+			read_comments(a->name, (comment_cb *)render_comment, r);
 			if (are_comments_writable(a->name)
-			    || error_str != NULL) {
+			    || r->error_str != NULL) {
 				a->antispam = antispam_generate(a->name);
-				parse_template("article_comment_form.html",
+				parse_template(r, "article_comment_form.html",
 				    (markers_cb *)markers_comment_form, a);
 				free(a->antispam);
 				a->antispam = NULL;
@@ -235,214 +365,351 @@ markers_article(const char *m, struct article *a)
 }
 
 static void
-markers_page_article(const char *m, struct article *a) 
+markers_page_article(struct render *r, const char *m, struct article *a)
 {
+	if (markers_page(r, m))
+		return;
 	if (strcmp(m, "PAGE_TITLE") == 0) {
-		hputs(" - ");
-		hputs(a->title);
+		hputs(r, " - ");
+		hputs(r, a->title);
 	} else if (strcmp(m, "PAGE_BODY") == 0) {
+		flush_head(r, "article");
 		a->display_more = 1;
-		parse_template("article.html", (markers_cb *)markers_article,
+		parse_template(r, "article.html", (markers_cb *)markers_article,
 		    a);
 	}
 }
 
 void
-render_page_article(struct article *a)
+render_page_article(struct article *a, struct render *r)
 {
-	open_output("text/html");
-	parse_template("page.html", (markers_cb *)markers_page_article, a);
-	close_output();
+	open_output(r, "text/html");
+	parse_template(r, "page.html", (markers_cb *)markers_page_article, a);
+	close_output(r);
 }
 
 static void
-render_tag_article(struct article *a)
+render_tag_article(struct article *a, struct render *r)
 {
 	a->display_more = 0;
-	parse_template("article.html", (markers_cb *)markers_article, a);
+	parse_template(r, "article.html", (markers_cb *)markers_article, a);
 }
 
 static void
-markers_page_tag(const char *m, struct tag *t)
+markers_page_tag(struct render *r, const char *m, struct tag *t)
 {
+	if (markers_page(r, m))
+		return;
 	if (strcmp(m, "PAGE_TITLE") == 0) {
 		if (t->name != NULL) {
-			hputs(" - tag:");
-			hputs(t->name);
+			hputs(r, " - tag:");
+			hputs(r, t->name);
 		}
 	} else if (strcmp(m, "HEADERS") == 0) {
 		/* link to the RSS feed of the tag */
-		hputs("\t<link rel=\"alternate\" type=\"application/rss+xml\" "
-		    "title=\"" SITE_NAME " - RSS");
+		hputs(r, "\t<link rel=\"alternate\" "
+		    "type=\"application/rss+xml\" title=\"" SITE_NAME " - RSS");
 		if (t->name != NULL) {
-			hputs(" - tag:");
-			hputs(t->name);
+			hputs(r, " - tag:");
+			hputs(r, t->name);
 		}
-		hputs("\" href=\"");
-		hput_url("rss", t->name);
-		hputs("\">\n");
+		hputs(r, "\" href=\"");
+		hput_url(r, "rss", t->name);
+		hputs(r, "\">\n");
 		/* no cache */
-		hputs("\t<meta http-equiv=\"cache-control\" content=\"no-cache\">");
+		hputs(r, "\t<meta http-equiv=\"cache-control\" "
+		    "content=\"no-cache\">");
 	} else if (strcmp(m, "NAVIGATION_NEXT") == 0) {
 		if (t->next) {
-			hputs("<a href=\"");
-			hput_url("tag", t->name, t->page+1, t->number);
-			hputs("\">" NAVIGATION_NEXT "</a>");
+			hputs(r, "<a href=\"");
+			if (r->status & STATUS_STATIC
+			    && !is_tag_combination(t->name))
+				hput_url(r, "tag", t->name, t->page+1,
+				    t->number);
+			else
+				hput_url(r, "tag_after", t->name, t->list.names[
+				    t->offset-t->first+t->number-1], t->number);
+			hputs(r, "\">" NAVIGATION_NEXT "</a>");
 		}
 	} else if (strcmp(m, "NAVIGATION_PREVIOUS") == 0) {
 		if (t->previous) {
-			hputs("<a href=\"");
-			hput_url("tag", t->name, t->page-1, t->number);
-			hputs("\">" NAVIGATION_PREVIOUS "</a>");
+			hputs(r, "<a href=\"");
+			if (t->offset <= t->number)
+				hput_url(r, "tag", t->name, 0, t->number);
+			else if (r->status & STATUS_STATIC
+			    && !is_tag_combination(t->name))
+				hput_url(r, "tag", t->name, t->page-1,
+				    t->number);
+			else
+				hput_url(r, "tag_before", t->name,
+				    t->list.names[t->offset-t->first],
+				    t->number);
+			hputs(r, "\">" NAVIGATION_PREVIOUS "</a>");
 		}
 	} else if (strcmp(m, "NAVIGATION_PAGE") == 0) {
-		hputd(t->page+1);
+		hputd(r, t->page+1);
 	} else if (strcmp(m, "NAVIGATION_PAGES") == 0) {
-		hputd(t->pages);
+		hputd(r, t->pages);
 	} else if (strcmp(m, "PAGE_BODY") == 0) {
-		read_articles(t->name, t->offset, t->number,
-		    render_tag_article);
+		flush_head(r, t->name != NULL ? "tag" : "index");
+		read_page_articles(t, (article_cb *)render_tag_article, r);
 	}
 }
 
 void
-render_page_tag(struct tag *t)
+render_page_tag(struct tag *t, struct render *r)
 {
-	open_output("text/html");
-	parse_template("page.html", (markers_cb *)markers_page_tag, t);
-	close_output();
+	open_output(r, "text/html");
+	parse_template(r, "page.html", (markers_cb *)markers_page_tag, t);
+	close_output(r);
 }
 
+/*
+ * Link to the closest period (of the same length) which has articles,
+ * older or newer than the given one.
+ */
 static void
-markers_page_tags2(const char *m)
+hput_archive_link(struct render *r, const char *period, int older,
+    const char *label)
 {
-	SLIST_HEAD(, article_tag) list;
-	struct article_tag *at;
-	unsigned long nb_articles_total, nb_articles;
+	struct archive *archives;
+	unsigned long nb_archives, i;
+	char p[ARCHIVE_LEN];
+	size_t len;
+	int cmp, found;
 
+	len = strlen(period);
+	archives = get_archives(&nb_archives);
+	for (i = 0, found = -1; i < nb_archives; ++i) {
+		cmp = strncmp(archives[i].period, period, len);
+		if (cmp > 0 && !older)
+			found = i;
+		else if (cmp < 0) {
+			if (older)
+				found = i;
+			break;
+		}
+	}
+	if (found != -1)
+		strlcpy(p, archives[found].period, len+1);
+	free(archives);
+	if (found == -1)
+		return;
+	hputs(r, "<a href=\"");
+	hput_url(r, "archive", p, 0);
+	hputs(r, "\">");
+	hputs(r, label);
+	hputs(r, "</a>");
+}
+
+static void
+markers_page_archive(struct render *r, const char *m, struct tag *t)
+{
+	if (markers_page(r, m))
+		return;
+	if (strcmp(m, "PAGE_TITLE") == 0) {
+		hputs(r, " - archive:");
+		hputs(r, t->name);
+	} else if (strcmp(m, "NAVIGATION_NEXT") == 0) {
+		/* the next page of the period, or the older period */
+		if (t->next) {
+			hputs(r, "<a href=\"");
+			hput_url(r, "archive", t->name, t->page+1);
+			hputs(r, "\">" NAVIGATION_NEXT "</a>");
+		} else
+			hput_archive_link(r, t->name, 1, NAVIGATION_NEXT);
+	} else if (strcmp(m, "NAVIGATION_PREVIOUS") == 0) {
+		if (t->previous) {
+			hputs(r, "<a href=\"");
+			hput_url(r, "archive", t->name, t->page-1);
+			hputs(r, "\">" NAVIGATION_PREVIOUS "</a>");
+		} else
+			hput_archive_link(r, t->name, 0, NAVIGATION_PREVIOUS);
+	} else if (strcmp(m, "NAVIGATION_PAGE") == 0)
+		hputd(r, t->page+1);
+	else if (strcmp(m, "NAVIGATION_PAGES") == 0)
+		hputd(r, t->pages);
+	else if (strcmp(m, "PAGE_BODY") == 0) {
+		flush_head(r, "archive");
+		read_page_articles(t, (article_cb *)render_tag_article, r);
+	}
+}
+
+void
+render_page_archive(struct tag *t, struct render *r)
+{
+	open_output(r, "text/html");
+	parse_template(r, "page.html", (markers_cb *)markers_page_archive, t);
+	close_output(r);
+}
+
+static void
+markers_page_search(struct render *r, const char *m, struct tag *t)
+{
+	if (markers_page(r, m))
+		return;
+	if (strcmp(m, "PAGE_TITLE") == 0) {
+		hputs(r, " - search:");
+		hput_escaped(r, t->name);
+	} else if (strcmp(m, "HEADERS") == 0) {
+		hputs(r, "\t<meta name=\"robots\" content=\"noindex\">");
+	} else if (strcmp(m, "NAVIGATION_NEXT") == 0) {
+		if (t->next) {
+			hputs(r, "<a href=\"");
+			hput_url(r, "search", t->name, t->page+1, t->number);
+			hputs(r, "\">" NAVIGATION_NEXT "</a>");
+		}
+	} else if (strcmp(m, "NAVIGATION_PREVIOUS") == 0) {
+		if (t->previous) {
+			hputs(r, "<a href=\"");
+			hput_url(r, "search", t->name, t->page-1, t->number);
+			hputs(r, "\">" NAVIGATION_PREVIOUS "</a>");
+		}
+	} else if (strcmp(m, "NAVIGATION_PAGE") == 0) {
+		hputd(r, t->page+1);
+	} else if (strcmp(m, "NAVIGATION_PAGES") == 0) {
+		hputd(r, t->pages);
+	} else if (strcmp(m, "PAGE_BODY") == 0) {
+		flush_head(r, "search");
+		if (t->list.nb == 0)
+			hputs(r, "<hr>\n<div class=\"article\">" SEARCH_NORESULT
+			    "</div>\n");
+		else
+			read_page_articles(t,
+			    (article_cb *)render_tag_article, r);
+	}
+}
+
+void
+render_page_search(struct tag *t, struct render *r)
+{
+	open_output(r, "text/html");
+	parse_template(r, "page.html", (markers_cb *)markers_page_search, t);
+	close_output(r);
+}
+
+static void
+markers_page_tags2(struct render *r, const char *m)
+{
+	struct tag_count *counts;
+	unsigned long nb_counts, i;
 
 	if (strcmp(m, "TAGS") != 0)
 		return;
-	nb_articles_total = read_articles(NULL, 0, 0, NULL);
-	SLIST_FIRST(&list) = get_article_tags(NULL);
-	SLIST_FOREACH(at, &list, next) {
-		if (at->name == NULL)
-			return;
-		nb_articles = read_articles(at->name, 0, 0, NULL);
-		if (nb_articles == 0)
+	counts = get_tag_counts(&nb_counts);
+	/* the first count is the one of the index */
+	for (i = 1; i < nb_counts; ++i) {
+		if (counts[i].number == 0)
 			continue;
-		hputs("<span style=\"font-size: ");
-		hputd(nb_articles * (100/nb_articles_total)+100);
-		hputs("%\"><a href=\"");
-		hput_url("tag", at->name, 0, NB_ARTICLES);
-		hputs("\">");
-		hputs(at->name);
-		hputs("</a></span> ");
-	}
-	while (!SLIST_EMPTY(&list)) {
-		at = SLIST_FIRST(&list);
-		SLIST_REMOVE_HEAD(&list, next);
-		free(at->name);
-		free(at);
+		hputs(r, "<span style=\"font-size: ");
+		hputd(r, counts[i].number * (100/counts[0].number)+100);
+		hputs(r, "%\"><a href=\"");
+		hput_url(r, "tag", counts[i].name, 0, NB_ARTICLES);
+		hputs(r, "\">");
+		hputs(r, counts[i].name);
+		hputs(r, "</a></span> ");
 	}
+	free(counts);
 }
 
 static void
-markers_page_tags(const char *m)
+markers_page_tags(struct render *r, const char *m)
 {
+	if (markers_page(r, m))
+		return;
 	if (strcmp(m, "PAGE_TITLE") == 0)
-		hputs(" - tags");
-	else if (strcmp(m, "PAGE_BODY") == 0)
-		parse_template("tags.html", (markers_cb *)markers_page_tags2,
+		hputs(r, " - tags");
+	else if (strcmp(m, "PAGE_BODY") == 0) {
+		flush_head(r, "tags");
+		parse_template(r, "tags.html", (markers_cb *)markers_page_tags2,
 		    NULL);
+	}
 }
 
 void
-render_page_tags(void)
+render_page_tags(struct render *r)
 {
-	open_output("text/html");
-	parse_template("page.html", (markers_cb *)markers_page_tags, NULL);
-	close_output();
+	open_output(r, "text/html");
+	parse_template(r, "page.html", (markers_cb *)markers_page_tags, NULL);
+	close_output(r);
 }
 
 static void
-render_rss_article(struct article *a)
+render_rss_article(struct article *a, struct render *r)
 {
-	char buf[BUFSIZ];
 	struct article_tag *at;
+	char date[DATE_LEN];
 
-	hputs("    <item>\n"
+	hputs(r, "    <item>\n"
 	    "      <title>");
-	hputs(a->title);
-	hputs("</title>\n"
+	hputs(r, a->title);
+	hputs(r, "</title>\n"
 	    "      <link>");
-	hput_url("article", a->name);
-	hputs("</link>\n");
-	SLIST_FOREACH(at, &a->tags, next) {
+	hput_url(r, "article", a->name);
+	hputs(r, "</link>\n");
+	SLIST_FOREACH(at, article_tags(a), next) {
 		if (at->name == NULL)
 			continue;
-		hputs("      <category>");
-		hputs(at->name);
-		hputs("</category>\n");
+		hputs(r, "      <category>");
+		hputs(r, at->name);
+		hputs(r, "</category>\n");
 	}
-	hputs("      <description><![CDATA[");
-	while (fgets(buf, sizeof(buf), a->body) != NULL)
-		hputs(buf);
-	if (a->more != NULL) {
-		hputs("<b><a href=\"");
-		hput_url("article", a->name);
-		hputs("\">" NAVIGATION_READMORE "</a></b>");
+	hputs(r, "      <description><![CDATA[");
+	hput_file(r, a->body);
+	if (article_has_more(a)) {
+		hputs(r, "<b><a href=\"");
+		hput_url(r, "article", a->name);
+		hputs(r, "\">" NAVIGATION_READMORE "</a></b>");
 	}
-	hputs("]]></description>\n"
+	hputs(r, "]]></description>\n"
 	    "      <pubDate>");
-	strftime(buf, sizeof(buf), "%a, %d %b %Y %R %z", &a->date);
-	hputs(buf);
-	hputs("</pubDate>\n"
+	hputs(r, format_date(DATE_ARTICLE_RFC822, &a->date, 0, date));
+	hputs(r, "</pubDate>\n"
 	    "      <guid isPermaLink=\"false\">");
-	hputs(a->name);
-	hputs("</guid>\n"
+	hputs(r, a->name);
+	hputs(r, "</guid>\n"
 	    "    </item>\n");
 }
 
 void
-render_rss(struct tag *t)
+render_rss(struct tag *t, struct render *r)
 {
 	char date[32];
+	struct tm tm;
 	time_t now;
-	extern enum STATUS status;
 
-	open_output("application/rss+xml");
-	hputs(
+	open_output(r, "application/rss+xml");
+	hputs(r, 
 	    "<?xml version=\"1.0\"?>\n"
 	    "<rss version=\"2.0\" xmlns:atom=\"http://www.w3.org/2005/Atom\">\n"
 	    "  <channel>\n"
 	    "    <atom:link href=\"");
-	if (status & STATUS_STATIC)
-		hput_url("rss", t->name);
+	if (r->status & STATUS_STATIC)
+		hput_url(r, "rss", t->name);
 	else
-		hput_url("rss", NULL); /* XXX problem with '&' */
-	hputs("\" rel=\"self\" type=\"application/rss+xml\" />\n"
+		hput_url(r, "rss", NULL); /* XXX problem with '&' */
+	hputs(r, "\" rel=\"self\" type=\"application/rss+xml\" />\n"
 	    "    <title>");
-	hputs(SITE_NAME);
+	hputs(r, SITE_NAME);
 	if (t->name != NULL) {
-		hputs(" - tag:");
-		hputs(t->name);
+		hputs(r, " - tag:");
+		hputs(r, t->name);
 	}
-	hputs("</title>\n"
+	hputs(r, "</title>\n"
 	    "    <link>");
-	hputs(BASE_URL);
-	hputs("</link>\n"
+	hputs(r, BASE_URL);
+	hputs(r, "</link>\n"
 	    "    <description>");
-	hputs(DESCRIPTION);
-	hputs("</description>\n"
+	hputs(r, DESCRIPTION);
+	hputs(r, "</description>\n"
 	    "    <pubDate>");
 	time(&now);
-	strftime(date, sizeof(date), "%a, %d %b %Y %R %z", localtime(&now));
-	hputs(date);
-	hputs("</pubDate>\n");
-	read_articles(t->name, t->offset, t->number, render_rss_article);
-	hputs(
+	rfc822_format(localtime_r(&now, &tm), date, sizeof(date));
+	hputs(r, date);
+	hputs(r, "</pubDate>\n");
+	read_page_articles(t, (article_cb *)render_rss_article, r);
+	hputs(r, 
 	    "  </channel>\n"
 	    "</rss>\n");
-	close_output();
+	close_output(r);
 }
@@ -0,0 +1,618 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2009 Colin Didier <cdidier@cybione.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Full-text search. "blog -s index" writes an inverted index of the
+ * articles in SEARCH_INDEX, which is mmap()ed to answer the queries.
+ *
+ * Index format (the integers are 32 bits, big endian):
+ *	header:		"CLOGIDX1", number of articles, number of words,
+ *			offsets of the articles, words, postings and strings
+ *			sections, size of the file
+ *	articles:	offset of the name in the strings section
+ *	words:		sorted, offset of the word in the strings section,
+ *			offset of its posting list, number of articles
+ *	postings:	per word, the ids of the articles (delta encoded)
+ *			and the number of occurrences, as varints
+ *	strings:	NUL terminated strings
+ * The ids of the articles are their positions in the list of the
+ * articles, so the newest articles have the lowest ids.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "articles.h"
+#include "search.h"
+#include "cache.h"
+#include "timing.h"
+
+#define INDEX_MAGIC	"CLOGIDX1"
+#define HEADER_SIZE	(sizeof(INDEX_MAGIC)-1 + 7*4)
+
+struct tokenizer {
+	char	 word[SEARCH_WORD_LEN+1];
+	size_t	 len;
+	char	 in_tag, in_entity;
+};
+
+struct word {
+	char		*word;
+	unsigned long	 df, last_id, id, tf;
+	unsigned char	*postings;
+	size_t		 len, size;
+};
+
+struct words {
+	struct word	*table;
+	unsigned long	 nb, size;
+};
+
+/*
+ * Feed one character to the tokenizer, return 1 if a word is complete.
+ * The HTML tags and entities are skipped, the words are lowercased and
+ * the non-ASCII characters are kept as is (UTF-8).
+ */
+static int
+tokenize(struct tokenizer *t, int c)
+{
+	if (t->in_tag) {
+		if (c == '>')
+			t->in_tag = 0;
+		return 0;
+	}
+	if (t->in_entity) {
+		if (c == ';' || c == ' ' || c == '\n' || c == EOF)
+			t->in_entity = 0;
+		return 0;
+	}
+	if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80) {
+		if (t->len < SEARCH_WORD_LEN)
+			t->word[t->len++] = c;
+		return 0;
+	}
+	if (c >= 'A' && c <= 'Z') {
+		if (t->len < SEARCH_WORD_LEN)
+			t->word[t->len++] = c - 'A' + 'a';
+		return 0;
+	}
+	if (c == '<')
+		t->in_tag = 1;
+	else if (c == '&')
+		t->in_entity = 1;
+	/* ignore the one letter words */
+	if (t->len < 2) {
+		t->len = 0;
+		return 0;
+	}
+	t->word[t->len] = '\0';
+	t->len = 0;
+	return 1;
+}
+
+static void
+put_varint(struct word *w, unsigned long v)
+{
+	unsigned char *p;
+
+	if (w->len + 10 > w->size) {
+		w->size = w->size == 0 ? 16 : w->size * 2;
+		if ((p = realloc(w->postings, w->size)) == NULL)
+			err(1, "realloc");
+		w->postings = p;
+	}
+	while (v >= 0x80) {
+		w->postings[w->len++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	w->postings[w->len++] = v;
+}
+
+static unsigned long
+get_varint(const unsigned char **p, const unsigned char *end)
+{
+	unsigned long v;
+	int shift;
+
+	for (v = 0, shift = 0; *p < end && shift < 35; shift += 7) {
+		v |= (unsigned long)(**p & 0x7f) << shift;
+		if (!(*(*p)++ & 0x80))
+			break;
+	}
+	return v;
+}
+
+static void
+put_uint32(unsigned char *p, unsigned long v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static unsigned long
+get_uint32(const unsigned char *p)
+{
+	return (unsigned long)p[0] << 24 | (unsigned long)p[1] << 16
+	    | (unsigned long)p[2] << 8 | p[3];
+}
+
+/* write the pending occurrences of the previous article */
+static void
+flush_word(struct word *w)
+{
+	if (w->tf == 0)
+		return;
+	put_varint(w, w->df == 0 ? w->id : w->id - w->last_id);
+	put_varint(w, w->tf);
+	w->last_id = w->id;
+	w->tf = 0;
+	++w->df;
+}
+
+static unsigned long
+hash_word(const char *s)
+{
+	unsigned long h;
+
+	for (h = 2166136261UL; *s != '\0'; ++s)
+		h = (h ^ (unsigned char)*s) * 16777619UL;
+	return h;
+}
+
+static struct word *
+get_word(struct words *ws, const char *s)
+{
+	struct word *old, *w;
+	unsigned long i, old_size;
+
+	if (ws->nb * 2 >= ws->size) {
+		old = ws->table;
+		old_size = ws->size;
+		ws->size = ws->size == 0 ? 1024 : ws->size * 2;
+		if ((ws->table = calloc(ws->size, sizeof(struct word))) == NULL)
+			err(1, "calloc");
+		for (i = 0; i < old_size; ++i) {
+			if (old[i].word == NULL)
+				continue;
+			for (w = &ws->table[hash_word(old[i].word)
+			    & (ws->size-1)]; w->word != NULL;)
+				w = w == &ws->table[ws->size-1] ?
+				    ws->table : w+1;
+			*w = old[i];
+		}
+		free(old);
+	}
+	for (w = &ws->table[hash_word(s) & (ws->size-1)]; w->word != NULL;) {
+		if (strcmp(w->word, s) == 0)
+			return w;
+		w = w == &ws->table[ws->size-1] ? ws->table : w+1;
+	}
+	if ((w->word = strdup(s)) == NULL)
+		err(1, "strdup");
+	++ws->nb;
+	return w;
+}
+
+static void
+index_file(struct words *ws, unsigned long id, const char *article,
+    const char *file)
+{
+	char path[MAXPATHLEN];
+	struct tokenizer t;
+	struct word *w;
+	FILE *f;
+	int c;
+
+	article_path(path, article, file);
+	if ((f = fopen(path, "r")) == NULL) {
+		if (errno != ENOENT)
+			warn("fopen: %s", path);
+		return;
+	}
+	memset(&t, 0, sizeof(t));
+	do {
+		c = getc(f);
+		if (!tokenize(&t, c))
+			continue;
+		w = get_word(ws, t.word);
+		if (w->tf != 0 && w->id != id)
+			flush_word(w);
+		w->id = id;
+		++w->tf;
+	} while (c != EOF);
+	fclose(f);
+}
+
+static int
+compar_words(const void *w1, const void *w2)
+{
+	return strcmp(((const struct word *)w1)->word,
+	    ((const struct word *)w2)->word);
+}
+
+int
+build_search_index(void)
+{
+	char path[MAXPATHLEN], tmp[MAXPATHLEN+sizeof(".tmp")];
+	struct article_list list;
+	struct words ws;
+	struct word *w;
+	unsigned char header[HEADER_SIZE], buf[12];
+	unsigned long i, nb, strings, postings, off;
+	FILE *f;
+	extern enum STATUS status;
+
+	if (list_articles(NULL, &list) == -1)
+		return -1;
+	memset(&ws, 0, sizeof(ws));
+	for (i = 0; i < list.nb; ++i) {
+		index_file(&ws, i, list.names[i], "article");
+		index_file(&ws, i, list.names[i], "more");
+	}
+	/* compact and sort the words */
+	for (i = 0, nb = 0; i < ws.size; ++i)
+		if (ws.table[i].word != NULL) {
+			flush_word(&ws.table[i]);
+			ws.table[nb++] = ws.table[i];
+		}
+	if (nb != 0)
+		memset(ws.table + nb, 0, (ws.size - nb) * sizeof(struct word));
+	if (nb != 0)
+		qsort(ws.table, nb, sizeof(struct word), compar_words);
+	snprintf(path, MAXPATHLEN, "%s" SEARCH_INDEX,
+	    status & STATUS_FROMCMD ? CHROOT_DIR : "");
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (status & STATUS_FROMCMD)
+		fprintf(stderr, "Writing %s...\n", path);
+	if ((f = fopen(tmp, "w")) == NULL) {
+		warn("fopen: %s", tmp);
+		goto err;
+	}
+	/* header */
+	memcpy(header, INDEX_MAGIC, sizeof(INDEX_MAGIC)-1);
+	off = sizeof(INDEX_MAGIC)-1;
+	put_uint32(header+off, list.nb);
+	put_uint32(header+off+4, nb);
+	put_uint32(header+off+8, HEADER_SIZE);
+	put_uint32(header+off+12, HEADER_SIZE + list.nb*4);
+	postings = HEADER_SIZE + list.nb*4 + nb*12;
+	put_uint32(header+off+16, postings);
+	for (i = 0, strings = postings; i < nb; ++i)
+		strings += ws.table[i].len;
+	put_uint32(header+off+20, strings);
+	off = 0;
+	for (i = 0; i < list.nb; ++i)
+		off += strlen(list.names[i]) + 1;
+	for (i = 0; i < nb; ++i)
+		off += strlen(ws.table[i].word) + 1;
+	put_uint32(header+sizeof(INDEX_MAGIC)-1+24, strings + off);
+	fwrite(header, sizeof(header), 1, f);
+	/* articles */
+	for (i = 0, off = 0; i < list.nb; ++i) {
+		put_uint32(buf, off);
+		fwrite(buf, 4, 1, f);
+		off += strlen(list.names[i]) + 1;
+	}
+	/* words */
+	for (i = 0, postings = 0; i < nb; ++i) {
+		w = &ws.table[i];
+		put_uint32(buf, off);
+		put_uint32(buf+4, postings);
+		put_uint32(buf+8, w->df);
+		fwrite(buf, 12, 1, f);
+		off += strlen(w->word) + 1;
+		postings += w->len;
+	}
+	/* postings */
+	for (i = 0; i < nb; ++i)
+		fwrite(ws.table[i].postings, 1, ws.table[i].len, f);
+	/* strings */
+	for (i = 0; i < list.nb; ++i)
+		fwrite(list.names[i], strlen(list.names[i]) + 1, 1, f);
+	for (i = 0; i < nb; ++i)
+		fwrite(ws.table[i].word, strlen(ws.table[i].word) + 1, 1, f);
+	if (ferror(f) | (fclose(f) == EOF)) {
+		warn("fwrite: %s", tmp);
+		unlink(tmp);
+		goto err;
+	}
+	if (rename(tmp, path) == -1) {
+		warn("rename: %s", path);
+		unlink(tmp);
+		goto err;
+	}
+	for (i = 0; i < nb; ++i) {
+		free(ws.table[i].word);
+		free(ws.table[i].postings);
+	}
+	free(ws.table);
+	free_article_list(&list);
+	return 0;
+
+err:	for (i = 0; i < ws.size; ++i) {
+		free(ws.table[i].word);
+		free(ws.table[i].postings);
+	}
+	free(ws.table);
+	free_article_list(&list);
+	return -1;
+}
+
+struct index {
+	const unsigned char	*base;
+	size_t			 size;
+	unsigned long		 nb_articles, nb_words;
+	const unsigned char	*articles, *words, *postings;
+	const char		*strings;
+	size_t			 strings_len;
+};
+
+struct result {
+	unsigned long	 id;
+	double		 score;
+};
+
+static int
+open_index(struct index *idx)
+{
+	char path[MAXPATHLEN];
+	struct stat sb;
+	unsigned long off[5];
+	void *p;
+	int fd, i;
+	extern enum STATUS status;
+
+	snprintf(path, MAXPATHLEN, "%s" SEARCH_INDEX,
+	    status & STATUS_FROMCMD ? CHROOT_DIR : "");
+	CACHE_DEPEND(path);
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		warn("open: %s", path);
+		return -1;
+	}
+	if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)HEADER_SIZE) {
+		warnx("%s: invalid index", path);
+		close(fd);
+		return -1;
+	}
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		warn("mmap: %s", path);
+		return -1;
+	}
+	idx->base = p;
+	idx->size = sb.st_size;
+	if (memcmp(idx->base, INDEX_MAGIC, sizeof(INDEX_MAGIC)-1) != 0)
+		goto invalid;
+	idx->nb_articles = get_uint32(idx->base + sizeof(INDEX_MAGIC)-1);
+	idx->nb_words = get_uint32(idx->base + sizeof(INDEX_MAGIC)-1 + 4);
+	for (i = 0; i < 5; ++i) {
+		off[i] = get_uint32(idx->base + sizeof(INDEX_MAGIC)-1 + 8 + i*4);
+		if (off[i] > idx->size || (i > 0 && off[i] < off[i-1]))
+			goto invalid;
+	}
+	if (off[4] != idx->size || off[0] + idx->nb_articles*4 > off[1]
+	    || off[1] + idx->nb_words*12 > off[2]
+	    || (off[4] > off[3] && idx->base[off[4]-1] != '\0'))
+		goto invalid;
+	idx->articles = idx->base + off[0];
+	idx->words = idx->base + off[1];
+	idx->postings = idx->base + off[2];
+	idx->strings = (const char *)idx->base + off[3];
+	idx->strings_len = off[4] - off[3];
+	return 0;
+
+invalid:
+	warnx("%s: invalid index", path);
+	munmap((void *)idx->base, idx->size);
+	return -1;
+}
+
+/* binary search of a word, return its entry in the words section */
+static const unsigned char *
+find_word(struct index *idx, const char *word)
+{
+	unsigned long lo, hi, mid;
+	const unsigned char *w;
+	int cmp;
+
+	lo = 0;
+	hi = idx->nb_words;
+	while (lo < hi) {
+		mid = lo + (hi - lo)/2;
+		w = idx->words + mid*12;
+		if (get_uint32(w) >= idx->strings_len)
+			return NULL;
+		if ((cmp = strcmp(idx->strings + get_uint32(w), word)) == 0)
+			return w;
+		else if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+static int
+compar_results(const void *r1, const void *r2)
+{
+	const struct result *a = r1, *b = r2;
+
+	if (a->score != b->score)
+		return a->score < b->score ? 1 : -1;
+	/* newest first */
+	return a->id < b->id ? -1 : a->id > b->id;
+}
+
+static int
+compar_df(const void *w1, const void *w2)
+{
+	unsigned long df1, df2;
+
+	df1 = get_uint32(*(const unsigned char * const *)w1 + 8);
+	df2 = get_uint32(*(const unsigned char * const *)w2 + 8);
+	return df1 < df2 ? -1 : df1 > df2;
+}
+
+/*
+ * Return the articles which contain all the words of the query, ranked by
+ * tf-idf. The rarest word is decoded first and the other posting lists
+ * only filter its results.
+ */
+static unsigned long
+query_index(struct index *idx, const char *query, struct result **results,
+    char *normalized, size_t len)
+{
+	const unsigned char *words[SEARCH_MAX_WORDS], *p, *end;
+	struct tokenizer t;
+	size_t n;
+	unsigned long nb_words, nb, i, j, k, id, tf, df;
+	double idf;
+	const char *s;
+
+	*results = NULL;
+	*normalized = '\0';
+	memset(&t, 0, sizeof(t));
+	nb_words = 0;
+	n = 0;
+	for (s = query; ; ++s) {
+		if (tokenize(&t, *s != '\0' ? (unsigned char)*s : EOF)) {
+			if (nb_words == SEARCH_MAX_WORDS)
+				break;
+			/* the words of the query, for the links */
+			if (n != 0 && n < len - 1)
+				normalized[n++] = ' ';
+			n += strlcpy(normalized + n, t.word, len - n);
+			if (n >= len)
+				n = len - 1;
+			if ((words[nb_words++] = find_word(idx, t.word))
+			    == NULL)
+				return 0;
+		}
+		if (*s == '\0')
+			break;
+	}
+	if (nb_words == 0)
+		return 0;
+	qsort(words, nb_words, sizeof(words[0]), compar_df);
+	for (i = 0, nb = 0; i < nb_words; ++i) {
+		df = get_uint32(words[i] + 8);
+		idf = log(1.0 + (double)idx->nb_articles / df);
+		p = idx->postings + get_uint32(words[i] + 4);
+		end = (const unsigned char *)idx->strings;
+		if (i == 0 && (*results = calloc(df, sizeof(struct result)))
+		    == NULL) {
+			warn("calloc");
+			return 0;
+		}
+		for (j = 0, k = 0, id = 0; j < df; ++j) {
+			id = j == 0 ? get_varint(&p, end)
+			    : id + get_varint(&p, end);
+			tf = get_varint(&p, end);
+			if (i == 0) {
+				(*results)[nb].id = id;
+				(*results)[nb++].score = (1.0 + log(tf)) * idf;
+				continue;
+			}
+			/* both lists are sorted by id */
+			while (k < nb && (*results)[k].id < id)
+				(*results)[k++].score = -1;
+			if (k < nb && (*results)[k].id == id)
+				(*results)[k++].score += (1.0 + log(tf)) * idf;
+		}
+		if (i == 0)
+			continue;
+		while (k < nb)
+			(*results)[k++].score = -1;
+		/* remove the articles without the word */
+		for (j = 0, k = 0; j < nb; ++j)
+			if ((*results)[j].score >= 0)
+				(*results)[k++] = (*results)[j];
+		nb = k;
+	}
+	qsort(*results, nb, sizeof(struct result), compar_results);
+	return nb;
+}
+
+int
+search_articles(const char *query, unsigned long page, unsigned long number,
+    tag_cb *callback, void *data)
+{
+	char normalized[SEARCH_MAX_WORDS*(SEARCH_WORD_LEN+1)];
+	struct index idx;
+	struct result *results;
+	struct tag t;
+	unsigned long i, nb;
+	int ret;
+
+	TIMING_BEGIN(STAGE_SEARCH);
+	TIMING_COUNT(COUNTER_OPENS, 1);
+	if (open_index(&idx) == -1) {
+		TIMING_END(STAGE_SEARCH);
+		return -1;
+	}
+	ret = -1;
+	nb = query_index(&idx, query, &results, normalized,
+	    sizeof(normalized));
+	TIMING_END(STAGE_SEARCH);
+	if (page && number > ULONG_MAX / page)
+		goto out;
+	t.offset = page * number;
+	t.first = 0;
+	if (t.offset >= nb && page != 0)
+		goto out;
+	/* the names are in the mapped index */
+	t.list.nb = 0;
+	if (nb != 0 && (t.list.names = calloc(nb, sizeof(char *))) == NULL) {
+		warn("calloc");
+		goto out;
+	}
+	for (i = 0; i < nb; ++i)
+		if (results[i].id < idx.nb_articles
+		    && get_uint32(idx.articles + results[i].id*4)
+		    < idx.strings_len)
+			t.list.names[t.list.nb++] = (char *)idx.strings
+			    + get_uint32(idx.articles + results[i].id*4);
+	t.name = normalized;
+	t.page = page;
+	t.number = number;
+	t.pages = nb/number + (nb%number != 0 ? 1 : 0);
+	t.next = (t.offset + number < nb);
+	t.previous = (page > 0);
+	if (callback != NULL)
+		callback(&t, data);
+	if (nb != 0)
+		free(t.list.names);
+	ret = 0;
+out:	free(results);
+	munmap((void *)idx.base, idx.size);
+	return ret;
+}
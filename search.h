@@ -0,0 +1,17 @@
+/* $Id$ */
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include "articles.h"
+
+/* maximum length of a word, the longer ones are truncated */
+#define SEARCH_WORD_LEN		32
+/* maximum number of words in a query */
+#define SEARCH_MAX_WORDS	8
+
+int	build_search_index(void);
+int	search_articles(const char *, unsigned long, unsigned long,
+	    tag_cb, void *);
+
+#endif
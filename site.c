@@ -0,0 +1,307 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2009 Colin Didier <cdidier@cybione.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Model of the whole site for the static builds: ARTICLES_DIR, each
+ * directory of TAGS_DIR and the comments are read once, then the lists of
+ * the pages, the tags of the articles and the numbers of comments are
+ * answered from memory until site_free().
+ *
+ *	articles	all the names, newest first
+ *	tags		the names of the tags, sorted, with their lists
+ *	postings	the tags of each article, article i has those from
+ *			first[i] to first[i+1]
+ *	comments	the number of comments of each article
+ */
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include "common.h"
+#include "articles.h"
+#include "comments.h"
+#include "site.h"
+
+struct site_tag {
+	char			*name;
+	struct article_list	 list;
+};
+
+struct posting {
+	unsigned long	 tag;
+	unsigned long	 number;	/* position in the list of the tag */
+};
+
+struct site_comments {
+	unsigned long	 nb;
+	char		 readable, writable;
+};
+
+static int loaded = 0;
+static struct article_list articles;
+static struct site_tag *tags = NULL;
+static unsigned long nb_tags = 0;
+static unsigned long *first = NULL;
+static struct posting *postings = NULL;
+static struct site_comments *comments = NULL;
+
+/* position of an article in the index, -1 if it is not there */
+static long
+find_article(const char *article)
+{
+	unsigned long i;
+
+	i = article_list_search(&articles, article);
+	if (i == 0 || strcmp(articles.names[i-1], article) != 0)
+		return -1;
+	return i-1;
+}
+
+static long
+find_tag(const char *tag)
+{
+	unsigned long lo, hi, mid;
+	int cmp;
+
+	lo = 0;
+	hi = nb_tags;
+	while (lo < hi) {
+		mid = lo + (hi - lo)/2;
+		if ((cmp = strcmp(tags[mid].name, tag)) == 0)
+			return mid;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -1;
+}
+
+static int
+load_tags(void)
+{
+	struct article_tag *list, *at;
+	unsigned long i;
+
+	list = get_article_tags(NULL);
+	for (nb_tags = 0, at = list; at != NULL; at = SLIST_NEXT(at, next))
+		++nb_tags;
+	if (nb_tags != 0 && (tags = calloc(nb_tags,
+	    sizeof(struct site_tag))) == NULL)
+		warn("calloc");
+	/* get_article_tags() sorts them */
+	for (i = 0; list != NULL; list = at) {
+		at = SLIST_NEXT(list, next);
+		if (tags != NULL
+		    && list_articles(list->name, &tags[i].list) != -1)
+			tags[i++].name = list->name;
+		else
+			free(list->name);
+		free(list);
+	}
+	if (tags == NULL && nb_tags != 0) {
+		nb_tags = 0;
+		return -1;
+	}
+	nb_tags = i;
+	return 0;
+}
+
+/* bucket the tags by article, in the order of the tags */
+static int
+load_postings(void)
+{
+	unsigned long i, j, nb;
+	long a;
+
+	if ((first = calloc(articles.nb + 1, sizeof(unsigned long))) == NULL) {
+		warn("calloc");
+		return -1;
+	}
+	for (nb = 0, i = 0; i < nb_tags; ++i)
+		for (j = 0; j < tags[i].list.nb; ++j)
+			if ((a = find_article(tags[i].list.names[j])) != -1) {
+				++first[a+1];
+				++nb;
+			}
+	for (i = 0; i < articles.nb; ++i)
+		first[i+1] += first[i];
+	if (nb != 0 && (postings = calloc(nb, sizeof(struct posting)))
+	    == NULL) {
+		warn("calloc");
+		return -1;
+	}
+	for (i = 0; i < nb_tags; ++i)
+		for (j = 0; j < tags[i].list.nb; ++j)
+			if ((a = find_article(tags[i].list.names[j])) != -1) {
+				postings[first[a]].tag = i;
+				postings[first[a]++].number = j+1;
+			}
+	/* first[i] was moved to the end of the tags of article i */
+	for (i = articles.nb; i > 0; --i)
+		first[i] = first[i-1];
+	first[0] = 0;
+	return 0;
+}
+
+static int
+load_comments(void)
+{
+	unsigned long i;
+	struct site_comments *c;
+
+	if (articles.nb != 0 && (comments = calloc(articles.nb,
+	    sizeof(struct site_comments))) == NULL) {
+		warn("calloc");
+		return -1;
+	}
+	for (i = 0; i < articles.nb; ++i) {
+		c = &comments[i];
+		c->writable = are_comments_writable(articles.names[i]);
+		c->readable = are_comments_readable(articles.names[i]);
+		c->nb = c->readable ?
+		    read_comments(articles.names[i], NULL, NULL) : 0;
+	}
+	return 0;
+}
+
+int
+site_load(void)
+{
+	site_free();
+	if (list_articles(NULL, &articles) == -1)
+		return -1;
+	if (load_tags() == -1 || load_postings() == -1
+	    || load_comments() == -1) {
+		site_free();
+		return -1;
+	}
+	loaded = 1;
+	return 0;
+}
+
+void
+site_free(void)
+{
+	unsigned long i;
+
+	if (articles.names != NULL)
+		free_article_list(&articles);
+	articles.names = NULL;
+	articles.nb = 0;
+	for (i = 0; i < nb_tags; ++i) {
+		free(tags[i].name);
+		free_article_list(&tags[i].list);
+	}
+	free(tags);
+	tags = NULL;
+	nb_tags = 0;
+	free(first);
+	first = NULL;
+	free(postings);
+	postings = NULL;
+	free(comments);
+	comments = NULL;
+	loaded = 0;
+}
+
+/* the list of the index or of a tag, which must not be freed */
+int
+site_list(const char *tag, struct article_list *list)
+{
+	long t;
+
+	if (!loaded || is_tag_combination(tag))
+		return -1;
+	if (tag == NULL) {
+		*list = articles;
+		return 0;
+	}
+	if ((t = find_tag(tag)) == -1) {
+		list->names = NULL;
+		list->nb = 0;
+	} else
+		*list = tags[t].list;
+	return 0;
+}
+
+static struct article_tag *
+new_tag(const char *name, unsigned long number, struct article_tag *next)
+{
+	struct article_tag *at;
+
+	if ((at = malloc(sizeof(struct article_tag))) == NULL) {
+		warn("malloc");
+		return next;
+	}
+	at->name = NULL;
+	if (name != NULL && (at->name = strdup(name)) == NULL) {
+		warn("strdup");
+		free(at);
+		return next;
+	}
+	at->number = number;
+	SLIST_NEXT(at, next) = next;
+	return at;
+}
+
+/*
+ * Same list as get_article_tags(): the index first, then the tags of the
+ * article in order, or all the tags if article is NULL.
+ */
+int
+site_article_tags(const char *article, struct article_tag **list)
+{
+	unsigned long i;
+	long a;
+
+	if (!loaded)
+		return -1;
+	*list = NULL;
+	if (article == NULL) {
+		for (i = nb_tags; i > 0; --i)
+			*list = new_tag(tags[i-1].name, 0, *list);
+		return 0;
+	}
+	if ((a = find_article(article)) == -1)
+		return 0;
+	for (i = first[a+1]; i > first[a]; --i)
+		*list = new_tag(tags[postings[i-1].tag].name,
+		    postings[i-1].number, *list);
+	*list = new_tag(NULL, a+1, *list);
+	return 0;
+}
+
+int
+site_comments(const char *article, unsigned long *nb, int *readable,
+    int *writable)
+{
+	long a;
+
+	if (!loaded || (a = find_article(article)) == -1)
+		return -1;
+	if (nb != NULL)
+		*nb = comments[a].nb;
+	if (readable != NULL)
+		*readable = comments[a].readable;
+	if (writable != NULL)
+		*writable = comments[a].writable;
+	return 0;
+}
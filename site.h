@@ -0,0 +1,14 @@
+/* $Id$ */
+
+#ifndef SITE_H
+#define SITE_H
+
+#include "articles.h"
+
+int	site_load(void);
+void	site_free(void);
+int	site_list(const char *, struct article_list *);
+int	site_article_tags(const char *, struct article_tag **);
+int	site_comments(const char *, unsigned long *, int *, int *);
+
+#endif
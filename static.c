@@ -27,29 +27,35 @@
 #include "common.h"
 #include "output.h"
 #include "articles.h"
+#include "search.h"
+#include "site.h"
 
-void render_page_article(struct article *);
-void render_page_tag(struct tag *);
-void render_page_tags(void);
-void render_rss(struct tag *);
+void render_page_article(struct article *, struct render *);
+void render_page_tag(struct tag *, struct render *);
+void render_page_tags(struct render *);
+void render_page_archive(struct tag *, struct render *);
+void render_rss(struct tag *, struct render *);
+
+/* the static files are generated one after the other */
+static struct render sr;
 
 static void
-write_article_file(struct article *a)
+write_article_file(struct article *a, void *data)
 {
 	char path[MAXPATHLEN];
 	struct stat sb;
-	extern FILE *hout;
 	extern enum STATUS status;
 
+	(void)data;
 	snprintf(path, MAXPATHLEN, "%s" BASE_DIR "/%s.html",
 	    status & STATUS_FROMCMD ? CHROOT_DIR : "", a->name);
 	if (status & STATUS_FROMCMD)
 		fprintf(stderr, "Writing %s...\n", path);
-	if ((hout = fopen(path, "w")) == NULL)
+	if ((sr.out = fopen(path, "w")) == NULL)
 		warn("fopen: %s", path);
 	else {
-		render_page_article(a);
-		fclose(hout);
+		render_page_article(a, &sr);
+		fclose(sr.out);
 		if (stat(path, &sb) != -1 && sb.st_size == 0)
 			unlink(path);
 	}
@@ -61,7 +67,6 @@ write_tag_file(const char *tag, unsigned long page)
 	char path[MAXPATHLEN];
 	struct stat sb;
 	char page_str[20];
-	extern FILE *hout;
 	extern enum STATUS status;
 
 	snprintf(page_str, sizeof(page_str), "%lu", page);
@@ -71,11 +76,37 @@ write_tag_file(const char *tag, unsigned long page)
 	    page != 0 ? "-" : "", page != 0 ? page_str : "");
 	if (status & STATUS_FROMCMD)
 		fprintf(stderr, "Writing %s...\n", path);
-	if ((hout = fopen(path, "w")) == NULL)
+	if ((sr.out = fopen(path, "w")) == NULL)
 		warn("fopen: %s", path);
 	else {
-		read_tag(tag, page, NB_ARTICLES, render_page_tag);
-		fclose(hout);
+		read_tag(tag, page, NB_ARTICLES, (tag_cb *)render_page_tag,
+		    &sr);
+		fclose(sr.out);
+		if (stat(path, &sb) != -1 && sb.st_size == 0)
+			unlink(path);
+	}
+}
+
+static void
+write_archive_file(const char *period, unsigned long page)
+{
+	char path[MAXPATHLEN];
+	struct stat sb;
+	char page_str[20];
+	extern enum STATUS status;
+
+	snprintf(page_str, sizeof(page_str), "%lu", page);
+	snprintf(path, MAXPATHLEN, "%s" BASE_DIR "/archive_%s%s%s.html",
+	    status & STATUS_FROMCMD ? CHROOT_DIR : "", period,
+	    page != 0 ? "-" : "", page != 0 ? page_str : "");
+	if (status & STATUS_FROMCMD)
+		fprintf(stderr, "Writing %s...\n", path);
+	if ((sr.out = fopen(path, "w")) == NULL)
+		warn("fopen: %s", path);
+	else {
+		read_archive(period, page, NB_ARTICLES,
+		    (tag_cb *)render_page_archive, &sr);
+		fclose(sr.out);
 		if (stat(path, &sb) != -1 && sb.st_size == 0)
 			unlink(path);
 	}
@@ -86,18 +117,17 @@ write_tags_file(void)
 {
 	char path[MAXPATHLEN];
 	struct stat sb;
-	extern FILE *hout;
 	extern enum STATUS status;
 	
 	snprintf(path, MAXPATHLEN, "%s" BASE_DIR "/tags.html",
 	    status & STATUS_FROMCMD ? CHROOT_DIR : "");
 	if (status & STATUS_FROMCMD)
 		fprintf(stderr, "Writing %s...\n", path);
-	if ((hout = fopen(path, "w")) == NULL)
+	if ((sr.out = fopen(path, "w")) == NULL)
 		warn("fopen: %s", path);
 	else {
-		render_page_tags();
-		fclose(hout);
+		render_page_tags(&sr);
+		fclose(sr.out);
 		if (stat(path, &sb) != -1 && sb.st_size == 0)
 			unlink(path);
 	}
@@ -108,7 +138,6 @@ write_rss_file(const char *tag)
 {
 	char path[MAXPATHLEN];
 	struct stat sb;
-	extern FILE *hout;
 	extern enum STATUS status;
 
 	snprintf(path, MAXPATHLEN, "%s" BASE_DIR "/rss%s%s.xml",
@@ -116,24 +145,56 @@ write_rss_file(const char *tag)
 	    tag != NULL ? "_" : "", tag != NULL ? tag : "");
 	if (status & STATUS_FROMCMD)
 		fprintf(stderr, "Writing %s...\n", path);
-	if ((hout = fopen(path, "w")) == NULL)
+	if ((sr.out = fopen(path, "w")) == NULL)
 		warn("fopen: %s", path);
 	else {
-		read_tag(tag, 0, NB_ARTICLES, render_rss);
-		fclose(hout);
+		read_tag(tag, 0, NB_ARTICLES, (tag_cb *)render_rss, &sr);
+		fclose(sr.out);
 		if (stat(path, &sb) != -1 && sb.st_size == 0)
 			unlink(path);
 	}
 }
 
+/* number of articles of a period (YYYY or YYYYMM) */
+static unsigned long
+archive_number(const char *period)
+{
+	struct archive *archives;
+	unsigned long nb_archives, i, nb;
+
+	archives = get_archives(&nb_archives);
+	for (i = 0, nb = 0; i < nb_archives; ++i)
+		if (strncmp(archives[i].period, period, strlen(period)) == 0)
+			nb += archives[i].number;
+	free(archives);
+	return nb;
+}
+
 static void
-generate_article(struct article *a)
+generate_archive(const char *period, unsigned long nb_articles)
+{
+	unsigned long pages, p;
+
+	pages = nb_articles/NB_ARTICLES
+	    + (nb_articles%NB_ARTICLES != 0 ? 1 : 0);
+	for (p = 0; p < pages; ++p)
+		write_archive_file(period, p);
+}
+
+static void
+generate_article(struct article *a, void *data)
 {
 	struct article_tag *at;
 	unsigned long page;
+	char period[ARCHIVE_LEN];
 
-	write_article_file(a);
-	SLIST_FOREACH(at, &a->tags, next) {
+	write_article_file(a, data);
+	/* the pages of the periods move with each article */
+	strlcpy(period, a->name, sizeof(period));
+	generate_archive(period, archive_number(period));
+	period[4] = '\0';
+	generate_archive(period, archive_number(period));
+	SLIST_FOREACH(at, article_tags(a), next) {
 		page = at->number/NB_ARTICLES
 		    + (at->number%NB_ARTICLES != 0 ? 1 : 0) - 1;
 		write_tag_file(at->name, page);
@@ -142,30 +203,27 @@ generate_article(struct article *a)
 	}
 }
 
+static void
+generate_tag(const char *tag, unsigned long nb_articles)
+{
+	unsigned long pages, p;
+
+	pages = nb_articles/NB_ARTICLES
+	    + (nb_articles%NB_ARTICLES != 0 ? 1 : 0);
+	for (p = 0; p < pages; ++p)
+		write_tag_file(tag, p);
+}
+
 static void
 generate_tags(void)
 {
-	SLIST_HEAD(, article_tag) list;
-	struct article_tag tmp, *at;
-	unsigned long nb_articles, pages, p;
+	struct tag_count *counts;
+	unsigned long nb_counts, i;
 
-	SLIST_FIRST(&list) = get_article_tags(NULL);
-	tmp.name = NULL;
-	SLIST_INSERT_HEAD(&list, &tmp, next);
-	SLIST_FOREACH(at, &list, next) {
-		nb_articles = read_articles(at->name, 0, 0, NULL);
-		pages = nb_articles/NB_ARTICLES
-		    + (nb_articles%NB_ARTICLES != 0 ? 1 : 0);
-		for (p = 0; p < pages; ++p)
-			write_tag_file(at->name, p);
-	}
-	SLIST_REMOVE_HEAD(&list, next);
-	while (!SLIST_EMPTY(&list)) {
-		at = SLIST_FIRST(&list);
-		SLIST_REMOVE_HEAD(&list, next);
-		free(at->name);
-		free(at);
-	}
+	counts = get_tag_counts(&nb_counts);
+	for (i = 0; i < nb_counts; ++i)
+		generate_tag(counts[i].name, counts[i].number);
+	free(counts);
 	write_tags_file();
 }
 
@@ -189,32 +247,80 @@ generate_rss(void)
 	}
 }
 
+static void
+generate_archives(void)
+{
+	struct archive *archives;
+	unsigned long nb_archives, i;
+	char year[5];
+
+	archives = get_archives(&nb_archives);
+	for (i = 0; i < nb_archives; ++i) {
+		if (i == 0 || strncmp(archives[i].period,
+		    archives[i-1].period, 4) != 0) {
+			strlcpy(year, archives[i].period, sizeof(year));
+			generate_archive(year, archive_number(year));
+		}
+		generate_archive(archives[i].period, archives[i].number);
+	}
+	free(archives);
+}
+
 void
 generate_static(const char *cmd)
 {
-	FILE *old_f;
 	mode_t old_mask;
-	extern FILE *hout;
-	extern enum STATUS status;
 
-	status |= STATUS_STATIC;
-	old_f = hout;
+	render_init(&sr, stdout);
+	sr.status |= STATUS_STATIC;
 	old_mask = umask(0002);
+	/* the pages of the lists are rendered from the model of the site */
+	if (strcmp(cmd, "all") == 0 || strcmp(cmd, "tags") == 0
+	    || strcmp(cmd, "archives") == 0 || strcmp(cmd, "rss") == 0
+	    || strcmp(cmd, "articles") == 0)
+		site_load();
 	if (strcmp(cmd, "all") == 0) {
 		generate_tags();
-		read_articles(NULL, 0, 0, write_article_file);
+		read_articles(NULL, 0, 0, write_article_file, NULL);
+		generate_archives();
 		generate_rss();
+		build_search_index();
 	} else if (strcmp(cmd, "tags") == 0)
 		generate_tags();
+	else if (strcmp(cmd, "archives") == 0)
+		generate_archives();
+	else if (strcmp(cmd, "index") == 0)
+		build_search_index();
 	else if (strcmp(cmd, "rss") == 0)
 		generate_rss();
 	else if (strcmp(cmd, "articles") == 0)
-		read_articles(NULL, 0, 0, write_article_file);
+		read_articles(NULL, 0, 0, write_article_file, NULL);
 	else if (is_article_name(cmd, strlen(cmd))) {
-		read_article(cmd, generate_article);
+		read_article(cmd, generate_article, NULL);
 	} else
-		document_not_found();
-	status ^= STATUS_STATIC;
-	hout = old_f;
+		document_not_found(&sr);
+	site_free();
+	umask(old_mask);
+}
+
+/* the pages and the feed of a tag, and the tag cloud */
+void
+generate_static_tag(const char *tag)
+{
+	struct tag_count *counts;
+	unsigned long nb_counts, i;
+	mode_t old_mask;
+
+	render_init(&sr, stdout);
+	sr.status |= STATUS_STATIC;
+	old_mask = umask(0002);
+	counts = get_tag_counts(&nb_counts);
+	for (i = 0; i < nb_counts; ++i)
+		if (tag == NULL ? counts[i].name == NULL
+		    : counts[i].name != NULL && strcmp(counts[i].name, tag) == 0)
+			generate_tag(tag, counts[i].number);
+	free(counts);
+	write_rss_file(tag);
+	write_tags_file();
 	umask(old_mask);
 }
@@ -0,0 +1,156 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2009 Colin Didier <cdidier@cybione.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "timing.h"
+
+/* maximum nesting of the stages, the deeper ones are ignored */
+#define TIMING_DEPTH	16
+
+int			timing_enabled = 0;
+unsigned long long	timing_counters[COUNTER_MAX];
+
+static const char *stage_names[STAGE_MAX] = {
+	"other", "list", "article", "tags", "comments", "search", "template",
+	"gzip"
+};
+static const char *counter_names[COUNTER_MAX] = {
+	"opens", "dirents", "bytes"
+};
+
+static double stage_times[STAGE_MAX];
+static enum STAGE stack[TIMING_DEPTH];
+static int depth, overflow;
+static double start, last;
+/* time to the first byte of the body, of the requests since the start */
+static double request, first_byte;
+static int first_byte_sent;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+timing_start(void)
+{
+	memset(stage_times, 0, sizeof(stage_times));
+	memset(timing_counters, 0, sizeof(timing_counters));
+	depth = overflow = 0;
+	stack[0] = STAGE_OTHER;
+	start = last = request = now();
+	first_byte = 0;
+	first_byte_sent = 0;
+	timing_enabled = 1;
+}
+
+/* another request is rendered by the process (-B) */
+void
+timing_request(void)
+{
+	request = now();
+	first_byte_sent = 0;
+}
+
+/* the elapsed time goes to the stage on the top of the stack */
+void
+timing_begin(enum STAGE s)
+{
+	double t;
+
+	if (depth == TIMING_DEPTH - 1) {
+		++overflow;
+		return;
+	}
+	t = now();
+	stage_times[stack[depth]] += t - last;
+	last = t;
+	stack[++depth] = s;
+}
+
+void
+timing_end(enum STAGE s)
+{
+	double t;
+
+	if (overflow > 0) {
+		--overflow;
+		return;
+	}
+	if (depth == 0 || stack[depth] != s)
+		return;
+	t = now();
+	stage_times[s] += t - last;
+	last = t;
+	--depth;
+}
+
+/* the body of the page starts to be sent to the client */
+void
+timing_first_byte(void)
+{
+	if (first_byte_sent)
+		return;
+	first_byte += now() - request;
+	first_byte_sent = 1;
+}
+
+/* Server-Timing header, durations in milliseconds */
+void
+timing_header(FILE *f)
+{
+	int i;
+
+	fprintf(f, "Server-Timing: total;dur=%.3f", (now() - start) * 1e3);
+	if (first_byte_sent)
+		fprintf(f, ", ttfb;dur=%.3f", first_byte * 1e3);
+	for (i = 0; i < STAGE_MAX; ++i)
+		if (stage_times[i] > 0)
+			fprintf(f, ", %s;dur=%.3f", stage_names[i],
+			    stage_times[i] * 1e3);
+	for (i = 0; i < COUNTER_MAX; ++i)
+		fprintf(f, ", %s;desc=%llu", counter_names[i],
+		    timing_counters[i]);
+	fputs("\r\n", f);
+}
+
+/* one line of key=value on stderr, the mean of several runs */
+void
+timing_report(const char *request, unsigned long runs)
+{
+	int i;
+
+	fprintf(stderr, "timing request=\"%s\" runs=%lu total_ms=%.3f",
+	    request != NULL ? request : "", runs,
+	    (now() - start) * 1e3 / runs);
+	fprintf(stderr, " ttfb_ms=%.3f", first_byte * 1e3 / runs);
+	for (i = 0; i < STAGE_MAX; ++i)
+		fprintf(stderr, " %s_ms=%.3f", stage_names[i],
+		    stage_times[i] * 1e3 / runs);
+	for (i = 0; i < COUNTER_MAX; ++i)
+		fprintf(stderr, " %s=%llu", counter_names[i],
+		    timing_counters[i] / runs);
+	fputc('\n', stderr);
+}
@@ -0,0 +1,56 @@
+/* $Id$ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdio.h>
+
+/* the time of a stage excludes the time of the stages nested in it */
+enum STAGE {
+	STAGE_OTHER,
+	STAGE_LIST,		/* reading the directories */
+	STAGE_ARTICLE,		/* opening the articles */
+	STAGE_TAGS,		/* get_article_tags() */
+	STAGE_COMMENTS,		/* parsing the comments */
+	STAGE_SEARCH,
+	STAGE_TEMPLATE,		/* parsing the templates and formatting */
+	STAGE_GZIP,
+	STAGE_MAX
+};
+
+enum COUNTER {
+	COUNTER_OPENS,		/* files and directories opened */
+	COUNTER_DIRENTS,	/* directory entries visited */
+	COUNTER_BYTES,		/* bytes emitted, before compression */
+	COUNTER_MAX
+};
+
+extern int			timing_enabled;
+extern unsigned long long	timing_counters[COUNTER_MAX];
+
+#define TIMING_BEGIN(s)		do {					\
+	if (timing_enabled)						\
+		timing_begin(s);					\
+} while (0)
+#define TIMING_END(s)		do {					\
+	if (timing_enabled)						\
+		timing_end(s);						\
+} while (0)
+#define TIMING_COUNT(c, n)	do {					\
+	if (timing_enabled)						\
+		timing_counters[c] += (n);				\
+} while (0)
+#define TIMING_FIRST_BYTE()	do {					\
+	if (timing_enabled)						\
+		timing_first_byte();					\
+} while (0)
+
+void	timing_start(void);
+void	timing_request(void);
+void	timing_begin(enum STAGE);
+void	timing_end(enum STAGE);
+void	timing_first_byte(void);
+void	timing_header(FILE *);
+void	timing_report(const char *, unsigned long);
+
+#endif
@@ -21,6 +21,7 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "config.h"
 #include "antispam.h"
@@ -41,6 +42,8 @@ strchomp(char *s)
 {
 	size_t len, i, spaces;
 
+	if (s == NULL)
+		return;
 	len = strlen(s);
 	/* remove spaces at the end of the string */
 	while (len > 0 && isspace(s[len-1]))
@@ -103,7 +106,7 @@ parse_timezone_rfc822(const char *tz)
 time_t
 rfc822_date(char *date)
 {
-	struct tm tm, *lt;
+	struct tm tm, lt;
 	time_t now;
 	char *p;
 	int i;
@@ -124,8 +127,64 @@ rfc822_date(char *date)
 	tm.tm_gmtoff = offset = *p != '\0' ? parse_timezone_rfc822(p) : 0;
 	/* get the current time to convert to the local timezone */
 	time(&now);
-	lt = localtime(&now);
-	return mktime(&tm) - offset + lt->tm_gmtoff;
+	localtime_r(&now, &lt);
+	return mktime(&tm) - offset + lt.tm_gmtoff;
+}
+
+/*
+ * Same output as strftime(buf, len, "%a, %d %b %Y %R %z", tm) in the C
+ * locale, without the format string parsing. The RSS feeds print one of
+ * these per item.
+ */
+size_t
+rfc822_format(const struct tm *tm, char *buf, size_t len)
+{
+	static const char days[] = "SunMonTueWedThuFriSat";
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	char *p;
+	long off;
+	int year;
+
+	/* "Ddd, DD Mmm YYYY HH:MM +hhmm" */
+	if (len < 29 || tm->tm_wday < 0 || tm->tm_wday > 6 || tm->tm_mon < 0
+	    || tm->tm_mon > 11 || tm->tm_year + 1900 < 0
+	    || tm->tm_year + 1900 > 9999)
+		return strftime(buf, len, "%a, %d %b %Y %R %z", tm);
+	p = buf;
+	memcpy(p, days + tm->tm_wday*3, 3);
+	p += 3;
+	*p++ = ',';
+	*p++ = ' ';
+	*p++ = '0' + tm->tm_mday/10;
+	*p++ = '0' + tm->tm_mday%10;
+	*p++ = ' ';
+	memcpy(p, months + tm->tm_mon*3, 3);
+	p += 3;
+	*p++ = ' ';
+	year = tm->tm_year + 1900;
+	*p++ = '0' + year/1000;
+	*p++ = '0' + year/100%10;
+	*p++ = '0' + year/10%10;
+	*p++ = '0' + year%10;
+	*p++ = ' ';
+	*p++ = '0' + tm->tm_hour/10;
+	*p++ = '0' + tm->tm_hour%10;
+	*p++ = ':';
+	*p++ = '0' + tm->tm_min/10;
+	*p++ = '0' + tm->tm_min%10;
+	*p++ = ' ';
+	off = tm->tm_gmtoff/60;
+	if (off < 0) {
+		*p++ = '-';
+		off = -off;
+	} else
+		*p++ = '+';
+	*p++ = '0' + off/600%10;
+	*p++ = '0' + off/60%10;
+	*p++ = '0' + off%60/10;
+	*p++ = '0' + off%10;
+	*p = '\0';
+	return p - buf;
 }
 
 struct antispam *
@@ -134,18 +193,20 @@ antispam_generate(const char *additional_salt)
 	struct antispam *as;
 	char *data;
 	size_t len;
+	unsigned int seed;
 	
 	assert(additional_salt != NULL);
-	srand(time(NULL));
+	/* not the state of rand(), shared by the threads */
+	seed = time(NULL);
 	len = sizeof(ANTISPAM_JAM_SALT) + strlen(additional_salt) + 1;
 	if ((data = malloc(len)) == NULL
 	    || (as = malloc(sizeof(struct antispam))) == NULL) {
 		warnx("malloc");
 		return NULL;
 	}
-	as->jam1 = rand()%(ANTISPAM_JAM_MAX-ANTISPAM_JAM_MIN+1)
+	as->jam1 = rand_r(&seed)%(ANTISPAM_JAM_MAX-ANTISPAM_JAM_MIN+1)
 	    + ANTISPAM_JAM_MIN;
-	as->jam2 = rand()%(ANTISPAM_JAM_MAX-ANTISPAM_JAM_MIN+1)
+	as->jam2 = rand_r(&seed)%(ANTISPAM_JAM_MAX-ANTISPAM_JAM_MIN+1)
 	    + ANTISPAM_JAM_MIN;
 	strlcpy(data+1, ANTISPAM_JAM_SALT, len-1);
 	strlcpy(data+sizeof(ANTISPAM_JAM_SALT), additional_salt,
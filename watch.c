@@ -0,0 +1,419 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2009 Colin Didier <cdidier@cybione.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Keep the static pages up to date: the directories of the articles, of the
+ * tags and of the templates are watched with inotify(7). The events are
+ * turned into the targets of generate_static() (an article, "rss"...), which
+ * are run once no event came for WATCH_DELAY milliseconds.
+ */
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "common.h"
+#include "articles.h"
+#include "pack.h"
+
+/* quiet time before regenerating, and longest wait after an event */
+#define WATCH_DELAY	200
+#define WATCH_MAX_DELAY	2000
+
+#define DIR_EVENTS	(IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO)
+#define FILE_EVENTS	(DIR_EVENTS|IN_CLOSE_WRITE)
+/* are_comments_writable() closes the comments for writing at each render */
+#define ARTICLE_EVENTS	(DIR_EVENTS|IN_CLOSE_WRITE|IN_MODIFY)
+
+/* the years and the months above the articles */
+#ifdef ARTICLES_SHARDED
+#define SHARD_DEPTH	2
+#else
+#define SHARD_DEPTH	0
+#endif
+
+void	generate_static(const char *);
+void	generate_static_tag(const char *);
+
+enum WATCH {
+	WATCH_NONE = 0,
+	WATCH_SHARD,			/* ARTICLES_DIR or a year */
+	WATCH_ARTICLES,
+	WATCH_ARTICLE,
+	WATCH_TAGS,
+	WATCH_TAG,
+	WATCH_TEMPLATES
+};
+
+struct watch {
+	enum WATCH	 type;
+	char		*name;		/* of the article, the tag or the shard */
+};
+
+enum TARGET {
+	TARGET_STATIC,			/* a command of generate_static() */
+	TARGET_TAG			/* "" for the main list */
+};
+
+struct target {
+	SLIST_ENTRY(target) next;
+	enum TARGET	 type;
+	char		*name;
+};
+
+#ifdef __linux__
+static struct watch *watches = NULL;	/* indexed by descriptor */
+static int nb_watches = 0;
+static SLIST_HEAD(, target) targets = SLIST_HEAD_INITIALIZER(targets);
+static unsigned long nb_targets = 0, nb_events = 0;
+static double first = 0;		/* event which queued the first target */
+static int queued;
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void
+queue(enum TARGET type, const char *name)
+{
+	struct target *t;
+
+	queued = 1;
+	SLIST_FOREACH(t, &targets, next)
+		if (t->type == type && strcmp(t->name, name) == 0)
+			return;
+	if (SLIST_EMPTY(&targets))
+		first = now_ms();
+	if ((t = malloc(sizeof(struct target))) == NULL
+	    || (t->name = strdup(name)) == NULL)
+		err(1, NULL);
+	t->type = type;
+	SLIST_INSERT_HEAD(&targets, t, next);
+	++nb_targets;
+}
+
+/* the lists where an article appears: the main one and those of its tags */
+static void
+queue_lists(const char *article)
+{
+	struct article_tag *at, *next;
+
+	for (at = get_article_tags(article); at != NULL; at = next) {
+		next = SLIST_NEXT(at, next);
+		queue(TARGET_TAG, at->name != NULL ? at->name : "");
+		free(at->name);
+		free(at);
+	}
+}
+
+/* the lists where the articles move when one is added or deleted */
+static void
+queue_index(void)
+{
+	queue(TARGET_STATIC, "tags");
+	queue(TARGET_STATIC, "archives");
+	queue(TARGET_STATIC, "rss");
+	queue(TARGET_STATIC, "index");
+}
+
+/* the pages of the articles, the lists, the archives and the feeds */
+static void
+queue_all(void)
+{
+	queue(TARGET_STATIC, "tags");
+	queue(TARGET_STATIC, "articles");
+	queue(TARGET_STATIC, "archives");
+	queue(TARGET_STATIC, "rss");
+}
+
+static void
+add_watch(int fd, const char *path, uint32_t mask, enum WATCH type,
+    const char *name)
+{
+	int wd;
+
+	if ((wd = inotify_add_watch(fd, path, mask)) == -1) {
+		warn("inotify_add_watch: %s", path);
+		return;
+	}
+	if (wd >= nb_watches) {
+		if ((watches = realloc(watches,
+		    (wd + 64) * sizeof(struct watch))) == NULL)
+			err(1, NULL);
+		memset(watches + nb_watches, 0,
+		    (wd + 64 - nb_watches) * sizeof(struct watch));
+		nb_watches = wd + 64;
+	}
+	free(watches[wd].name);
+	watches[wd].type = type;
+	watches[wd].name = name != NULL ? strdup(name) : NULL;
+}
+
+/* the directories of the articles or of the tags */
+static void
+add_watches(int fd, const char *dir, enum WATCH type)
+{
+	char path[MAXPATHLEN];
+	struct dirent *e;
+	DIR *d;
+
+	if ((d = opendir(dir)) == NULL) {
+		warn("opendir: %s", dir);
+		return;
+	}
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.')
+			continue;
+		if (type == WATCH_ARTICLE
+		    && !is_article_name(e->d_name, strlen(e->d_name)))
+			continue;
+		snprintf(path, MAXPATHLEN, "%s/%s", dir, e->d_name);
+		add_watch(fd, path, (type == WATCH_ARTICLE ? ARTICLE_EVENTS
+		    : FILE_EVENTS)|IN_ONLYDIR, type, e->d_name);
+	}
+	closedir(d);
+}
+
+/* the articles, below their years and months with ARTICLES_SHARDED */
+static void
+add_article_watches(int fd, const char *dir, int depth)
+{
+	char path[MAXPATHLEN];
+	struct dirent *e;
+	size_t len;
+	DIR *d;
+
+	if (depth < SHARD_DEPTH) {
+		add_watch(fd, dir, DIR_EVENTS|IN_ONLYDIR, WATCH_SHARD, dir);
+		if ((d = opendir(dir)) == NULL) {
+			warn("opendir: %s", dir);
+			return;
+		}
+		len = depth == 0 ? 4 : 2;
+		while ((e = readdir(d)) != NULL) {
+			if (strlen(e->d_name) != len
+			    || strspn(e->d_name, "0123456789") != len)
+				continue;
+			snprintf(path, MAXPATHLEN, "%s/%s", dir, e->d_name);
+			add_article_watches(fd, path, depth + 1);
+		}
+		closedir(d);
+		return;
+	}
+	add_watch(fd, dir, DIR_EVENTS|IN_ONLYDIR, WATCH_ARTICLES, NULL);
+	add_watches(fd, dir, WATCH_ARTICLE);
+}
+
+static void
+handle_event(int fd, const struct inotify_event *ev)
+{
+	char path[MAXPATHLEN];
+	struct watch *w;
+	const char *name;
+	int depth;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		queue_all();
+		return;
+	}
+	if (ev->wd < 0 || ev->wd >= nb_watches)
+		return;
+	w = &watches[ev->wd];
+	if (ev->mask & IN_IGNORED) {
+		free(w->name);
+		w->name = NULL;
+		w->type = WATCH_NONE;
+		return;
+	}
+	name = ev->len > 0 ? ev->name : "";
+	if (name[0] == '.')
+		return;
+	switch (w->type) {
+	case WATCH_ARTICLES:
+		if (!(ev->mask & IN_ISDIR)
+		    || !is_article_name(name, strlen(name)))
+			break;
+		if (ev->mask & (IN_CREATE|IN_MOVED_TO)) {
+			article_path(path, name, NULL);
+			add_watch(fd, path, ARTICLE_EVENTS|IN_ONLYDIR,
+			    WATCH_ARTICLE, name);
+			queue(TARGET_STATIC, name);
+		}
+		/* the pages move from a list to the next */
+		queue_index();
+		break;
+	case WATCH_SHARD:
+		if (!(ev->mask & IN_ISDIR))
+			break;
+		if (ev->mask & (IN_CREATE|IN_MOVED_TO)) {
+			depth = strcmp(w->name, CHROOT_DIR ARTICLES_DIR) == 0 ?
+			    1 : 2;
+			snprintf(path, MAXPATHLEN, "%s/%s", w->name, name);
+			add_article_watches(fd, path, depth);
+		}
+		queue_index();
+		break;
+	case WATCH_ARTICLE:
+		if (strcmp(name, "comments") == 0) {
+			if (!(ev->mask & IN_CLOSE_WRITE))
+				queue(TARGET_STATIC, w->name);
+		} else if (ev->mask & IN_MODIFY)
+			break;
+		else if (strcmp(name, "article") == 0
+		    || strcmp(name, "more") == 0) {
+			queue(TARGET_STATIC, w->name);
+			queue(TARGET_STATIC, "index");
+			queue_lists(w->name);
+		}
+		break;
+	case WATCH_TAGS:
+		if (!(ev->mask & IN_ISDIR))
+			break;
+		if (ev->mask & (IN_CREATE|IN_MOVED_TO)) {
+			snprintf(path, MAXPATHLEN, CHROOT_DIR TAGS_DIR "/%s",
+			    name);
+			add_watch(fd, path, FILE_EVENTS|IN_ONLYDIR, WATCH_TAG,
+			    name);
+		}
+		queue(TARGET_TAG, name);
+		break;
+	case WATCH_TAG:
+		/* an article tagged or untagged, its page shows the tags */
+		queue(TARGET_TAG, w->name);
+		if (is_article_name(name, strlen(name)))
+			queue(TARGET_STATIC, name);
+		break;
+	case WATCH_TEMPLATES:
+		queue_all();
+		break;
+	case WATCH_NONE:
+		break;
+	}
+}
+
+static void
+regenerate(void)
+{
+	struct target *t;
+	unsigned long depth;
+	double begin;
+
+	depth = nb_targets;
+	begin = now_ms();
+	/* the pack would hide the changes of the articles */
+	if (is_packed())
+		build_pack();
+	while ((t = SLIST_FIRST(&targets)) != NULL) {
+		SLIST_REMOVE_HEAD(&targets, next);
+		if (t->type == TARGET_TAG)
+			generate_static_tag(t->name[0] != '\0' ? t->name
+			    : NULL);
+		else
+			generate_static(t->name);
+		free(t->name);
+		free(t);
+	}
+	nb_targets = 0;
+	fprintf(stderr, "watch: %lu events, %lu targets queued, regenerated "
+	    "in %.1f ms, %.1f ms after the first event\n", nb_events, depth,
+	    now_ms() - begin, now_ms() - first);
+	nb_events = 0;
+}
+
+void
+watch_static(void)
+{
+	char buf[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct pollfd pfd;
+	double last;
+	ssize_t len;
+	char *p;
+	int fd, timeout;
+
+	if ((fd = inotify_init()) == -1)
+		err(1, "inotify_init");
+	add_article_watches(fd, CHROOT_DIR ARTICLES_DIR, 0);
+	add_watch(fd, CHROOT_DIR TAGS_DIR, DIR_EVENTS|IN_ONLYDIR, WATCH_TAGS,
+	    NULL);
+	add_watches(fd, CHROOT_DIR TAGS_DIR, WATCH_TAG);
+	add_watch(fd, CHROOT_DIR TEMPLATES_DIR, FILE_EVENTS, WATCH_TEMPLATES,
+	    NULL);
+	fprintf(stderr, "watch: watching %s\n", CHROOT_DIR BASE_DIR);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	last = 0;
+	for (;;) {
+		timeout = -1;
+		if (!SLIST_EMPTY(&targets)) {
+			timeout = MIN(last + WATCH_DELAY,
+			    first + WATCH_MAX_DELAY) - now_ms();
+			if (timeout <= 0) {
+				regenerate();
+				continue;
+			}
+		}
+		if (poll(&pfd, 1, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		if (!(pfd.revents & POLLIN))
+			continue;
+		if ((len = read(fd, buf, sizeof(buf))) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "read");
+		}
+		for (p = buf; p < buf + len;
+		    p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			queued = 0;
+			handle_event(fd, ev);
+			if (queued) {
+				++nb_events;
+				last = now_ms();
+			}
+		}
+	}
+}
+#else
+void
+watch_static(void)
+{
+	errx(1, "-w needs inotify(7)");
+}
+#endif